@@ -3,6 +3,10 @@
 #include <algorithm>
 #include <string>
 
+// Tag of an activation, used by kernels that fuse the activation in
+enum class ActivationKind { Identity, ReLU };
+
+
 class ActivationFunction {
 
 public:
@@ -15,10 +19,12 @@ public:
     virtual float backward( float x ) = 0;
 
     virtual std::string desc() = 0;
+
+    virtual ActivationKind kind() = 0;
 };
 
 
-class Identity : public ActivationFunction {
+class Identity final : public ActivationFunction {
 
 public:
 
@@ -39,9 +45,13 @@ public:
     std::string desc() override {
         return "Id";
     }
+
+    ActivationKind kind() override {
+        return ActivationKind::Identity;
+    }
 };
 
-class RELU : public ActivationFunction {
+class RELU final : public ActivationFunction {
 
 public:
 
@@ -62,6 +72,20 @@ public:
     std::string desc() override {
         return "ReLU";
     }
+
+    ActivationKind kind() override {
+        return ActivationKind::ReLU;
+    }
 };
 
+// Spelling used by the compile-time layers (see static_model.hpp)
+using ReLU = RELU;
+
+
+inline ActivationFunction* get_activation( ActivationKind kind ) {
+    if ( kind == ActivationKind::ReLU ) {
+        return RELU::get_instance();
+    }
 
+    return Identity::get_instance();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "lingebra.hpp"
+#include "model.hpp"
+
+
+/*
+ * Per-machine tuning of the kernels.
+ *
+ * The best blocking and thread count of gemm() depend on the caches and
+ * cores of the machine and on the shapes, which are fixed by the net and
+ * the batch size. autotune() times the candidates for every gemm() shape of
+ * a training step (forward, derivatives of the inputs, weight gradients)
+ * and the task size of the split optimizer updates, and installs the
+ * winners in `gemm_tuning` and AdamOptimizer::task_size.
+ *
+ * Winners are kept in a text cache keyed by the CPU model and core count,
+ * one line per result:
+ *
+ *      <cpu> <tab> gemm <rows> <depth> <cols> <block rows> <block depth> <threads> <us>
+ *      <cpu> <tab> parallel_flops <flops>
+ *      <cpu> <tab> update_task_size <elements>
+ *
+ * Later runs on the same machine only read it, only shapes missing from the
+ * cache are timed. Lines of other machines are kept, so one cache can be
+ * shared. The parameters never change results, only the speed.
+ */
+
+struct GemmShape {
+    size_t rows, depth, cols;
+};
+
+
+struct TunedGemm {
+    GemmShape shape;
+    GemmParams params;
+
+    // Time of one call with `params`
+    double us;
+};
+
+
+// "model name" of /proc/cpuinfo and the number of cores
+std::string cpu_model();
+
+// gemm() shapes of a training step of `net` with batches of `batch`
+std::vector< GemmShape > gemm_shapes( const NeuralNet& net, size_t batch );
+
+// Fastest parameters for one shape
+TunedGemm tune_gemm( const GemmShape& shape );
+
+/*
+ * Load the tuning of this machine from `cache_path`, tune what is missing
+ * (everything if `retune`) and write the cache back if anything was tuned.
+ * Returns false if the cache could not be written, the tuning is installed
+ * anyway.
+ */
+bool autotune( const NeuralNet& net, size_t batch, const std::string& cache_path, bool retune = false );
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include "model.hpp"
+
+
+/*
+ * Confidence-gated cascade inference.
+ *
+ * A cheap model (e.g. a distilled student or a low-rank factorization)
+ * predicts every sample. Only samples where it is unsure, whose softmax
+ * margin (top probability minus the second) is below `threshold`, go on
+ * to the full model. Those are gathered into a compact batch, so the
+ * expensive GEMMs run on the hard subset only. With most inputs easy, the
+ * mean cost per sample is close to that of the cheap model.
+ *
+ * calibrate() picks the threshold on held-out samples: the lowest one at
+ * which the cascade is at most `max_drop` less accurate than the full
+ * model alone.
+ */
+
+// Top softmax probability minus the second one, per column of `logits`
+std::vector< float > softmax_margins( const Matrix& logits );
+
+
+class Cascade {
+
+    NeuralNet* _cheap;
+    NeuralNet* _full;
+    float _threshold;
+
+public:
+    // Both nets are switched to evaluation mode
+    Cascade( NeuralNet* cheap, NeuralNet* full, float threshold = 0.5f );
+
+    // Predictions of a batch (one sample per column), the number of
+    // samples the full model had to predict in `escalated` if given
+    std::vector< size_t > predict( ConstMatrixView batch, size_t* escalated = nullptr );
+
+    float calibrate( ConstMatrixView data, const std::vector< int >& labels, float max_drop );
+
+    float threshold() const;
+    void set_threshold( float threshold );
+};
+
+
+struct CascadeReport {
+    size_t samples = 0;
+    float threshold = 0.f;
+    float escalated = 0.f;
+
+    float accuracy = 0.f;
+    float cheap_accuracy = 0.f;
+    float full_accuracy = 0.f;
+
+    // Per sample, FLOPs of the GEMMs and biases, time in batches
+    double flops = 0.0;
+    double cheap_flops = 0.0;
+    double full_flops = 0.0;
+    double us = 0.0;
+    double full_us = 0.0;
+
+    void print() const;
+};
+
+
+// Run the cascade and both models alone over `data` in batches of `batch`
+CascadeReport evaluate_cascade( Cascade& cascade, NeuralNet& cheap, NeuralNet& full, ConstMatrixView data,
+                                const std::vector< int >& labels, size_t batch = 256 );
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "model.hpp"
+#include "statistics.hpp"
+
+
+/*
+ * Binary checkpoints of trained layers.
+ *
+ * A checkpoint is a list of layers, each with its activation, weights and
+ * (possibly empty) bias, in the order of the forward pass. Any model that can
+ * describe itself as a list of LayerParams can be saved / restored, so e.g. a
+ * NeuralNet checkpoint can be loaded into a StaticNeuralNet of the same shape.
+ *
+ * Layout (little endian): magic, layer count, then for every layer:
+ *      activation kind, rows, cols, has_bias, weights (column-major, packed),
+ *      bias (rows floats, only if has_bias)
+ * optionally followed by the normalization the net was trained with:
+ *      magic, feature count, means, scales
+ * Readers that do not ask for the normalization ignore it, a checkpoint
+ * without it loads with an empty one.
+ *
+ * Files are not trusted: unknown activations, empty or oversized layers and
+ * layers that do not chain are rejected before anything is allocated.
+ */
+
+struct LayerParams {
+    ActivationKind act;
+    Matrix weights;
+    Matrix bias;
+};
+
+
+// Copy parameters out of / into a network
+std::vector< LayerParams > layer_params( const NeuralNet& net );
+NeuralNet from_layer_params( std::vector< LayerParams >&& layers );
+
+// Return false (and report why) if the file cannot be written / read. An
+// empty normalization is not stored.
+bool write_checkpoint( const std::string& path, const std::vector< LayerParams >& layers,
+                       const Normalization& norm = Normalization() );
+bool read_checkpoint( const std::string& path, std::vector< LayerParams >& layers,
+                      Normalization* norm = nullptr );
+
+bool save_checkpoint( const NeuralNet& net, const std::string& path, const Normalization& norm = Normalization() );
+bool load_checkpoint( const std::string& path, NeuralNet& net, Normalization* norm = nullptr );
+
+// Size of the file save_checkpoint() writes for `net`
+size_t checkpoint_bytes( const NeuralNet& net, const Normalization& norm = Normalization() );
+
+
+/*
+ * Helpers for binary (de)serialization, also used by other file formats.
+ * Matrices are written column-major without their padding.
+ */
+template < typename T >
+void write_value( std::ofstream& f, T value ) {
+    f.write( reinterpret_cast< const char* >( &value ), sizeof( T ) );
+}
+
+template < typename T >
+T read_value( std::ifstream& f ) {
+    T value{};
+    f.read( reinterpret_cast< char* >( &value ), sizeof( T ) );
+    return value;
+}
+
+void write_matrix( std::ofstream& f, const Matrix& m );
+void read_matrix( std::ifstream& f, Matrix& m );
+
+// Bytes between the read position and the end of the file, sizes read from
+// a file are checked against it before anything is allocated
+size_t remaining_bytes( std::ifstream& f );
+
+// Whether `kind` read from a file is a known ActivationKind
+bool valid_activation( uint32_t kind );
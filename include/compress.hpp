@@ -0,0 +1,63 @@
+#pragma once
+
+#include "model.hpp"
+
+
+/*
+ * Post-training low-rank compression of linear layers.
+ *
+ * A m x n weight matrix W is replaced by B * A with A (k x n) and B (m x k),
+ * the best rank-k approximation of W. The layer becomes two thinner layers:
+ * an Identity layer without bias computing A * x followed by a layer with
+ * weights B and the original bias / activation. This pays off as soon as
+ * k * ( m + n ) < m * n.
+ *
+ * The factors come from the eigen decomposition of the smaller of W W^T and
+ * W^T W, its eigenvalues are the squared singular values of W.
+ */
+
+struct LowRankFactors {
+
+    // Orthonormal basis of the dominant singular subspace, ordered by
+    // decreasing singular value (columns of U if `left`, of V otherwise)
+    Matrix basis;
+    bool left;
+
+    std::vector< float > singular_values;
+};
+
+
+// Size / cost of a network for a single sample
+struct ModelCost {
+    size_t flops;
+    size_t bytes;
+    double latency_us;
+    float accuracy;
+};
+
+
+LowRankFactors decompose( const Matrix& weights );
+
+// Smallest rank keeping at least `energy` of the squared singular values
+size_t rank_for_energy( const LowRankFactors& factors, float energy );
+
+// Largest rank whose two factors, rank * ( rows + cols ) weights, are
+// smaller than the rows x cols matrix; above it factorizing costs more
+size_t break_even_rank( size_t rows, size_t cols );
+
+// Copy of `net` with layer `layer` replaced by its rank `rank` factorization
+NeuralNet factorize( const NeuralNet& net, size_t layer,
+                     const LowRankFactors& factors, size_t rank );
+
+// Smallest rank whose held-out accuracy is at most `max_drop` below the
+// accuracy of the uncompressed network
+size_t rank_for_accuracy( NeuralNet& net, size_t layer,
+                          const LowRankFactors& factors,
+                          const Matrix& data, const std::vector< int >& labels,
+                          float max_drop );
+
+float accuracy( NeuralNet& net, const Matrix& data, const std::vector< int >& labels );
+
+ModelCost measure( NeuralNet& net, const Matrix& data, const std::vector< int >& labels );
+
+void print_cost_comparison( const ModelCost& before, const ModelCost& after );
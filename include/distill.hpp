@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "model.hpp"
+#include "statistics.hpp"
+#include "trainer.hpp"
+
+
+/*
+ * Knowledge distillation.
+ *
+ * A trained teacher labels every training sample with its class
+ * probabilities at temperature T, softmax( logits / T ). A higher T spreads
+ * the probability over the classes the teacher finds similar, which tells
+ * a smaller student more than the hard label alone. The student is then
+ * trained on ( 1 - alpha ) * the usual cross entropy with the labels plus
+ * alpha * T^2 * the cross entropy with the soft targets at the same T (see
+ * distillation_loss).
+ *
+ * The teacher runs once. Its targets are cached for the whole dataset, as
+ * 16-bit fixed point probabilities (absolute error below 1e-5), half the
+ * size of floats, and epochs only gather them.
+ */
+
+struct SoftTargets {
+    size_t classes = 0;
+    float temperature = 1.f;
+
+    // Probabilities of sample after sample, in units of 1 / 65535
+    std::vector< uint16_t > probabilities;
+
+    size_t samples() const;
+
+    // Column j of `out` (classes x indices.size()) = targets of sample indices[j]
+    void gather( const std::vector< size_t >& indices, MatrixView out ) const;
+};
+
+
+// Run `teacher` over `data` (normalized by `norm`) in batches
+SoftTargets compute_soft_targets( NeuralNet& teacher, const Dataset& data, const Normalization& norm,
+                                  float temperature, size_t batch = 1024 );
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lingebra.hpp"
+#include "trainer.hpp"
+
+
+/*
+ * Multi-process data-parallel training.
+ *
+ * `world` processes (ranks 0 .. world - 1) start from the same weights and
+ * each trains on its own shard of the data. After every backward pass the
+ * gradients are averaged by a ring all-reduce, so every rank takes the same
+ * optimizer step and the weights stay identical.
+ *
+ * Ranks form a ring, rank r sends to r + 1 and receives from r - 1 (mod
+ * world). The all-reduce splits the buffer into `world` chunks and runs
+ *
+ *      reduce-scatter  world - 1 steps, each rank adds the chunk received
+ *                      from its left neighbour and passes the sum on, so
+ *                      rank r ends with the full sum of chunk r + 1
+ *      all-gather      world - 1 steps passing the summed chunks around
+ *
+ * Every rank sends and receives 2 ( world - 1 ) / world of the buffer,
+ * independent of the number of ranks. The sum of chunk c is always formed
+ * in the same order, x_c + x_(c+1) + ... + x_(c-1) by rank, so results do
+ * not depend on timing and are bitwise equal on all ranks.
+ */
+
+// Connection of a rank to its ring neighbours
+class Transport {
+
+public:
+    virtual ~Transport() {}
+
+    virtual size_t rank() const = 0;
+    virtual size_t world() const = 0;
+
+    // Send `send_count` floats to the right neighbour while receiving
+    // `recv_count` from the left one
+    virtual bool exchange( const float* send, size_t send_count, float* recv, size_t recv_count ) = 0;
+};
+
+
+struct DistributedConfig {
+    size_t rank = 0;
+    size_t world = 1;
+
+    // "shm": POSIX shared memory, ranks on one machine
+    // "tcp": TCP sockets, rank r listens on `port` + r of hosts[r]
+    std::string transport = "shm";
+
+    // Name of the shared memory segment, unique per job
+    std::string shm_name = "/neural-net-ring";
+
+    // Host of every rank, empty = all on `host`
+    std::vector< std::string > hosts;
+    std::string host = "127.0.0.1";
+    uint16_t port = 29500;
+};
+
+
+// Connect to the ring neighbours, nullptr on failure
+std::unique_ptr< Transport > connect_ring( const DistributedConfig& config );
+
+
+class RingAllReduce {
+
+    std::unique_ptr< Transport > _transport;
+
+    // Gradients packed without the padding of the matrices
+    std::vector< float > _buffer;
+    std::vector< float > _received;
+
+    // Time and bytes spent in all_reduce()
+    double _seconds = 0.0;
+    size_t _bytes = 0;
+
+public:
+    explicit RingAllReduce( std::unique_ptr< Transport >&& transport );
+
+    size_t rank() const;
+    size_t world() const;
+
+    // Sum `count` values over all ranks, in place
+    bool all_reduce( float* data, size_t count );
+
+    // Replace every matrix by its mean over all ranks
+    bool average( const std::vector< Matrix* >& matrices );
+
+    // Wait until all ranks get here
+    bool barrier();
+
+    double seconds() const;
+    size_t bytes() const;
+};
+
+
+// Samples rank, rank + world, ... of `data`, every shard gets the same
+// number of samples so that all ranks take the same number of steps
+std::shared_ptr< const Dataset > shard_dataset( const Dataset& data, size_t rank, size_t world );
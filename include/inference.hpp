@@ -0,0 +1,120 @@
+#pragma once
+
+#include "checkpoint.hpp"
+#include "model.hpp"
+#include "statistics.hpp"
+
+
+/*
+ * Latency optimized single-sample forward pass.
+ *
+ * Weights of every layer are repacked into panels of up to PANEL_VECTORS
+ * SIMD vectors of outputs. A panel stores the weights of its outputs for
+ * input 0, then input 1, ... so a GEMV streams each panel front to back while
+ * its accumulators stay in registers. Bias and activation are applied to the
+ * accumulators before they are stored. Zero inputs (the usual case after a
+ * ReLU) are skipped.
+ *
+ * All scratch memory lives in a Workspace that is allocated once, the engine
+ * itself is immutable after construction and can be shared between threads,
+ * each using its own Workspace.
+ */
+
+#if defined( __AVX512F__ )
+constexpr size_t SIMD_FLOATS = 16;
+constexpr size_t PANEL_VECTORS = 16;
+#elif defined( __AVX__ )
+constexpr size_t SIMD_FLOATS = 8;
+constexpr size_t PANEL_VECTORS = 12;
+#else
+constexpr size_t SIMD_FLOATS = 4;
+constexpr size_t PANEL_VECTORS = 12;
+#endif
+
+
+struct PackedLayer {
+
+    // Block of consecutive outputs, `vectors` * SIMD_FLOATS wide
+    struct Panel {
+        size_t row;
+        size_t vectors;
+        size_t offset;
+    };
+
+    size_t input_dim = 0;
+    size_t output_dim = 0;
+
+    // output_dim rounded up to whole SIMD vectors
+    size_t padded_dim = 0;
+
+    std::vector< Panel > panels;
+
+    // for each panel: input_dim x panel width, in `Panel::offset` order
+    aligned_vector weights;
+
+    // padded_dim, zero padded
+    aligned_vector bias;
+
+    ActivationKind act = ActivationKind::Identity;
+
+    PackedLayer() {}
+    PackedLayer( const Matrix& weights, const Matrix& bias, ActivationKind act );
+
+    // out = act( weights * in + bias ), `in` given by its nonzero elements
+    void forward( const uint32_t* indices, const float* values, size_t nonzeros,
+                  float* out ) const;
+};
+
+
+class InferenceEngine {
+
+    std::vector< PackedLayer > _layers;
+
+    // Largest (padded) width of any layer input / output
+    size_t _max_dim = 0;
+
+public:
+
+    // Preallocated scratch buffers for one forward pass
+    struct Workspace {
+        aligned_vector buffers[2];
+        std::vector< uint32_t > indices;
+        aligned_vector values;
+    };
+
+    InferenceEngine() {}
+    explicit InferenceEngine( const NeuralNet& net );
+    explicit InferenceEngine( const std::vector< LayerParams >& layers );
+
+    void add_layer( PackedLayer&& layer );
+
+    size_t input_dim() const;
+    size_t output_dim() const;
+    const std::vector< PackedLayer >& layers() const;
+
+    Workspace workspace() const;
+
+    // Logits for a single sample, the result points into `ws`
+    const float* forward( const float* input, Workspace& ws ) const;
+
+    size_t predict( const float* input, Workspace& ws ) const;
+};
+
+
+/*
+ * Inference compile step.
+ *
+ * Rewrites trained layers into an equivalent, cheaper list for serving:
+ *
+ *  - input normalization x' = ( x - mean ) * scale is folded into the first
+ *    layer, W' = W diag( scale ), b' = b - W' mean, so raw samples go
+ *    straight in (and keep their zeros, which the engine skips)
+ *
+ *  - a layer with Identity activation and the layer after it are merged,
+ *    W' = W2 W1, b' = W2 b1 + b2, whenever the product has fewer weights
+ *    than the two factors (so low-rank factorizations stay factored)
+ */
+std::vector< LayerParams > compile_layers( std::vector< LayerParams >&& layers,
+                                           const Normalization& norm );
+
+InferenceEngine compile( const NeuralNet& net, const Normalization& norm = Normalization() );
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <iostream>
 #include <tuple>
@@ -25,102 +31,461 @@
     Random initializations somehow
  */
 
+
+/*
+ * Storage is aligned to a cache line and every column is padded to a multiple
+ * of MATRIX_PADDING floats, so each column starts on a 64-byte boundary.
+ */
+constexpr size_t MATRIX_ALIGNMENT = 64;
+constexpr size_t MATRIX_PADDING = MATRIX_ALIGNMENT / sizeof( float );
+
+
+// Observers of the matrix storage, installed by MemoryTracker (see
+// memory.hpp) while no other thread allocates
+struct MatrixMemoryHooks {
+    void ( *allocated )( const void* ptr, size_t bytes ) = nullptr;
+    void ( *freed )( const void* ptr ) = nullptr;
+};
+
+inline MatrixMemoryHooks matrix_memory_hooks;
+
+
+template < typename T, size_t Alignment >
+struct AlignedAllocator {
+
+    using value_type = T;
+
+    template < typename U >
+    struct rebind { using other = AlignedAllocator< U, Alignment >; };
+
+    AlignedAllocator() = default;
+
+    template < typename U >
+    AlignedAllocator( const AlignedAllocator< U, Alignment >& ) {}
+
+    T* allocate( size_t n ) {
+        T* ptr = static_cast< T* >( ::operator new( n * sizeof( T ), std::align_val_t( Alignment ) ) );
+        if ( matrix_memory_hooks.allocated ) {
+            matrix_memory_hooks.allocated( ptr, n * sizeof( T ) );
+        }
+
+        return ptr;
+    }
+
+    void deallocate( T* ptr, size_t ) {
+        if ( matrix_memory_hooks.freed ) {
+            matrix_memory_hooks.freed( ptr );
+        }
+
+        ::operator delete( ptr, std::align_val_t( Alignment ) );
+    }
+
+    template < typename U >
+    bool operator==( const AlignedAllocator< U, Alignment >& ) const { return true; }
+
+    template < typename U >
+    bool operator!=( const AlignedAllocator< U, Alignment >& ) const { return false; }
+};
+
+using aligned_vector = std::vector< float, AlignedAllocator< float, MATRIX_ALIGNMENT > >;
+
+
+// Leading dimension used for a column of `rows` elements
+constexpr size_t padded_rows( size_t rows ) {
+    return ( rows + MATRIX_PADDING - 1 ) / MATRIX_PADDING * MATRIX_PADDING;
+}
+
+
+/*
+ * Non-owning, strided view of a column-major block.
+ *
+ * Element (row, col) lives at ptr[col * ld + row]. Views are cheap to copy and
+ * are used to pass sub-matrices (a batch out of a dataset, a single sample out
+ * of a batch) to the kernels below without copying. MatrixView converts
+ * implicitly to ConstMatrixView.
+ */
+template < typename T >
+struct BasicMatrixView {
+
+    T* ptr;
+    size_t rows;
+    size_t cols;
+    size_t ld;
+
+    BasicMatrixView() : ptr( nullptr ), rows( 0 ), cols( 0 ), ld( 0 ) {}
+
+    BasicMatrixView( T* ptr, size_t rows, size_t cols, size_t ld ) : ptr( ptr )
+                                                                   , rows( rows )
+                                                                   , cols( cols )
+                                                                   , ld( ld ) {}
+
+    template < typename U,
+               typename = std::enable_if_t< std::is_same< const U, T >::value &&
+                                            !std::is_same< U, T >::value > >
+    BasicMatrixView( const BasicMatrixView< U >& rhs ) : ptr( rhs.ptr )
+                                                      , rows( rhs.rows )
+                                                      , cols( rhs.cols )
+                                                      , ld( rhs.ld ) {}
+
+    T& at( size_t row, size_t col ) const {
+        return ptr[col * ld + row];
+    }
+
+    T* col( size_t col ) const {
+        return ptr + col * ld;
+    }
+
+    BasicMatrixView block( size_t row, size_t col, size_t n_rows, size_t n_cols ) const {
+        assert( row + n_rows <= rows && col + n_cols <= cols );
+        return BasicMatrixView( ptr + col * ld + row, n_rows, n_cols, ld );
+    }
+
+    BasicMatrixView col_range( size_t col, size_t n_cols ) const {
+        return block( 0, col, rows, n_cols );
+    }
+
+    void print() const {
+
+        std::cout << "Rows " << rows << " Columns " << cols << "\n";
+        for ( size_t row = 0; row < rows; row++ ) {
+            std::cout << "| ";
+            for ( size_t col = 0; col < cols; col++ ){
+                std::cout << at(row, col) << " | ";
+            }
+
+            std::cout << std::endl;
+        }
+
+        std::cout << "\n";
+    }
+};
+
+using MatrixView = BasicMatrixView< float >;
+using ConstMatrixView = BasicMatrixView< const float >;
+
+
+/*
+ * Tunable parameters of gemm(), set by autotune() (see autotune.hpp) before
+ * any computation. Every element of c is summed over k in the same order for
+ * any parameters, so they change the speed but not the results.
+ *
+ *      block_rows x block_depth    block of `a` kept in cache while the
+ *                                  columns of `b` stream by (0 = all)
+ *      threads                     columns of `c` are split between threads
+ */
+struct GemmParams {
+    size_t block_rows = 0;
+    size_t block_depth = 0;
+    size_t threads = 1;
+};
+
+
+struct GemmTuning {
+
+    // Tuned shapes: `a` is rows x depth, `b` depth x cols
+    struct Entry {
+        size_t rows, depth, cols;
+        GemmParams params;
+    };
+
+    std::vector< Entry > shapes;
+
+    // Other shapes, on `fallback_threads` once they have `parallel_flops`
+    GemmParams fallback;
+    size_t fallback_threads = 1;
+    size_t parallel_flops = std::numeric_limits< size_t >::max();
+
+    GemmParams lookup( size_t rows, size_t depth, size_t cols ) const {
+        for ( auto& entry : shapes ) {
+            if ( entry.rows == rows && entry.depth == depth && entry.cols == cols ) {
+                return entry.params;
+            }
+        }
+
+        GemmParams res = fallback;
+        if ( 2 * rows * depth * cols >= parallel_flops ) {
+            res.threads = fallback_threads;
+        }
+
+        return res;
+    }
+};
+
+inline GemmTuning gemm_tuning;
+
+
+/*
+ * Kernels, shared by Matrix and views.
+ */
+
+// res += x * scale
+inline void axpy( float* __restrict__ res, const float* __restrict__ x, float scale, size_t n ) {
+    for ( size_t i = 0; i < n; i++ ){
+        res[i] += x[i] * scale;
+    }
+}
+
+
+// Columns [ col_begin, col_end ) of c = a * b (c += a * b if `accumulate`)
+inline void gemm_columns( ConstMatrixView a, ConstMatrixView b, MatrixView c, bool accumulate,
+                          size_t col_begin, size_t col_end, const GemmParams& params ) {
+
+    size_t block_rows = params.block_rows ? params.block_rows : a.rows;
+    size_t block_depth = params.block_depth ? params.block_depth : a.cols;
+
+    // Unblocked
+    if ( block_rows >= a.rows && block_depth >= a.cols ) {
+
+        // j-k-i order, the innermost loop streams a column of `a` into a column of `c`
+        for ( size_t col2 = col_begin; col2 < col_end; col2++ ){
+
+            float* __restrict__ res = c.col( col2 );
+
+            if ( !accumulate ) {
+                std::fill( res, res + c.rows, 0.f );
+            }
+
+            for ( size_t col1 = 0; col1 < a.cols; col1++ ){
+                axpy( res, a.col( col1 ), b.at( col1, col2 ), a.rows );
+            }
+        }
+
+        return;
+    }
+
+    for ( size_t k0 = 0; k0 < a.cols; k0 += block_depth ){
+        size_t k1 = std::min( k0 + block_depth, a.cols );
+
+        for ( size_t i0 = 0; i0 < a.rows; i0 += block_rows ){
+            size_t i1 = std::min( i0 + block_rows, a.rows );
+
+            for ( size_t col2 = col_begin; col2 < col_end; col2++ ){
+
+                float* res = c.col( col2 ) + i0;
+
+                if ( k0 == 0 && !accumulate ) {
+                    std::fill( res, res + ( i1 - i0 ), 0.f );
+                }
+
+                for ( size_t col1 = k0; col1 < k1; col1++ ){
+                    axpy( res, a.col( col1 ) + i0, b.at( col1, col2 ), i1 - i0 );
+                }
+            }
+        }
+    }
+}
+
+
+// c = a * b, or c += a * b if `accumulate` is set
+inline void gemm( ConstMatrixView a, ConstMatrixView b, MatrixView c, bool accumulate = false ) {
+
+    assert( a.cols == b.rows && c.rows == a.rows && c.cols == b.cols );
+
+    GemmParams params = gemm_tuning.lookup( a.rows, a.cols, b.cols );
+    size_t threads = std::max< size_t >( 1, std::min( params.threads, b.cols ) );
+
+    if ( threads == 1 ) {
+        gemm_columns( a, b, c, accumulate, 0, b.cols, params );
+        return;
+    }
+
+    std::vector< std::thread > workers;
+    for ( size_t t = 1; t < threads; t++ ) {
+        workers.emplace_back( gemm_columns, a, b, c, accumulate,
+                              t * b.cols / threads, ( t + 1 ) * b.cols / threads, params );
+    }
+
+    gemm_columns( a, b, c, accumulate, 0, b.cols / threads, params );
+
+    for ( auto& worker : workers ) {
+        worker.join();
+    }
+}
+
+/*
+ * Component-wise operations on matrices.
+ * The rhs matrix must have the same number of rows as dst,
+ * but may have a different number of columns. If rhs has less columns, the
+ * last column is repeated to accomodate the size difference.
+ */
+inline void cwise_product( MatrixView dst, ConstMatrixView rhs ) {
+
+    assert( dst.rows == rhs.rows );
+
+    for ( size_t col1 = 0; col1 < dst.cols; col1++ ){
+        float* __restrict__ out = dst.col( col1 );
+        const float* __restrict__ in = rhs.col( std::min( rhs.cols - 1, col1 ) );
+
+        for ( size_t row1 = 0; row1 < dst.rows; row1++ ){
+            out[row1] *= in[row1];
+        }
+    }
+}
+
+inline void cwise_add( MatrixView dst, ConstMatrixView rhs ) {
+
+    assert( dst.rows == rhs.rows );
+
+    for ( size_t col1 = 0; col1 < dst.cols; col1++ ){
+        float* __restrict__ out = dst.col( col1 );
+        const float* __restrict__ in = rhs.col( std::min( rhs.cols - 1, col1 ) );
+
+        for ( size_t row1 = 0; row1 < dst.rows; row1++ ){
+            out[row1] += in[row1];
+        }
+    }
+}
+
+// Apply function on every element of dst in place
+template < typename func >
+void apply( MatrixView dst, func f ) {
+    for ( size_t col1 = 0; col1 < dst.cols; col1++ ){
+        float* out = dst.col( col1 );
+
+        for ( size_t row1 = 0; row1 < dst.rows; row1++ ){
+            out[row1] = f( out[row1] );
+        }
+    }
+}
+
+
 class Matrix {
-    std::vector< float > _data;
+    aligned_vector _data;
 
 public:
     size_t rows;
     size_t cols;
 
+    // Distance between the starts of two consecutive columns in `_data`
+    size_t ld;
+
 /*
  *  constructors and helper functions
  */
 
-    Matrix() : _data({}), rows(0), cols(0) {}
+    Matrix() : _data({}), rows(0), cols(0), ld(0) {}
 
     // Zero initialized matrix
-    Matrix( size_t rows, size_t cols ) : _data({}), rows(rows), cols(cols) {
-        _data = std::vector< float >( rows * cols, 0.0 );
+    Matrix( size_t rows, size_t cols ) : _data({}), rows(rows), cols(cols), ld(padded_rows(rows)) {
+        _data = aligned_vector( ld * cols, 0.0 );
     }
 
-    Matrix( const Matrix& rhs ) : _data( rhs.data() ), rows(rhs.rows), cols(rhs.cols) {}
-    Matrix( Matrix&& rhs ) : _data( std::move(rhs.data()) ), rows(rhs.rows), cols(rhs.cols){}
+    Matrix( const Matrix& rhs ) : _data( rhs.data() ), rows(rhs.rows), cols(rhs.cols), ld(rhs.ld) {}
+    Matrix( Matrix&& rhs ) : _data( std::move(rhs.data()) ), rows(rhs.rows), cols(rhs.cols), ld(rhs.ld) {
+        rhs.rows = rhs.cols = rhs.ld = 0;
+    }
 
+    // Deep copy of a (possibly strided) view
+    explicit Matrix( ConstMatrixView rhs ) : Matrix( rhs.rows, rhs.cols ) {
+        for ( size_t col = 0; col < cols; col++ ){
+            std::copy( rhs.col( col ), rhs.col( col ) + rows, column( col ) );
+        }
+    }
 
-    Matrix( std::vector< float >&& data, size_t rows, size_t cols ) : _data( std::move( data ) )
-                                                                    , rows( rows )
-                                                                    , cols( cols ) {}
+    // Construct from tightly packed column-major data
+    Matrix( const std::vector< float >& data, size_t rows, size_t cols ) : Matrix( rows, cols ) {
+        assert( data.size() == rows * cols );
+        for ( size_t col = 0; col < cols; col++ ){
+            std::copy( data.begin() + col * rows, data.begin() + ( col + 1 ) * rows, column( col ) );
+        }
+    }
 
-    Matrix( std::vector< float >& data, size_t rows, size_t cols ) : _data( data )
-                                                                   , rows( rows )
-                                                                   , cols( cols ) {}
+    Matrix( std::vector< float >&& data, size_t rows, size_t cols ) : Matrix( static_cast< const std::vector< float >& >( data ), rows, cols ) {}
 
     Matrix& operator=(const Matrix& rhs){
         _data = rhs.data();
         rows = rhs.rows;
         cols = rhs.cols;
+        ld = rhs.ld;
         return *this;
     }
 
     Matrix& operator=(Matrix&& rhs){
+        if ( this == &rhs ) {
+            return *this;
+        }
+
         _data = std::move( rhs.data() );
         rows = rhs.rows;
         cols = rhs.cols;
+        ld = rhs.ld;
+        rhs.rows = rhs.cols = rhs.ld = 0;
         return *this;
     }
 
-    std::vector< float > & data() {
+    // Raw storage, including the padding at the end of each column
+    aligned_vector & data() {
         return _data;
     }
 
-    const std::vector< float > & data() const {
+    const aligned_vector & data() const {
         return _data;
     }
 
+    float* column( size_t col ) {
+        return _data.data() + col * ld;
+    }
+
+    const float* column( size_t col ) const {
+        return _data.data() + col * ld;
+    }
+
+    MatrixView view() {
+        return MatrixView( _data.data(), rows, cols, ld );
+    }
+
+    ConstMatrixView view() const {
+        return ConstMatrixView( _data.data(), rows, cols, ld );
+    }
+
+    operator MatrixView() {
+        return view();
+    }
+
+    operator ConstMatrixView() const {
+        return view();
+    }
+
+    MatrixView block( size_t row, size_t col, size_t n_rows, size_t n_cols ) {
+        return view().block( row, col, n_rows, n_cols );
+    }
+
+    ConstMatrixView block( size_t row, size_t col, size_t n_rows, size_t n_cols ) const {
+        return view().block( row, col, n_rows, n_cols );
+    }
+
+    MatrixView col_range( size_t col, size_t n_cols ) {
+        return view().col_range( col, n_cols );
+    }
+
+    ConstMatrixView col_range( size_t col, size_t n_cols ) const {
+        return view().col_range( col, n_cols );
+    }
+
 
     // column-major storage
     float at( size_t row, size_t col ) const{
-        return _data[col * rows + row];
+        return _data[col * ld + row];
     }
 
     float& at( size_t row, size_t col ){
-        return _data[col * rows + row];
+        return _data[col * ld + row];
     }
 
     void print() const{
-
-        std::cout << "Rows " << rows << " Columns " << cols << "\n";
-        for ( size_t row = 0; row < rows; row++ ) {
-            std::cout << "| ";
-            for ( size_t col = 0; col < cols; col++ ){
-                std::cout << at(row, col) << " | ";
-            }
-
-            std::cout << std::endl;
-        }
-
-        std::cout << "\n";
+        view().print();
     }
 
 
 /*
  *  Main interface
  */
-    Matrix mult( const Matrix &rhs ) {
+    Matrix mult( ConstMatrixView rhs ) const {
 
         assert( cols == rhs.rows );
 
         Matrix res(rows, rhs.cols);
-
-
-        for ( size_t col1 = 0; col1 < cols; col1++ ){
-            for (size_t col2 = 0; col2 < rhs.cols; col2++){
-                for ( size_t row1 = 0; row1 < rows; row1++ ){
-                    res.at(row1, col2) += at(row1, col1) * rhs.at(col1, col2);
-                }
-            }
-        }
-
+        gemm( view(), rhs, res );
 
         return res;
     }
@@ -142,27 +507,16 @@ public:
     // Apply function on this matrix in place
     template < typename func >
     Matrix& apply( func f ) {
-        for ( auto &x : _data ) {
-            x = f(x);
-        }
-
+        ::apply( view(), f );
         return *this;
     }
 
     Matrix& add_scalar( float n ){
-        for ( auto &x : _data ) {
-            x += n;
-        }
-
-        return *this;
+        return apply( [n]( float x ){ return x + n; } );
     }
 
     Matrix& multiply_scalar( float n ){
-        for ( auto &x : _data ) {
-            x *= n;
-        }
-
-        return *this;
+        return apply( [n]( float x ){ return x * n; } );
     }
 
     /*
@@ -173,44 +527,28 @@ public:
      */
 
     // Component-wise (Hadamard) product with rhs of same dimensions
-    Matrix& cwise_product( const Matrix& rhs ){
-
-        for ( size_t col1 = 0; col1 < cols; col1++ ){
-            for ( size_t row1 = 0; row1 < rows; row1++ ){
-                at(row1, col1) *= rhs.at(row1, std::min(rhs.cols - 1, col1));
-            }
-        }
-
+    Matrix& cwise_product( ConstMatrixView rhs ){
+        ::cwise_product( view(), rhs );
         return *this;
     }
 
-    // Component-wise addition of matrices, supports different 
-    Matrix& cwise_add( const Matrix& rhs ){
-
-        for ( size_t col1 = 0; col1 < cols; col1++ ){
-            for ( size_t row1 = 0; row1 < rows; row1++ ){
-                at(row1, col1) += rhs.at(row1, std::min(rhs.cols - 1, col1));
-            }
-        }
-
+    // Component-wise addition of matrices, supports different
+    Matrix& cwise_add( ConstMatrixView rhs ){
+        ::cwise_add( view(), rhs );
         return *this;
     }
 
     // Sum rows of this matrix into single elements
     Matrix& row_reduce(){
 
-        std::vector< float > new_data( rows, 0.f );
+        Matrix reduced( rows, 1 );
 
         for ( size_t col1 = 0; col1 < cols; col1++ ){
             for ( size_t row1 = 0; row1 < rows; row1++ ){
-                new_data[row1] += at(row1, col1);
+                reduced.at(row1, 0) += at(row1, col1);
             }
         }
-        _data = std::move( new_data );
-
-        // set cols to correct number
-        cols = 1;
 
-        return *this;
+        return *this = std::move( reduced );
     }
 };
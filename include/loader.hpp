@@ -9,6 +9,11 @@
 #include <iostream>
 #include <math.h>
 
+#include "lingebra.hpp"
+#include "memory.hpp"
+#include "sparse.hpp"
+#include "statistics.hpp"
+
 struct Loader{
     Loader() {}
 
@@ -23,23 +28,30 @@ struct Loader{
 
         std::string line;
         while (std::getline(f, line)) {
+            res.push_back(parse_vector(line));
+        }
 
-            std::vector<float> vector;
-            float n;
 
-            std::istringstream stream(line);
+        return res;
+    }
 
-            while(stream >> n){
-                vector.push_back(n);
-                char ch;
-                stream >> ch;
-            }
+    // One line of a vectors CSV file
+    static std::vector<float> parse_vector(const std::string &line) {
+        std::vector<float> vector;
+        float n;
 
-            res.push_back(vector);
+        std::istringstream stream(line);
+
+        while(stream >> n){
+            vector.push_back(n);
+            char ch;
+            stream >> ch;
         }
 
+        // Datasets keep many of these, drop the spare capacity of push_back
+        vector.shrink_to_fit();
 
-        return res;
+        return vector;
     }
 
     std::vector<int> load_labels_from_csv(std::string path) {
@@ -65,38 +77,49 @@ struct Loader{
     }
 
 
-    void normalize(std::vector<std::vector<float>> &vectors, float mean, float sd) {
-        for (std::vector<float>& vector : vectors) {
-            for (float &n : vector) {
-                n = (n-mean)/sd;
-            }
+    // Pack vectors as columns of a single matrix, so that batches and samples
+    // can be sliced out of it as views
+    Matrix to_matrix(const std::vector<std::vector<float>> &vectors) {
+        if (vectors.empty()) {
+            return Matrix();
+        }
+
+        MemoryScope scope(MemoryCategory::dataset);
+
+        Matrix res(vectors[0].size(), vectors.size());
+        for (size_t i = 0; i < vectors.size(); i++) {
+            std::copy(vectors[i].begin(), vectors[i].end(), res.column(i));
         }
+
+        return res;
     }
 
-    // return (mean, sd)
-    std::tuple<float, float> normalize_dataset(std::vector<std::vector<float>> &vectors) {
-        float mean = 0, variance = 0;
 
-        float sum = 0.0;
-        size_t count = 0;
-        for (std::vector<float>& vector : vectors) {
-            for (float n : vector) {
-                sum += n;
-                count += 1;
-            }
+    // Same as to_matrix, keeping only nonzero features (CSR, one row per vector)
+    SparseMatrix to_sparse(const std::vector<std::vector<float>> &vectors) {
+        SparseMatrix res(vectors.empty() ? 0 : vectors[0].size());
+        for (const std::vector<float>& vector : vectors) {
+            res.append_sample(vector.data(), vector.size());
         }
 
-        mean = sum/count;
+        return res;
+    }
 
-        float sq_sum = 0;
+
+    void normalize(std::vector<std::vector<float>> &vectors, float mean, float sd) {
         for (std::vector<float>& vector : vectors) {
-            for (float n : vector) {
-                sq_sum += pow(n-mean, 2);
+            for (float &n : vector) {
+                n = (n-mean)/sd;
             }
         }
+    }
+
+    // return (mean, sd), computed in a single pass (see statistics.hpp)
+    std::tuple<float, float> normalize_dataset(std::vector<std::vector<float>> &vectors) {
+        RunningStats stats = compute_statistics(vectors).global();
 
-        variance = sq_sum/(count-1);
-        float sd = std::sqrt(variance);
+        float mean = stats.mean;
+        float sd = stats.sd();
 
         normalize(vectors, mean, sd);
 
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lingebra.hpp"
+
+
+/*
+ * Memory accounting.
+ *
+ * While enabled, the tracker sees every allocation and release of Matrix
+ * storage (through the hooks of AlignedAllocator) and of datasets
+ * registered with track(). Each block is attributed to the category and
+ * layer of the MemoryScope active on the allocating thread, the model code
+ * opens scopes around the forward and backward pass of every layer, the
+ * optimizer around its moments, the loader and trainer around their data.
+ * Live and peak bytes are kept per category and per layer, and the number
+ * of allocations per training step.
+ *
+ * Blocks allocated before enable() are not known to the tracker and their
+ * release is ignored, so enable it before the model is built.
+ *
+ * estimate_training_memory() predicts the same categories from the
+ * topology alone, to size jobs before anything is allocated.
+ */
+
+enum class MemoryCategory {
+    weights,
+    gradients,
+    optimizer,
+    activations,
+    dataset,
+    other,
+};
+
+constexpr size_t MEMORY_CATEGORIES = 6;
+
+// Allocations outside of any layer
+constexpr int NO_LAYER = -1;
+
+const char* category_name( MemoryCategory category );
+
+
+struct MemoryUsage {
+    size_t live = 0;
+    size_t peak = 0;
+    size_t allocations = 0;
+};
+
+
+// Allocations of one optimizer step, over all steps seen so far
+struct StepAllocations {
+    size_t steps = 0;
+    size_t min = 0;
+    size_t max = 0;
+    size_t total = 0;
+
+    // Bytes allocated by the steps (not live, most are freed in the step)
+    size_t bytes = 0;
+};
+
+
+/*
+ * Attribute allocations of the calling thread to `category` and `layer`
+ * until the scope ends, scopes nest.
+ */
+class MemoryScope {
+
+    MemoryCategory _category;
+    int _layer;
+
+public:
+    MemoryScope( MemoryCategory category, int layer = NO_LAYER );
+    ~MemoryScope();
+
+    MemoryScope( const MemoryScope& ) = delete;
+    MemoryScope& operator=( const MemoryScope& ) = delete;
+};
+
+
+class MemoryTracker {
+
+    struct Block {
+        MemoryCategory category;
+        int layer;
+        size_t bytes;
+    };
+
+    mutable std::mutex _mutex;
+    bool _enabled = false;
+
+    std::unordered_map< const void*, Block > _blocks;
+
+    MemoryUsage _total;
+    std::array< MemoryUsage, MEMORY_CATEGORIES > _categories;
+    std::map< int, std::array< MemoryUsage, MEMORY_CATEGORIES > > _layers;
+
+    // Allocations since the last end_step()
+    size_t _step_count = 0;
+    size_t _step_bytes = 0;
+    StepAllocations _steps;
+
+public:
+    ~MemoryTracker();
+
+    // Install / remove the hooks of the matrix storage
+    void enable();
+    void disable();
+    bool enabled() const;
+
+    // Forget all blocks and statistics
+    void reset();
+
+    // Peaks from here on start at the live bytes
+    void reset_peaks();
+
+    // Storage not allocated as a Matrix (e.g. a Dataset), attributed to the
+    // current scope, `key` identifies it for untrack()
+    void track( const void* key, size_t bytes );
+    void untrack( const void* key );
+
+    // Attribute a live block to another category / layer, e.g. weights that
+    // were allocated before the layer knew its position in the net
+    void assign( const void* ptr, MemoryCategory category, int layer );
+
+    // Called by the trainer after every optimizer step
+    void end_step();
+
+    MemoryUsage total() const;
+    MemoryUsage usage( MemoryCategory category ) const;
+    MemoryUsage usage( MemoryCategory category, int layer ) const;
+
+    // Layers that allocated anything, in order (NO_LAYER first)
+    std::vector< int > layers() const;
+
+    StepAllocations step_allocations() const;
+
+    void print() const;
+
+    // Hooks of AlignedAllocator
+    void allocated( const void* ptr, size_t bytes );
+    void freed( const void* ptr );
+
+private:
+    void add( const void* ptr, const Block& block );
+    void remove( const void* ptr );
+};
+
+extern MemoryTracker memory_tracker;
+
+
+// Predicted bytes of training a net, by category
+struct MemoryEstimate {
+    std::array< size_t, MEMORY_CATEGORIES > bytes{};
+
+    // Peak of the temporaries of a step, on top of `bytes`
+    size_t step_bytes = 0;
+
+    size_t total() const;
+    void print() const;
+};
+
+/*
+ * Memory of training a dense net of layers widths[0] -> widths[1] -> ...
+ * with batches of `batch` on `samples` in-memory samples of widths[0]
+ * features (0 = streamed / no dataset). Follows the allocations of
+ * LinearLayer, AdamOptimizer and Trainer, without recomputation or
+ * gradient accumulation.
+ */
+MemoryEstimate estimate_training_memory( const std::vector< size_t >& widths, size_t batch,
+                                         size_t samples, bool bias = true );
@@ -3,7 +3,9 @@
 #include "activations.hpp"
 #include "lingebra.hpp"
 #include "random.hpp"
+#include "sparse.hpp"
 
+#include <functional>
 #include <limits>
 #include <map>
 #include <memory>
@@ -44,6 +46,22 @@ public:
     // Write debug information during FP/BP
     bool debug_output = false;
 
+    // Compute derivatives w.r.t. inputs in backward(), not needed for the
+    // first layer of a network
+    bool propagate_derivatives = true;
+
+    // Add gradients of backward() to the current ones instead of replacing
+    // them, to sum up gradients of several micro-batches
+    bool accumulate_gradients = false;
+
+    // Drop activations after forward() during training, NeuralNet::backward()
+    // recomputes them from the inputs kept by the first layer of the segment
+    bool recompute = false;
+
+    // Dense inputs with at most this fraction of nonzeros are converted and
+    // run through the sparse kernels (0 disables the detection)
+    float sparse_threshold = 0.f;
+
     /*
      *  Forward pass related information
      *
@@ -52,6 +70,10 @@ public:
     Matrix _inputs;
     Matrix _outputs;
 
+    // Inputs of the last forward() if they were sparse, used instead of _inputs
+    SparseMatrix _sparse_inputs;
+    bool _inputs_sparse = false;
+
     /*
      * Backprop related information (stored during FP if `evaluation` is false)
      */
@@ -73,11 +95,17 @@ public:
     // gradients w.r.t biases 
     Matrix _bias_gradients;
 
+    // 0/1 mask of pruned weights, empty while the layer is dense
+    Matrix _weight_mask;
+
     LinearLayer( size_t input_dim, size_t output_dim, 
                  std::string activation, 
                  std::string init_mode = "he",
                  bool bias=true );
 
+    // Layer with given (trained) parameters, an empty `bias` means no bias
+    LinearLayer( Matrix&& weights, Matrix&& bias, ActivationFunction* act );
+
     /*
      * Helper functions
      */
@@ -91,12 +119,60 @@ public:
     std::vector< Matrix* > get_params();
     std::vector< Matrix* > get_grads();
 
+    // Masks of params (nullptr for parameters that are never pruned)
+    std::vector< Matrix* > get_masks();
+
 
     /*
      * Core functionality
+     *
+     * The view overload does not copy its input in evaluation mode, so a
+     * sample or a batch can be sliced out of a larger matrix for inference.
+     * The sparse overload skips zero inputs in both the forward product and
+     * the weight gradients.
      */
     Matrix forward( Matrix&& inputs );
+    Matrix forward( ConstMatrixView inputs );
+    Matrix forward( SparseMatrix&& inputs );
     Matrix backward( Matrix&& derivatives );
+
+    /*
+     * Activation recomputation
+     */
+
+    // Bytes of activations currently kept for backward()
+    size_t activation_bytes() const;
+    bool has_activations() const;
+
+    // Free activations, `keep_inputs` leaves what recompute_forward() needs
+    void release_activations( bool keep_inputs );
+
+    // Repeat the last forward() on the kept inputs, restoring activations
+    Matrix recompute_forward();
+
+private:
+    // Compute activated outputs (and \sigma' when training) from potentials
+    Matrix forward_outputs( Matrix&& potentials );
+
+    bool use_sparse( ConstMatrixView inputs ) const;
+};
+
+
+/*
+ * Cost of activation recomputation, accumulated over training steps.
+ *
+ * `peak_bytes` is the largest amount of activations held at once (kept
+ * between forward and backward plus one recomputed segment), `full_bytes`
+ * what the same steps hold without recomputation. Flops count the multiply
+ * adds of forward passes only, backward costs about twice the forward.
+ */
+struct RecomputeStats {
+    size_t peak_bytes = 0;
+    size_t full_bytes = 0;
+    size_t forward_flops = 0;
+    size_t recompute_flops = 0;
+
+    void print() const;
 };
 
 
@@ -107,6 +183,12 @@ class NeuralNet {
 
     std::vector< std::shared_ptr< LinearLayer > > _layers;
 
+    RecomputeStats _recompute_stats;
+
+    // Activation bytes kept by the current forward pass
+    size_t _kept_bytes = 0;
+    size_t _full_bytes = 0;
+
 public:
     NeuralNet();
     NeuralNet( std::vector< std::shared_ptr<LinearLayer > > &&layers);
@@ -114,11 +196,43 @@ public:
     void evaluation();
     void training();
 
+    // Switch backward() between replacing and accumulating gradients
+    void accumulate_gradients( bool accumulate );
+
+    /*
+     * Recompute activations of all layers but every `segment`-th one (the
+     * usual choice is about sqrt( layers ) ), 0 or 1 keeps all of them.
+     * Single layers can be switched by LinearLayer::recompute.
+     */
+    void set_recompute( size_t segment );
+    bool recomputing() const;
+    const RecomputeStats& recompute_stats() const;
+
     std::vector< Matrix* > params();
     std::vector< Matrix* > grads();
+    std::vector< Matrix* > masks();
+
+    const std::vector< std::shared_ptr< LinearLayer > >& layers() const;
 
     Matrix forward( Matrix &&input );
+    Matrix forward( ConstMatrixView input );
+    Matrix forward( SparseMatrix&& input );
     void backward( Matrix&& derivatives );
+
+    // backward() calling `layer_done( i )` as soon as the gradients of layer
+    // `i` are final, layers later in the pass no longer read its parameters
+    void backward( Matrix&& derivatives, const std::function< void( size_t ) >& layer_done );
+
     std::vector< size_t > predict( Matrix&& input );
+    std::vector< size_t > predict( ConstMatrixView input );
+
+private:
+    // Bookkeeping after layer `i` ran forward() during training
+    void after_forward( size_t i );
+
+    // Restore activations of the recomputed segment that ends by layer `end`
+    void recompute_segment( size_t end );
+
+    size_t live_activation_bytes() const;
 };
 
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "optimizer.hpp"
+#include "statistics.hpp"
+
+
+/*
+ * Online incremental learning.
+ *
+ * Labelled samples arrive as lines "label,x1,x2,...,xn" on a pipe, stdin or
+ * a file that keeps growing. Every `batch` new samples the learner takes
+ * one optimizer step of the live net and its existing Adam state. A
+ * mini-batch holds the new samples and `replay` samples drawn from a replay
+ * buffer. The buffer is a uniform sample of all the samples seen so far
+ * (reservoir sampling), so older data keep contributing and the net does
+ * not drift to the latest part of the stream only.
+ *
+ * Before its step the net predicts the new samples, which gives the
+ * accuracy on unseen data as the stream goes ("test, then train").
+ *
+ * Every `publish_every` steps the weights are compiled for raw samples
+ * (see compile_layers) and handed to the publisher, e.g. swapped into a
+ * running BatchingServer. The training thread only compiles a copy, the
+ * inference side never sees weights in the middle of an update.
+ */
+
+struct OnlineConfig {
+    // New and replayed samples per step
+    size_t batch = 64;
+    size_t replay = 64;
+
+    // Capacity of the replay buffer, in samples
+    size_t buffer = 20000;
+
+    size_t publish_every = 20;
+
+    // Samples to estimate the normalization from if none is set
+    size_t warmup = 1000;
+
+    // At the end of a file wait for more lines instead of stopping, give
+    // up after `idle_ms` without data (0 = never)
+    bool follow = false;
+    size_t idle_ms = 0;
+    size_t poll_ms = 100;
+};
+
+
+struct OnlineStats {
+    size_t samples = 0;
+    size_t steps = 0;
+    size_t published = 0;
+
+    // Lines that were not a label and `dim` features
+    size_t rejected = 0;
+
+    // New samples predicted right before their step
+    size_t correct = 0;
+
+    // Time of the steps and publishing
+    double seconds = 0.0;
+};
+
+
+/*
+ * Lines of a file descriptor, read with a timeout so that a stop request is
+ * noticed while waiting for a slow writer.
+ */
+class LineSource {
+
+    int _fd = -1;
+    bool _owned = false;
+    bool _follow = false;
+    size_t _idle_ms = 0;
+    size_t _poll_ms = 100;
+
+    std::string _buffer;
+
+public:
+    // "-" reads stdin, a FIFO blocks until a writer opens it
+    bool open( const std::string& path, const OnlineConfig& config );
+    ~LineSource();
+
+    // Next complete line, false at the end of the input or once `stop` is set
+    bool next( std::string& line, const std::atomic< bool >& stop );
+};
+
+
+class OnlineLearner {
+
+    NeuralNet* _net;
+    AdamOptimizer* _opt;
+    OnlineConfig _config;
+    Normalization _norm;
+    size_t _dim;
+
+    // Samples waiting for their step, raw
+    std::vector< std::vector< float > > _pending;
+    std::vector< int > _pending_labels;
+
+    // Replay buffer, raw, reservoir over the `_seen` samples so far
+    std::vector< std::vector< float > > _replay;
+    std::vector< int > _replay_labels;
+    size_t _seen = 0;
+
+    // Stats at the last publish, the accuracy is reported per interval
+    OnlineStats _reported;
+
+    RandomStream _gen = rng.stream( REPLAY_STREAM );
+
+    std::function< void( std::vector< LayerParams >&& ) > _publisher;
+    OnlineStats _stats;
+
+public:
+    OnlineLearner( NeuralNet* net, AdamOptimizer* opt, const OnlineConfig& config = OnlineConfig() );
+
+    // Normalization of raw samples, estimated from the stream if not set
+    void set_normalization( const Normalization& norm );
+    const Normalization& normalization() const;
+
+    void set_publisher( std::function< void( std::vector< LayerParams >&& ) > publisher );
+
+    // Queue one sample, a step is taken once `batch` of them are pending
+    void add( std::vector< float >&& sample, int label );
+
+    // Read and learn from `source` until it ends or `stop` is set, then
+    // learn the remaining samples and publish
+    void run( LineSource& source, const std::atomic< bool >& stop );
+
+    // Step on the pending samples (if any) and publish the weights
+    void flush();
+
+    const OnlineStats& stats() const;
+
+private:
+    void step();
+    void publish();
+    void remember( std::vector< float >&& sample, int label );
+};
+
+
+// Write a checkpoint to a temporary file and rename it over `path`, so
+// that readers see either the old or the new weights
+bool publish_checkpoint( const std::string& path, const std::vector< LayerParams >& layers );
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <string>
 
 #include "model.hpp"
 
@@ -13,6 +14,22 @@ float cross_entropy_loss( const Matrix &logits,
  * value of the CE loss on this batch as a return value
  */
 
+float distillation_loss( const Matrix &logits,
+                         const std::vector< int > &labels,
+                         const Matrix &soft_targets,
+                         float temperature, float alpha,
+                         Matrix &derivatives );
+/*
+ * Cross entropy extended by soft targets of a teacher (one column of class
+ * probabilities at `temperature` per sample, see distill.hpp):
+ *
+ *      ( 1 - alpha ) CE( softmax( z ), labels )
+ *          + alpha T^2 CE( softmax( z / T ), soft_targets )
+ *
+ * The T^2 keeps the gradient of the soft part, T ( softmax( z / T ) - p ),
+ * of about the same scale for any temperature.
+ */
+
 class AdamOptimizer {
 
     float _lr;
@@ -24,11 +41,18 @@ class AdamOptimizer {
     float _beta1t = 1.f;
     float _beta2t = 1.f;
 
+    // Bias corrected step size of the current step
+    float _lr_t = 0.f;
+
     size_t timestep = 0;
 
     std::vector< Matrix* > _model_params;
     std::vector< Matrix* > _model_gradients;
 
+    // Pruning masks of the parameters, gradients and moments of pruned
+    // weights are zeroed so they stay pruned (empty / nullptr = dense)
+    std::vector< Matrix* > _model_masks;
+
     std::vector< std::unique_ptr< Matrix > > _first_moments;
     std::vector< std::unique_ptr< Matrix > > _second_moments;
 
@@ -36,9 +60,40 @@ public:
 
     AdamOptimizer( NeuralNet *m, float lr, float beta1, float beta2 );
 
+    // Optimize any model that exposes its parameters and their gradients
+    // (e.g. StaticNeuralNet), `grads[i]` holds the gradient of `params[i]`
+    AdamOptimizer( std::vector< Matrix* > params, std::vector< Matrix* > grads,
+                   float lr, float beta1, float beta2,
+                   std::vector< Matrix* > masks = {} );
+
     // Assumes Trainer called backward() with appropriate loss on the model,
     // collects gradients from `_model_gradients` and adjusts `_model_params`
     void step();
+
+    /*
+     * step() in pieces, so that parameters can be updated as soon as their
+     * gradients are ready: begin_step() once, then update() of every
+     * parameter, whose columns may be split between concurrent calls.
+     */
+    void begin_step();
+    void update( size_t param, size_t col_begin, size_t col_end );
+
+    // Elements per update() task when the updates are split between
+    // threads, set by autotune()
+    static inline size_t task_size = 1 << 15;
+
+    size_t size() const;
+    const Matrix& param( size_t i ) const;
+
+    /*
+     * Moments and bias corrections, so that training can continue across
+     * runs as if it had not stopped. The file is tied to the parameters at
+     * the time of save(): load() refuses it (and keeps the fresh state) if
+     * the shapes or the parameters differ, e.g. after the model was
+     * retrained by another mode.
+     */
+    bool save( const std::string& path ) const;
+    bool load( const std::string& path );
 };
 
 
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+
+#include "model.hpp"
+
+
+/*
+ * Magnitude pruning of linear layers.
+ *
+ * Weights are pruned in blocks of `block_rows` consecutive rows of a column
+ * (1 = unstructured), blocks with the smallest L1 norm go first. Pruned
+ * weights are recorded in LinearLayer::_weight_mask, AdamOptimizer keeps them
+ * at zero during fine-tuning. The sparsity is raised gradually over epochs
+ * [start_epoch, end_epoch] along the cubic schedule of Zhu & Gupta:
+ *
+ *      s_t = s_f * ( 1 - ( 1 - t )^3 ),  t = progress through the schedule
+ */
+
+struct PruningSchedule {
+
+    float target_sparsity = 0.9f;
+    size_t start_epoch = 0;
+    size_t end_epoch = 0;
+    size_t block_rows = SPARSE_BLOCK_ROWS;
+
+    // Sparsity the layers should have during `epoch`
+    float sparsity_at( size_t epoch ) const;
+};
+
+
+// Prune the smallest weights of `layer` until `sparsity` of them are zero
+void prune_layer( LinearLayer& layer, float sparsity, size_t block_rows );
+
+// Fraction of zero weights
+float weight_sparsity( const LinearLayer& layer );
+
+
+/*
+ * Inference-only network of pruned layers in the block-sparse format.
+ */
+struct SparseLayer {
+    BlockSparseMatrix weights;
+    Matrix bias;
+    ActivationKind act;
+};
+
+
+class SparseNet {
+
+    std::vector< SparseLayer > _layers;
+
+public:
+    SparseNet() {}
+    explicit SparseNet( const NeuralNet& net );
+
+    Matrix forward( ConstMatrixView input ) const;
+    std::vector< size_t > predict( ConstMatrixView input ) const;
+
+    // Bytes of all weights and biases
+    size_t bytes() const;
+
+    // Sparse checkpoint, see pruning.cpp for the layout
+    bool save( const std::string& path ) const;
+    bool load( const std::string& path );
+
+    // Size of the file save() writes
+    size_t checkpoint_bytes() const;
+};
+
+
+// Report accuracy, latency and checkpoint size of the dense and the sparse
+// version of a pruned network on `data`
+void compare_sparse( NeuralNet& dense, const SparseNet& sparse,
+                     const Matrix& data, const std::vector< int >& labels );
@@ -1,59 +1,114 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <random>
+#include <vector>
 
 
-class RNG {
+/*
+ * Counter-based random numbers, Philox4x32-10 (Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3").
+ *
+ * Block `counter` of stream `stream` under key `key` is a pure function of
+ * the three, so any range of a stream can be generated independently. Vectors
+ * are filled in parallel with the same result for any number of threads, and
+ * every stream id gives an independent generator (one per thread, per
+ * shuffled dataset, ...).
+ */
+struct Philox {
+
+    using Block = std::array< uint32_t, 4 >;
+
+    static Block generate( uint64_t key, uint64_t stream, uint64_t counter );
+};
+
+
+/*
+ * Sequential view of one stream, a UniformRandomBitGenerator usable with
+ * std::shuffle and the std distributions.
+ */
+class RandomStream {
 
-    std::random_device rd;
-    std::mt19937 gen{ std::random_device{}() };
+    uint64_t _key = 0;
+    uint64_t _stream = 0;
+    uint64_t _counter = 0;
 
-    std::uniform_real_distribution< float > unif_dist;
-    std::normal_distribution< float > norm_dist;
+    Philox::Block _block{};
+    size_t _used = 4;
 
 public:
-    RNG() : rd(), gen() {
-        gen.seed( rd() );
+    using result_type = uint32_t;
+
+    RandomStream() {}
+    RandomStream( uint64_t seed, uint64_t stream ) : _key( seed ), _stream( stream ) {}
+
+    static constexpr result_type min() {
+        return 0;
     }
 
-    void seed() {
-        gen.seed( rd() );
+    static constexpr result_type max() {
+        return std::numeric_limits< result_type >::max();
     }
 
-    std::mt19937& get_gen(){
-        return gen;
+    result_type operator()() {
+        if ( _used == 4 ) {
+            _block = Philox::generate( _key, _stream, _counter++ );
+            _used = 0;
+        }
+
+        return _block[_used++];
     }
 
-    void seed( unsigned seed ) {
-        gen.seed( seed );
+    // Uniform in [0, 1)
+    float uniform() {
+        return ( operator()() >> 8 ) * ( 1.f / ( 1 << 24 ) );
     }
+};
 
-    std::vector< float > normal_vec( size_t count,
-                                     float mu,
-                                     float std ){
 
-        std::vector< float > result( count );
-        norm_dist = std::normal_distribution<float>(mu, std);
+/*
+ * Global generator for weight initialization.
+ *
+ * Every *_vec call takes the next unused range of stream 0, so the values
+ * depend only on the seed and the order of calls, and concurrent calls are
+ * safe. Large vectors are filled by several threads, normals come from a
+ * branch free Box-Muller transform that the compiler vectorizes.
+ */
+class RNG {
 
-        std::generate( result.begin(), result.end(), [&](){ return norm_dist(gen); });
+    uint64_t _seed = 0;
+    std::atomic< uint64_t > _offset{ 0 };
 
-        return result;
+public:
+    RNG() {
+        seed();
     }
 
-    std::vector< float > uniform_vec( size_t count,
-                                      float min,
-                                      float max ){
+    // Seed from std::random_device
+    void seed();
+    void seed( unsigned seed );
 
-        std::vector< float > result( count );
-        unif_dist = std::uniform_real_distribution<float>(min, max);
+    // Independent stream `id`, never overlapping the *_vec values
+    RandomStream stream( uint64_t id ) const;
 
-        std::generate( result.begin(), result.end(), [&](){ return unif_dist(gen); });
+    std::vector< float > normal_vec( size_t count,
+                                     float mu,
+                                     float std );
 
-        return result;
-    }
+    std::vector< float > uniform_vec( size_t count,
+                                      float min,
+                                      float max );
 };
 
 extern RNG rng;
+
+
+// Ids of the streams of `rng` that shuffle data. Trainers take
+// TRAINER_STREAM + their index, so concurrent ones shuffle independently
+constexpr uint64_t REPLAY_STREAM = 1;
+constexpr uint64_t TRAINER_STREAM = uint64_t( 1 ) << 32;
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint.hpp"
+
+
+/*
+ * Local inference server with dynamic batching.
+ *
+ * Requests are queued as they arrive. Every worker of the pool waits for the
+ * first request in the queue, then for more until it has `max_batch` of them
+ * or the first one has waited `max_wait_us`. The batch is run as one forward
+ * pass and each request gets its prediction. Concurrent clients thus share
+ * batched GEMMs, while a lone request never waits longer than `max_wait_us`.
+ *
+ * The model can be replaced while serving (e.g. by online training): a new
+ * version is swapped in atomically, every batch runs entirely on the
+ * version current when it started.
+ *
+ * Protocols:
+ *
+ *      stdin / stdout: one sample per line, comma separated as in the dataset
+ *          CSV, answered by a line with the predicted class (or "error"),
+ *          in order
+ *
+ *      Unix domain socket, binary (native endianness):
+ *          request   uint32 n, then n floats
+ *          response  int32 class, -1 for a sample of a wrong dimension
+ *          n = 0 asks for statistics instead: uint32 length, then text
+ */
+
+// Histogram of latencies in power of two buckets of microseconds
+class LatencyHistogram {
+
+    static constexpr size_t BUCKETS = 32;
+    std::array< std::atomic< uint64_t >, BUCKETS > _counts{};
+
+public:
+    void record( double us );
+    uint64_t count() const;
+
+    // Upper bound of the bucket holding the `p`-th percentile (0 - 100)
+    double percentile( double p ) const;
+
+    std::string summary() const;
+};
+
+
+struct ServerConfig {
+    size_t max_batch = 32;
+    size_t max_wait_us = 1000;
+
+    // 0 = one per core
+    size_t workers = 0;
+};
+
+
+class BatchingServer {
+
+    using clock = std::chrono::steady_clock;
+
+    struct Request {
+        std::vector< float > input;
+        std::promise< int > result;
+        clock::time_point arrival;
+    };
+
+    // Layers for raw samples, e.g. a compiled checkpoint, accessed only by
+    // std::atomic_load / std::atomic_store
+    std::shared_ptr< const std::vector< LayerParams > > _layers;
+    size_t _input_dim;
+    ServerConfig _config;
+
+    std::deque< Request > _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop = false;
+
+    std::vector< std::thread > _workers;
+
+    // Statistics
+    LatencyHistogram _latency;
+    std::atomic< uint64_t > _requests{ 0 };
+    std::atomic< uint64_t > _batches{ 0 };
+    std::atomic< uint64_t > _model_updates{ 0 };
+    clock::time_point _start;
+
+public:
+    BatchingServer( std::vector< LayerParams >&& layers, const ServerConfig& config );
+    ~BatchingServer();
+
+    size_t input_dim() const;
+
+    // Queue a sample, the future gets its class (-1 if the sample is invalid)
+    std::future< int > submit( std::vector< float >&& input );
+
+    // Serve `layers` from the next batch on, false (and the old model
+    // kept) if they take inputs of another dimension
+    bool update_model( std::vector< LayerParams >&& layers );
+
+    // Finish queued requests and stop the workers
+    void stop();
+
+    // Throughput counters, batch sizes and latency percentiles
+    std::string statistics() const;
+
+private:
+    void work();
+
+    // Logits of a batch of samples (one per column)
+    static Matrix forward( const std::vector< LayerParams >& layers, Matrix&& input );
+};
+
+
+// Serve lines of stdin until EOF
+int serve_stdin( BatchingServer& server );
+
+// Serve a Unix domain socket until SIGINT / SIGTERM
+int serve_socket( BatchingServer& server, const std::string& path );
+
+
+/*
+ * Load generator: `clients` connections each send `requests` samples (taken
+ * round robin from `samples`) one after another and wait for the answers.
+ * Reports client side latency, throughput, accuracy if `labels` are given,
+ * and the statistics of the server.
+ */
+int run_load_generator( const std::string& path, const std::vector< std::vector< float > >& samples,
+                        const std::vector< int >& labels, size_t clients, size_t requests );
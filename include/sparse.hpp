@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "lingebra.hpp"
+
+/*
+ * Sparse batch of input vectors.
+ *
+ * Stored as CSR with one row per sample, which is the same as compressed
+ * columns of our column-major (features x batch) layout: the nonzeros of
+ * sample `col` are indices/values in [offsets[col], offsets[col + 1]).
+ */
+struct SparseMatrix {
+
+    // number of features / number of samples, as in the dense Matrix
+    size_t rows = 0;
+    size_t cols = 0;
+
+    std::vector< size_t > offsets = { 0 };
+    std::vector< uint32_t > indices;
+    std::vector< float > values;
+
+    SparseMatrix() {}
+    SparseMatrix( size_t rows ) : rows( rows ) {}
+
+    // Build from a dense matrix (or view), dropping exact zeros
+    static SparseMatrix from_dense( ConstMatrixView dense ) {
+        SparseMatrix res( dense.rows );
+        for ( size_t col = 0; col < dense.cols; col++ ){
+            res.append_sample( dense.col( col ), dense.rows );
+        }
+
+        return res;
+    }
+
+    // Append one sample (a column) of `rows` features
+    void append_sample( const float* sample, size_t n ) {
+        assert( n == rows );
+
+        for ( size_t row = 0; row < n; row++ ){
+            if ( sample[row] != 0.f ) {
+                indices.push_back( row );
+                values.push_back( sample[row] );
+            }
+        }
+
+        offsets.push_back( indices.size() );
+        cols++;
+    }
+
+    size_t nonzeros() const {
+        return values.size();
+    }
+
+    float density() const {
+        return rows * cols == 0 ? 0.f : float( nonzeros() ) / ( rows * cols );
+    }
+
+    Matrix to_dense() const {
+        Matrix res( rows, cols );
+        for ( size_t col = 0; col < cols; col++ ){
+            for ( size_t i = offsets[col]; i < offsets[col + 1]; i++ ){
+                res.at( indices[i], col ) = values[i];
+            }
+        }
+
+        return res;
+    }
+};
+
+
+// Fraction of nonzero elements of a dense block
+inline float density( ConstMatrixView dense ) {
+
+    size_t nonzeros = 0;
+    for ( size_t col = 0; col < dense.cols; col++ ){
+        const float* in = dense.col( col );
+        for ( size_t row = 0; row < dense.rows; row++ ){
+            nonzeros += ( in[row] != 0.f );
+        }
+    }
+
+    return dense.rows * dense.cols == 0 ? 0.f : float( nonzeros ) / ( dense.rows * dense.cols );
+}
+
+
+/*
+ * Sparse-dense kernels, only nonzero input elements cost any work.
+ */
+
+// c = a * b, b sparse
+inline void sparse_gemm( ConstMatrixView a, const SparseMatrix& b, MatrixView c ) {
+
+    assert( a.cols == b.rows && c.rows == a.rows && c.cols == b.cols );
+
+    for ( size_t col2 = 0; col2 < b.cols; col2++ ){
+
+        float* __restrict__ res = c.col( col2 );
+        std::fill( res, res + c.rows, 0.f );
+
+        for ( size_t i = b.offsets[col2]; i < b.offsets[col2 + 1]; i++ ){
+
+            const float* __restrict__ lhs = a.col( b.indices[i] );
+            const float scale = b.values[i];
+
+            for ( size_t row1 = 0; row1 < a.rows; row1++ ){
+                res[row1] += lhs[row1] * scale;
+            }
+        }
+    }
+}
+
+// c = a * b^T, b sparse (weight gradients of a layer with sparse inputs)
+inline void sparse_gemm_transposed( ConstMatrixView a, const SparseMatrix& b, MatrixView c ) {
+
+    assert( a.cols == b.cols && c.rows == a.rows && c.cols == b.rows );
+
+    for ( size_t col = 0; col < c.cols; col++ ){
+        std::fill( c.col( col ), c.col( col ) + c.rows, 0.f );
+    }
+
+    // every nonzero b(k, j) scatters column j of `a` into column k of `c`
+    for ( size_t col1 = 0; col1 < b.cols; col1++ ){
+
+        const float* __restrict__ lhs = a.col( col1 );
+
+        for ( size_t i = b.offsets[col1]; i < b.offsets[col1 + 1]; i++ ){
+
+            float* __restrict__ res = c.col( b.indices[i] );
+            const float scale = b.values[i];
+
+            for ( size_t row1 = 0; row1 < a.rows; row1++ ){
+                res[row1] += lhs[row1] * scale;
+            }
+        }
+    }
+}
+
+
+/*
+ * Block-sparse weight matrix for pruned layers.
+ *
+ * Columns are cut into blocks of SPARSE_BLOCK_ROWS consecutive rows, only
+ * blocks with a nonzero element are stored. Nonzero blocks of column `col`
+ * are [offsets[col], offsets[col + 1]), block `i` covers rows
+ * block_rows[i] * SPARSE_BLOCK_ROWS ... and keeps its values contiguously at
+ * values[i * SPARSE_BLOCK_ROWS].
+ */
+constexpr size_t SPARSE_BLOCK_ROWS = 8;
+
+struct BlockSparseMatrix {
+
+    size_t rows = 0;
+    size_t cols = 0;
+
+    std::vector< size_t > offsets = { 0 };
+    std::vector< uint32_t > block_rows;
+    aligned_vector values;
+
+    BlockSparseMatrix() {}
+
+    static BlockSparseMatrix from_dense( ConstMatrixView dense ) {
+
+        BlockSparseMatrix res;
+        res.rows = dense.rows;
+        res.cols = dense.cols;
+        res.offsets.reserve( dense.cols + 1 );
+
+        for ( size_t col = 0; col < dense.cols; col++ ){
+            for ( size_t row = 0; row < dense.rows; row += SPARSE_BLOCK_ROWS ){
+
+                size_t height = std::min( SPARSE_BLOCK_ROWS, dense.rows - row );
+                const float* block = dense.col( col ) + row;
+
+                if ( std::all_of( block, block + height, []( float x ){ return x == 0.f; } ) ) {
+                    continue;
+                }
+
+                res.block_rows.push_back( row / SPARSE_BLOCK_ROWS );
+                res.values.insert( res.values.end(), block, block + height );
+                res.values.insert( res.values.end(), SPARSE_BLOCK_ROWS - height, 0.f );
+            }
+
+            res.offsets.push_back( res.block_rows.size() );
+        }
+
+        return res;
+    }
+
+    size_t blocks() const {
+        return block_rows.size();
+    }
+
+    // Bytes needed to store the matrix
+    size_t bytes() const {
+        return offsets.size() * sizeof( size_t ) + block_rows.size() * sizeof( uint32_t ) +
+               values.size() * sizeof( float );
+    }
+
+    Matrix to_dense() const {
+        Matrix res( rows, cols );
+        for ( size_t col = 0; col < cols; col++ ){
+            for ( size_t i = offsets[col]; i < offsets[col + 1]; i++ ){
+                size_t row = block_rows[i] * SPARSE_BLOCK_ROWS;
+                for ( size_t k = 0; k < SPARSE_BLOCK_ROWS && row + k < rows; k++ ){
+                    res.at( row + k, col ) = values[i * SPARSE_BLOCK_ROWS + k];
+                }
+            }
+        }
+
+        return res;
+    }
+};
+
+
+// One block as a single vector register, the compiler does not vectorize an
+// 8-iteration loop on its own. Views need not be aligned to whole blocks.
+typedef float block_float __attribute__(( vector_size( SPARSE_BLOCK_ROWS * sizeof( float ) ), aligned( 4 ) ));
+
+// c = a * b, a block-sparse. Rows of `c` must be padded to whole blocks
+// (which padded_rows() guarantees), zero elements of b are skipped.
+inline void block_sparse_gemm( const BlockSparseMatrix& a, ConstMatrixView b, MatrixView c ) {
+
+    assert( a.cols == b.rows && c.rows == a.rows && c.cols == b.cols );
+    assert( c.ld % SPARSE_BLOCK_ROWS == 0 && c.ld >= padded_rows( c.rows ) );
+
+    for ( size_t col2 = 0; col2 < b.cols; col2++ ){
+
+        float* __restrict__ res = c.col( col2 );
+        std::fill( res, res + c.rows, 0.f );
+
+        for ( size_t col1 = 0; col1 < a.cols; col1++ ){
+
+            const float scale = b.at( col1, col2 );
+            if ( scale == 0.f ) {
+                continue;
+            }
+
+            for ( size_t i = a.offsets[col1]; i < a.offsets[col1 + 1]; i++ ){
+                auto* out = reinterpret_cast< block_float* >( res + a.block_rows[i] * SPARSE_BLOCK_ROWS );
+                auto* block = reinterpret_cast< const block_float* >( a.values.data() + i * SPARSE_BLOCK_ROWS );
+
+                *out += *block * scale;
+            }
+        }
+    }
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <array>
+#include <tuple>
+#include <utility>
+
+#include "checkpoint.hpp"
+
+
+/*
+ * Compile-time fixed-topology network.
+ *
+ *      StaticNeuralNet< Layer< 784, 256, ReLU >, Layer< 256, 10, Identity > >
+ *
+ * All feature dimensions are constexpr, so every kernel below is instantiated
+ * for its exact shape and the activation is called on a final class (inlined,
+ * no virtual dispatch). Single-sample inference runs in statically sized
+ * buffers; batched forward / backward use Matrix buffers that are reused as
+ * long as the batch size does not change.
+ *
+ * Parameters are stored in Matrix objects in the same order as in NeuralNet,
+ * so AdamOptimizer( net.params(), net.grads(), ... ) and the checkpoint
+ * functions work unchanged.
+ */
+
+template < size_t In, size_t Out, typename Act >
+struct Layer {
+
+    static constexpr size_t input_dim = In;
+    static constexpr size_t output_dim = Out;
+
+    // leading dimension of all Out x ? matrices of this layer
+    static constexpr size_t ld = padded_rows( Out );
+
+    Matrix weights = Matrix( Out, In );
+    Matrix bias = Matrix( Out, 1 );
+
+    Matrix weight_gradients = Matrix( Out, In );
+    Matrix bias_gradients = Matrix( Out, 1 );
+
+    // Batch state of the last forward pass in training mode
+    Matrix inputs;
+    Matrix outputs;
+    Matrix potentials_derivatives;
+    Matrix prev_derivatives;
+
+    Layer() {
+        std::vector< float > init = rng.normal_vec( Out * In, 0.0, 1.0 / std::sqrt( In ) );
+        weights = Matrix( std::move( init ), Out, In );
+        bias.add_scalar( 0.01 );
+    }
+
+    static ActivationKind kind() {
+        return Act::get_instance()->kind();
+    }
+
+    // out = act( W * in + b ) for a single sample
+    void forward_sample( const float* __restrict__ in, float* __restrict__ out ) const {
+
+        const float* __restrict__ w = weights.column( 0 );
+        std::copy( bias.column( 0 ), bias.column( 0 ) + Out, out );
+
+        for ( size_t col = 0; col < In; col++ ){
+            const float x = in[col];
+            for ( size_t row = 0; row < Out; row++ ){
+                out[row] += w[col * ld + row] * x;
+            }
+        }
+
+        for ( size_t row = 0; row < Out; row++ ){
+            out[row] = Act::get_instance()->forward( out[row] );
+        }
+    }
+
+    // Batched forward pass, stores backprop info if `training`
+    const Matrix& forward( ConstMatrixView in, bool training ) {
+
+        assert( in.rows == In );
+        size_t batch = in.cols;
+
+        if ( outputs.cols != batch ) {
+            outputs = Matrix( Out, batch );
+            potentials_derivatives = Matrix( Out, batch );
+        }
+
+        for ( size_t j = 0; j < batch; j++ ){
+            float* __restrict__ out = outputs.column( j );
+            forward_sample( in.col( j ), out );
+
+            // \sigma'(potential) from the activated value, valid for ReLU / Id
+            if ( training ) {
+                float* __restrict__ der = potentials_derivatives.column( j );
+                for ( size_t row = 0; row < Out; row++ ){
+                    der[row] = Act::get_instance()->backward( out[row] );
+                }
+            }
+        }
+
+        if ( training ) {
+            inputs = Matrix( in );
+        }
+
+        return outputs;
+    }
+
+    // Backward pass of the layer, see LinearLayer::backward. Derivatives
+    // w.r.t. the inputs are left in `prev_derivatives` if `propagate` is set
+    void backward( Matrix&& derivatives, bool propagate ) {
+
+        size_t batch = derivatives.cols;
+        derivatives.cwise_product( potentials_derivatives );
+
+        // weight gradients = D * inputs^T, bias gradients = row sums of D
+        std::fill( weight_gradients.data().begin(), weight_gradients.data().end(), 0.f );
+        std::fill( bias_gradients.data().begin(), bias_gradients.data().end(), 0.f );
+
+        float* __restrict__ wg = weight_gradients.column( 0 );
+        float* __restrict__ bg = bias_gradients.column( 0 );
+
+        for ( size_t j = 0; j < batch; j++ ){
+            const float* __restrict__ d = derivatives.column( j );
+            const float* __restrict__ x = inputs.column( j );
+
+            for ( size_t col = 0; col < In; col++ ){
+                const float xk = x[col];
+                for ( size_t row = 0; row < Out; row++ ){
+                    wg[col * ld + row] += d[row] * xk;
+                }
+            }
+
+            for ( size_t row = 0; row < Out; row++ ){
+                bg[row] += d[row];
+            }
+        }
+
+        // derivatives w.r.t. inputs = W^T * D, as dot products of columns
+        if ( propagate ) {
+            if ( prev_derivatives.cols != batch ) {
+                prev_derivatives = Matrix( In, batch );
+            }
+
+            const float* __restrict__ w = weights.column( 0 );
+            for ( size_t j = 0; j < batch; j++ ){
+                const float* __restrict__ d = derivatives.column( j );
+                float* __restrict__ prev = prev_derivatives.column( j );
+
+                for ( size_t col = 0; col < In; col++ ){
+                    float sum = 0.f;
+                    for ( size_t row = 0; row < Out; row++ ){
+                        sum += w[col * ld + row] * d[row];
+                    }
+                    prev[col] = sum;
+                }
+            }
+        }
+    }
+};
+
+
+template < typename... Layers >
+class StaticNeuralNet {
+
+    static_assert( sizeof...( Layers ) > 0, "StaticNeuralNet needs at least one layer" );
+
+    using layer_tuple = std::tuple< Layers... >;
+
+    template < size_t I >
+    using layer_t = std::tuple_element_t< I, layer_tuple >;
+
+    static constexpr size_t depth = sizeof...( Layers );
+
+    template < size_t... I >
+    static constexpr bool chained( std::index_sequence< I... > ) {
+        return ( ( layer_t< I >::output_dim == layer_t< I + 1 >::input_dim ) && ... && true );
+    }
+
+    static_assert( chained( std::make_index_sequence< depth - 1 >() ),
+                   "output dimension of every layer has to match input of the next one" );
+
+    static constexpr size_t max_dim = std::max( { Layers::input_dim..., Layers::output_dim... } );
+
+    layer_tuple _layers;
+
+    bool _evaluation = false;
+
+    // Ping-pong buffers for single-sample inference
+    alignas( MATRIX_ALIGNMENT ) std::array< float, padded_rows( max_dim ) > _scratch[2];
+
+    template < size_t I >
+    const float* forward_sample( const float* in ) {
+        float* out = _scratch[I % 2].data();
+        std::get< I >( _layers ).forward_sample( in, out );
+
+        if constexpr ( I + 1 < depth ) {
+            return forward_sample< I + 1 >( out );
+        }
+        else {
+            return out;
+        }
+    }
+
+    template < size_t I >
+    Matrix forward_batch( ConstMatrixView in ) {
+        const Matrix& out = std::get< I >( _layers ).forward( in, !_evaluation );
+
+        if constexpr ( I + 1 < depth ) {
+            return forward_batch< I + 1 >( out );
+        }
+        else {
+            return out;
+        }
+    }
+
+    template < size_t I >
+    void backward_batch( Matrix&& derivatives ) {
+        auto& layer = std::get< I >( _layers );
+        layer.backward( std::move( derivatives ), I > 0 );
+
+        if constexpr ( I > 0 ) {
+            backward_batch< I - 1 >( std::move( layer.prev_derivatives ) );
+        }
+    }
+
+    template < typename func, size_t... I >
+    void for_each_layer( func f, std::index_sequence< I... > ) {
+        ( f( std::get< I >( _layers ) ), ... );
+    }
+
+public:
+
+    static constexpr size_t input_dim = layer_t< 0 >::input_dim;
+    static constexpr size_t output_dim = layer_t< depth - 1 >::output_dim;
+
+    void evaluation() { _evaluation = true; }
+    void training() { _evaluation = false; }
+
+    template < size_t I >
+    auto& layer() { return std::get< I >( _layers ); }
+
+    std::vector< Matrix* > params() {
+        std::vector< Matrix* > res;
+        for_each_layer( [&]( auto& l ){ res.push_back( &l.weights ); res.push_back( &l.bias ); },
+                        std::make_index_sequence< depth >() );
+        return res;
+    }
+
+    std::vector< Matrix* > grads() {
+        std::vector< Matrix* > res;
+        for_each_layer( [&]( auto& l ){ res.push_back( &l.weight_gradients ); res.push_back( &l.bias_gradients ); },
+                        std::make_index_sequence< depth >() );
+        return res;
+    }
+
+    Matrix forward( ConstMatrixView input ) {
+        return forward_batch< 0 >( input );
+    }
+
+    void backward( Matrix&& derivatives ) {
+        backward_batch< depth - 1 >( std::move( derivatives ) );
+    }
+
+    std::vector< size_t > predict( ConstMatrixView input ) {
+        evaluation();
+        return predictions( forward( input ) );
+    }
+
+    // Logits of a single sample, valid until the next call
+    const float* forward( const float* sample ) {
+        return forward_sample< 0 >( sample );
+    }
+
+    size_t predict( const float* sample ) {
+        const float* logits = forward( sample );
+        return std::max_element( logits, logits + output_dim ) - logits;
+    }
+
+    /*
+     * Checkpoint interoperability, the layer list has to match this topology.
+     */
+    std::vector< LayerParams > get_layer_params() {
+        std::vector< LayerParams > res;
+        for_each_layer( [&]( auto& l ){ res.push_back( { l.kind(), l.weights, l.bias } ); },
+                        std::make_index_sequence< depth >() );
+        return res;
+    }
+
+    bool set_layer_params( const std::vector< LayerParams >& layers ) {
+        if ( layers.size() != depth ) {
+            std::cout << "Checkpoint has " << layers.size() << " layers, expected " << depth << "\n";
+            return false;
+        }
+
+        bool ok = true;
+        size_t i = 0;
+        for_each_layer( [&]( auto& l ){
+            const LayerParams& p = layers[i++];
+            ok = ok && p.act == l.kind() && p.weights.rows == l.output_dim &&
+                 p.weights.cols == l.input_dim && p.bias.rows == l.output_dim;
+        }, std::make_index_sequence< depth >() );
+
+        if ( !ok ) {
+            std::cout << "Checkpoint does not match the static topology\n";
+            return false;
+        }
+
+        i = 0;
+        for_each_layer( [&]( auto& l ){
+            l.weights = layers[i].weights;
+            l.bias = layers[i].bias;
+            i++;
+        }, std::make_index_sequence< depth >() );
+
+        return true;
+    }
+
+    bool save( const std::string& path ) {
+        return write_checkpoint( path, get_layer_params() );
+    }
+
+    bool load( const std::string& path ) {
+        std::vector< LayerParams > layers;
+        return read_checkpoint( path, layers ) && set_layer_params( layers );
+    }
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "lingebra.hpp"
+
+
+/*
+ * Mean and variance of a stream of values in a single pass (Welford).
+ * Partial results, e.g. of several threads, are combined by merge()
+ * (Chan et al.), which is exact up to rounding. Accumulates in double, so
+ * tens of millions of values lose no precision.
+ */
+struct RunningStats {
+
+    size_t count = 0;
+    double mean = 0;
+
+    // Sum of squared deviations from the mean
+    double m2 = 0;
+
+    void add( double x );
+    void merge( const RunningStats& rhs );
+
+    // Sample variance, 0 for fewer than two values
+    double variance() const;
+    double sd() const;
+};
+
+
+// Statistics of every feature of a dataset
+struct FeatureStats {
+
+    std::vector< RunningStats > features;
+
+    void merge( const FeatureStats& rhs );
+
+    // Statistics of all values of all features together
+    RunningStats global() const;
+};
+
+
+// One pass over the samples, split between `threads` threads (0 = all cores)
+FeatureStats compute_statistics( const std::vector< std::vector< float > >& vectors, size_t threads = 0 );
+
+
+/*
+ * Affine input normalization x' = ( x - mean ) * scale.
+ *
+ * Applied to samples as batches are gathered, so the dataset itself stays
+ * untouched. Global normalization stores the same mean / scale for all
+ * features. Features of zero variance are only centered.
+ */
+struct Normalization {
+
+    std::vector< float > mean;
+    std::vector< float > scale;
+
+    static Normalization global( const FeatureStats& stats );
+    static Normalization per_feature( const FeatureStats& stats );
+
+    bool empty() const;
+
+    // Normalize one sample of mean.size() features, `out` may be `in`
+    void apply( const float* in, float* out ) const;
+
+    // Normalize every column in place
+    void apply( MatrixView samples ) const;
+};
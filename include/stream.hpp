@@ -0,0 +1,157 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lingebra.hpp"
+#include "random.hpp"
+#include "statistics.hpp"
+
+
+/*
+ * Out-of-core datasets.
+ *
+ * A dataset is a list of shards, each either a pair of CSV files in the
+ * format read by Loader (vectors, labels) or a single binary file:
+ *
+ *      magic, dim (uint32), count (uint64), then `count` records of
+ *      label (int32) followed by dim floats
+ *
+ * Binary shards are much faster to parse, shard_csv() converts a CSV dataset
+ * without loading it to memory.
+ */
+
+struct Shard {
+    std::string vectors;
+
+    // Labels of a CSV shard, empty for binary shards
+    std::string labels;
+};
+
+
+// Sequential reader of a single shard
+class ShardReader {
+
+    std::ifstream _vectors;
+    std::ifstream _labels;
+
+    bool _binary = false;
+    size_t _dim = 0;
+
+    // Samples left in a binary shard
+    size_t _remaining = 0;
+
+    // First sample of a CSV shard, parsed by open() to learn the dimension
+    std::vector< float > _first;
+    bool _has_first = false;
+
+public:
+    // Return false (and report why) if the shard cannot be read
+    bool open( const Shard& shard );
+
+    size_t dim() const;
+
+    // Read the next sample to `out` (dim() floats), false at the end
+    bool next( float* out, int& label );
+};
+
+
+// Write samples as a binary shard
+bool write_shard( const std::string& path,
+                  const std::vector< std::vector< float > >& vectors,
+                  const std::vector< int >& labels );
+
+// Split a CSV dataset into binary shards <prefix>_<i>.bin of at most
+// `samples_per_shard` samples, returns the shards (empty on failure)
+std::vector< Shard > shard_csv( const std::string& vectors_csv, const std::string& labels_csv,
+                                const std::string& prefix, size_t samples_per_shard );
+
+// Statistics of all features in the shards in a single pass, shards are split
+// between `threads` threads (0 = all cores)
+FeatureStats shard_statistics( const std::vector< Shard >& shards, size_t threads = 0 );
+
+
+/*
+ * Dataset streamed from shards within a fixed memory budget.
+ *
+ * Every epoch reads the shards in a new random order on a background thread,
+ * which prefetches chunks of samples while the trainer computes. Batches are
+ * drawn from a shuffle buffer: every sample handed out is picked uniformly
+ * from the buffer and its slot refilled by the next sample read. Together
+ * with the shard permutation this approximates a full shuffle, the closer
+ * the larger the buffer is compared to a shard. The order depends only on
+ * the seed, not on the timing of the reader.
+ *
+ * Shuffle buffer and prefetched chunks never take more than the budget,
+ * whatever the size of the dataset.
+ */
+class StreamingDataset {
+
+    // Block of consecutive samples passed from the reader to the consumer
+    struct Chunk {
+        std::vector< float > values;
+        std::vector< int > labels;
+    };
+
+    std::vector< Shard > _shards;
+    size_t _dim = 0;
+
+    RandomStream _gen;
+
+    // Applied to features while batches are gathered
+    Normalization _normalization;
+
+    // Shuffle buffer of `_capacity` samples, the first `_buffered` are valid
+    std::vector< float > _buffer;
+    std::vector< int > _buffer_labels;
+    size_t _capacity = 0;
+    size_t _buffered = 0;
+
+    // Chunk the consumer currently takes samples from
+    Chunk _current;
+    size_t _cursor = 0;
+
+    // Prefetch queue, filled by the reader thread
+    size_t _chunk_samples = 0;
+    size_t _queue_capacity = 0;
+
+    std::thread _reader;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque< Chunk > _queue;
+    bool _reader_done = true;
+    bool _stop = false;
+
+public:
+    StreamingDataset( std::vector< Shard > shards, size_t memory_budget, unsigned seed = 42 );
+    ~StreamingDataset();
+
+    StreamingDataset( const StreamingDataset& ) = delete;
+    StreamingDataset& operator=( const StreamingDataset& ) = delete;
+
+    // Dimension of samples, 0 if the first shard could not be read
+    size_t dim() const;
+
+    void set_normalization( const Normalization& normalization );
+    bool normalized() const;
+
+    // Restart reading in a new shard order, drops what is left of the epoch
+    void start_epoch();
+
+    // Gather the next `size` samples (one per column) and their labels,
+    // false once the epoch has fewer samples left
+    bool next_batch( size_t size, Matrix& input, std::vector< int >& labels );
+
+    // Bytes taken by the shuffle buffer and the prefetched chunks
+    size_t memory_bytes() const;
+
+private:
+    void read_shards( std::vector< size_t > order );
+    bool pull_sample( float* out, int& label );
+    void stop_reader();
+};
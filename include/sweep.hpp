@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "trainer.hpp"
+
+
+/*
+ * Hyperparameter sweep with successive halving.
+ *
+ * The training samples are loaded and normalized once, every trial trains
+ * its own net on the same read-only Dataset. Trials run concurrently, one
+ * per thread, in rungs: all surviving trials train up to the epoch budget
+ * of the rung, are scored on the validation samples and only the best
+ * 1 / `eta` of them go on to the next rung with `eta` times the budget.
+ * Clearly losing configurations thus stop after a few epochs and most of
+ * the time goes to the promising ones.
+ */
+
+// One configuration of a 2 layer net (input - hidden relu - classes)
+struct TrialConfig {
+    float lr = 0.001;
+    float beta1 = 0.9;
+    float beta2 = 0.999;
+    size_t batch_size = 64;
+    size_t hidden = 256;
+};
+
+
+struct TrialResult {
+    TrialConfig config;
+
+    // Epochs trained before the trial finished or was stopped
+    size_t epochs = 0;
+
+    float train_loss = 0.f;
+
+    // On the validation samples, trials are ranked by the accuracy and then the loss
+    float loss = 0.f;
+    float accuracy = 0.f;
+    double seconds = 0.0;
+
+    bool stopped = false;
+};
+
+
+struct SweepConfig {
+    // Epochs of the first rung, the last one trains up to `max_epochs`
+    size_t min_epochs = 2;
+    size_t max_epochs = 18;
+    size_t eta = 3;
+
+    // Concurrent trials, 0 = one per core
+    size_t threads = 0;
+};
+
+
+// `count` configurations drawn around the defaults (lr log-uniformly)
+std::vector< TrialConfig > sample_trials( size_t count, uint64_t seed );
+
+// Results in the order of `trials`
+std::vector< TrialResult > run_sweep( std::shared_ptr< const Dataset > train,
+                                      const Matrix& validation, const std::vector< int >& validation_labels,
+                                      const std::vector< TrialConfig >& trials, const SweepConfig& config );
+
+// Table of the results, best first
+void print_sweep( const std::vector< TrialResult >& results );
+bool write_sweep_csv( const std::vector< TrialResult >& results, const std::string& path );
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/*
+ * Work-stealing task pool.
+ *
+ * Every worker owns a deque of tasks. Tasks submitted by a worker go to its
+ * own deque, other submissions are spread round robin. A worker runs its
+ * newest task first (the data it just touched are still in cache) and when
+ * its deque is empty it steals the oldest task of another worker. wait()
+ * lets the calling thread run tasks too until all of them are finished.
+ */
+class TaskPool {
+
+    using Task = std::function< void() >;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque< Task > tasks;
+    };
+
+    std::vector< std::unique_ptr< Queue > > _queues;
+    std::vector< std::thread > _workers;
+
+    // Submitted but not finished tasks
+    std::atomic< size_t > _pending{ 0 };
+    std::atomic< size_t > _next_queue{ 0 };
+
+    // Idle workers sleep on `_cv`, wait() on `_done_cv`
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::condition_variable _done_cv;
+    bool _stop = false;
+
+public:
+    // 0 threads = one per core
+    explicit TaskPool( size_t threads = 0 );
+    ~TaskPool();
+
+    TaskPool( const TaskPool& ) = delete;
+    TaskPool& operator=( const TaskPool& ) = delete;
+
+    size_t threads() const;
+
+    void submit( Task&& task );
+
+    // Run tasks on the calling thread until none is pending
+    void wait();
+
+private:
+    void work( size_t id );
+
+    // Take a task, preferring queue `id` (newest first), then steal (oldest first)
+    bool take( size_t id, Task& task );
+    void finish();
+};
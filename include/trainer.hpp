@@ -1,13 +1,30 @@
 #pragma once
 #include "model.hpp"
 #include "optimizer.hpp"
+#include "pruning.hpp"
+#include "stream.hpp"
+#include "tasks.hpp"
+#include "validation.hpp"
 #include <chrono>
 
 
+class RingAllReduce;
+struct SoftTargets;
+
+
+// Samples with their labels, may be shared read-only by several trainers
+struct Dataset {
+    std::vector< std::vector< float > > vectors;
+    std::vector< int > labels;
+};
+
+
 class Trainer {
 
-    // Generator that governs the data shuffling during training
-    std::mt19937 gen{ std::random_device{}() };
+    // Generator that governs the data shuffling during training, a stream of
+    // the global `rng` for deterministic shuffling, further calls of train()
+    // continue the sequence
+    RandomStream gen = rng.stream( TRAINER_STREAM );
 
     // Neural net that is optimized
     NeuralNet *model;
@@ -15,17 +32,125 @@ class Trainer {
     // Initialized optimizer object
     AdamOptimizer *optimizer;
 
-    std::vector< std::vector< float > > data;
-    std::vector< int > labels;
+    // In-memory samples, visited in the shuffled `order`
+    std::shared_ptr< const Dataset > dataset;
+    std::vector< size_t > order;
+
+    // Position of the next batch in `order`
+    size_t position = 0;
+
+    // Samples of the last batch of `dataset`
+    std::vector< size_t > batch_indices;
+
+    // Data streamed from disk, used instead of `dataset` if set
+    StreamingDataset *stream = nullptr;
+
+    // Gather batches directly in the sparse format (for mostly zero inputs)
+    bool sparse_inputs = false;
+
+    // Applied to samples while batches are gathered, the data stay raw
+    Normalization normalization;
+
+    // Gradual magnitude pruning of all layers during training
+    bool pruning = false;
+    PruningSchedule pruning_schedule;
+
+    bool verbose = true;
+
+    // Mean loss per sample in the last epoch
+    float last_loss = 0.f;
+
+    // Pool running the optimizer updates during backward(), indices of
+    // optimizer parameters by layer
+    std::unique_ptr< TaskPool > update_pool;
+    std::vector< std::vector< size_t > > layer_params;
 
+    // Averages gradients with the other ranks of a data-parallel job
+    RingAllReduce *gradient_sync = nullptr;
 
-    // Dataset of vectors : labels, data + labels zipped together
-    std::vector< std::pair< std::vector< float >, int > > dataset;
+    // Evaluates a snapshot of the weights after every epoch
+    BackgroundValidator *validator = nullptr;
+    EarlyStopping early_stopping;
+
+    // Soft targets of a teacher for every sample of `dataset`
+    std::shared_ptr< const SoftTargets > soft_targets;
+    float distillation_alpha = 0.f;
 
 public:
 
     Trainer( NeuralNet *m, AdamOptimizer *opt, 
             std::vector< std::vector< float > > d, std::vector< int > l );
 
-    void train( size_t epochs, size_t batch_size );
+    // Train on samples shared with other trainers
+    Trainer( NeuralNet *m, AdamOptimizer *opt, std::shared_ptr< const Dataset > data );
+
+    // Train on data that does not fit to memory
+    Trainer( NeuralNet *m, AdamOptimizer *opt, StreamingDataset *data );
+
+    // Shuffle with stream TRAINER_STREAM + `index` of `rng`, one per
+    // trainer that runs concurrently
+    void set_shuffle_stream( uint64_t index );
+
+    void set_sparse_inputs( bool sparse );
+    void set_normalization( const Normalization& norm );
+    void set_pruning( const PruningSchedule& schedule );
+
+    /*
+     * Update the parameters of each layer as soon as backward() has its
+     * gradients, on a pool of `threads` (0 = one per core) while the pass
+     * continues with earlier layers. Requires the optimizer to be built from
+     * the model. The result is the same as of the sequential step.
+     */
+    bool set_overlapped_updates( bool overlap, size_t threads = 0 );
+
+    /*
+     * Data-parallel training, gradients are averaged over all ranks before
+     * every optimizer step. All ranks must start from the same weights and
+     * take the same number of steps (see shard_dataset). Updates are not
+     * overlapped with the backward pass then.
+     */
+    void set_gradient_sync( RingAllReduce *sync );
+
+    // Validate the weights after every epoch in the background, possibly
+    // stopping early (see validation.hpp)
+    void set_validation( BackgroundValidator *v, const EarlyStopping& stopping = EarlyStopping() );
+
+    /*
+     * Distill a teacher: train on distillation_loss() with the cached soft
+     * targets of the samples (see distill.hpp), weight `alpha` on the soft
+     * part. Only for in-memory data, false if the targets do not match it.
+     */
+    bool set_distillation( std::shared_ptr< const SoftTargets > targets, float alpha );
+
+    // Print the loss and accuracy of every epoch (on by default)
+    void set_verbose( bool verbose );
+
+    // Mean training loss per sample in the last epoch
+    float epoch_loss() const;
+
+    /*
+     * Every optimizer step uses `batch_size` * `accumulation_steps` samples.
+     * They are passed through the model in micro-batches of `batch_size` and
+     * their gradients summed up, so the memory for activations does not grow
+     * with the effective batch size. The result is the same as of a single
+     * batch of all the samples.
+     *
+     * False if training stopped because gradients could not be averaged
+     * with the other ranks (see set_gradient_sync).
+     */
+    bool train( size_t epochs, size_t batch_size, size_t accumulation_steps = 1 );
+
+private:
+    // Shuffle the data for a new epoch
+    void start_epoch();
+
+    // Forward pass of the next `size` samples, false at the end of an epoch
+    bool forward_batch( size_t size, Matrix& logits, std::vector< int >& labels );
+
+    // Wait for the last validation results, restore the best weights
+    void finish_validation();
+
+    // Backward pass of the last micro-batch of a step, including the step,
+    // false if the gradient sync failed and no step was taken
+    bool backward_and_step( Matrix&& derivatives );
 };
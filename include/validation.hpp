@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "statistics.hpp"
+
+
+/*
+ * Held-out validation on a background thread.
+ *
+ * After an epoch the trainer hands over a copy of the weights (the only
+ * work on the training thread) and continues. The validator rebuilds a net
+ * from the snapshot, runs the validation samples through it in batches and
+ * records loss and accuracy, so validation never stalls the training loop.
+ *
+ * Early stopping looks at the results available so far: training stops
+ * once `patience` evaluated epochs passed without the validation loss
+ * improving on its best by more than `min_delta`. Results lag behind the
+ * training by about an epoch, a stopped run trains that much longer, but
+ * the snapshot of the best epoch is kept and can be restored.
+ */
+
+struct ValidationPoint {
+    size_t epoch;
+    float loss;
+    float accuracy;
+
+    // Time of the evaluation on the background thread
+    double seconds;
+};
+
+
+struct EarlyStopping {
+    // 0 = never stop early
+    size_t patience = 0;
+    float min_delta = 0.f;
+
+    // Load the weights of the best epoch into the model after training
+    bool restore_best = true;
+};
+
+
+class BackgroundValidator {
+
+    // Normalized samples, one per column
+    Matrix _data;
+    std::vector< int > _labels;
+    size_t _batch;
+
+    std::deque< std::pair< size_t, std::vector< LayerParams > > > _queue;
+    bool _busy = false;
+    bool _stop = false;
+
+    std::vector< ValidationPoint > _curve;
+
+    // Snapshot with the lowest loss, its index in `_curve`
+    std::vector< LayerParams > _best;
+    size_t _best_index = 0;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _worker;
+
+public:
+    // `samples` are raw, `norm` is applied once here
+    BackgroundValidator( ConstMatrixView samples, std::vector< int > labels,
+                         const Normalization& norm = Normalization(), size_t batch = 1024 );
+    ~BackgroundValidator();
+
+    // Queue the weights after `epoch` for evaluation
+    void submit( size_t epoch, std::vector< LayerParams >&& snapshot );
+
+    // Block until every submitted snapshot is evaluated
+    void wait();
+
+    // Results so far, in epoch order
+    std::vector< ValidationPoint > curve() const;
+
+    bool should_stop( const EarlyStopping& early_stopping ) const;
+
+    // Weights of the epoch with the lowest validation loss (empty before
+    // the first result)
+    std::vector< LayerParams > best() const;
+    size_t best_epoch() const;
+
+    bool write_csv( const std::string& path ) const;
+
+private:
+    void work();
+    ValidationPoint evaluate( size_t epoch, std::vector< LayerParams > snapshot ) const;
+};
@@ -0,0 +1,317 @@
+#include "autotune.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "tasks.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+
+// Microseconds of one call of `f`, the best of a few samples of at least a
+// millisecond each
+template < typename F >
+static double time_us( F&& f ) {
+
+    f();
+
+    size_t repeats = 1;
+    double best = std::numeric_limits< double >::infinity();
+
+    for ( size_t samples = 0; samples < 5; ) {
+        auto start = std::chrono::steady_clock::now();
+        for ( size_t i = 0; i < repeats; i++ ) {
+            f();
+        }
+
+        double us = std::chrono::duration< double, std::micro >( std::chrono::steady_clock::now() - start ).count();
+        if ( us < 1000.0 ) {
+            repeats *= 2;
+            continue;
+        }
+
+        best = std::min( best, us / repeats );
+        samples++;
+    }
+
+    return best;
+}
+
+
+// Uniform values in [ -1, 1 ), drawn from a stream of its own so that
+// tuning leaves `rng`, and with it the initialization of the net, alone
+static Matrix random_matrix( size_t rows, size_t cols ) {
+
+    RandomStream gen( 7, rows * 65536 + cols );
+    std::vector< float > values( rows * cols );
+    for ( float& v : values ) {
+        v = 2.f * gen.uniform() - 1.f;
+    }
+
+    return Matrix( values, rows, cols );
+}
+
+
+std::string cpu_model() {
+
+    std::ifstream cpuinfo( "/proc/cpuinfo" );
+    std::string line, model = "unknown";
+
+    while ( std::getline( cpuinfo, line ) ) {
+        if ( line.rfind( "model name", 0 ) == 0 ) {
+            size_t colon = line.find( ':' );
+            model = line.substr( std::min( line.size(), colon + 2 ) );
+            break;
+        }
+    }
+
+    // Tabs separate the fields of the cache
+    std::replace( model.begin(), model.end(), '\t', ' ' );
+    return model + " x" + std::to_string( std::thread::hardware_concurrency() );
+}
+
+
+std::vector< GemmShape > gemm_shapes( const NeuralNet& net, size_t batch ) {
+
+    std::vector< GemmShape > res;
+    auto add = [&]( GemmShape shape ){
+        for ( auto& s : res ) {
+            if ( s.rows == shape.rows && s.depth == shape.depth && s.cols == shape.cols ) {
+                return;
+            }
+        }
+        res.push_back( shape );
+    };
+
+    for ( auto& layer : net.layers() ) {
+        size_t out = layer->_weights.rows;
+        size_t in = layer->_weights.cols;
+
+        add( { out, in, batch } );
+        if ( layer->propagate_derivatives ) {
+            add( { in, out, batch } );
+        }
+        add( { out, batch, in } );
+    }
+
+    return res;
+}
+
+
+TunedGemm tune_gemm( const GemmShape& shape ) {
+
+    Matrix a = random_matrix( shape.rows, shape.depth );
+    Matrix b = random_matrix( shape.depth, shape.cols );
+    Matrix c( shape.rows, shape.cols );
+
+    GemmTuning saved = gemm_tuning;
+    gemm_tuning.shapes = { { shape.rows, shape.depth, shape.cols, GemmParams() } };
+
+    auto measure = [&]( const GemmParams& params ){
+        gemm_tuning.shapes[0].params = params;
+        return time_us( [&](){ gemm( a, b, c ); } );
+    };
+
+    // A candidate has to beat the current best by `margin`, so that timing
+    // noise does not pick blocks or threads that gain nothing in training
+    const double margin = 0.95;
+
+    TunedGemm best{ shape, GemmParams(), measure( GemmParams() ) };
+
+    // Blocks on one thread, sizes covering a whole dimension are the same as 0
+    for ( size_t rows : { 0, 32, 64, 128, 256 } ) {
+        for ( size_t depth : { 0, 64, 128, 256, 512 } ) {
+            if ( ( rows == 0 && depth == 0 ) || rows >= shape.rows || depth >= shape.depth ) {
+                continue;
+            }
+
+            GemmParams params{ rows, depth, 1 };
+            double us = measure( params );
+            if ( us < margin * best.us ) {
+                best = { shape, params, us };
+            }
+        }
+    }
+
+    // Then threads with the best blocking
+    size_t cores = std::max< size_t >( 1, std::thread::hardware_concurrency() );
+    for ( size_t threads = 2; threads <= std::min( cores, shape.cols ); threads *= 2 ) {
+        GemmParams params = best.params;
+        params.threads = threads;
+
+        double us = measure( params );
+        if ( us < margin * best.us ) {
+            best = { shape, params, us };
+        }
+    }
+
+    gemm_tuning = saved;
+    return best;
+}
+
+
+// Fastest task size of the optimizer updates of `net` on a pool of all cores
+static size_t tune_task_size( const NeuralNet& net ) {
+
+    size_t cores = std::thread::hardware_concurrency();
+    if ( cores <= 1 ) {
+        return AdamOptimizer::task_size;
+    }
+
+    std::vector< Matrix > params, grads;
+    for ( auto& layer : net.layers() ) {
+        for ( Matrix* m : layer->get_params() ) {
+            params.emplace_back( m->rows, m->cols );
+            grads.push_back( random_matrix( m->rows, m->cols ) );
+        }
+    }
+
+    std::vector< Matrix* > param_ptrs, grad_ptrs;
+    for ( size_t i = 0; i < params.size(); i++ ) {
+        param_ptrs.push_back( &params[i] );
+        grad_ptrs.push_back( &grads[i] );
+    }
+
+    AdamOptimizer opt( param_ptrs, grad_ptrs, 0.001, 0.9, 0.999 );
+    TaskPool pool( cores );
+
+    size_t best = AdamOptimizer::task_size;
+    double best_us = std::numeric_limits< double >::infinity();
+
+    for ( size_t task_size = 1 << 12; task_size <= ( 1 << 18 ); task_size <<= 2 ) {
+        double us = time_us( [&](){
+            opt.begin_step();
+            for ( size_t i = 0; i < opt.size(); i++ ) {
+                const Matrix& p = opt.param( i );
+                size_t step = std::max< size_t >( 1, task_size / std::max< size_t >( 1, p.rows ) );
+
+                for ( size_t col = 0; col < p.cols; col += step ) {
+                    size_t end = std::min( col + step, p.cols );
+                    pool.submit( [&opt, i, col, end](){ opt.update( i, col, end ); } );
+                }
+            }
+            pool.wait();
+        } );
+
+        if ( us < best_us ) {
+            best_us = us;
+            best = task_size;
+        }
+    }
+
+    return best;
+}
+
+
+bool autotune( const NeuralNet& net, size_t batch, const std::string& cache_path, bool retune ) {
+
+    std::string cpu = cpu_model();
+
+    std::vector< std::string > other_lines;
+    std::vector< TunedGemm > tuned;
+    size_t parallel_flops = 0;
+    size_t task_size = 0;
+
+    std::ifstream in( cache_path );
+    std::string line;
+    while ( std::getline( in, line ) ) {
+        size_t tab = line.find( '\t' );
+        if ( tab == std::string::npos || line.substr( 0, tab ) != cpu || retune ) {
+            if ( tab != std::string::npos && line.substr( 0, tab ) != cpu ) {
+                other_lines.push_back( line );
+            }
+            continue;
+        }
+
+        std::istringstream fields( line.substr( tab + 1 ) );
+        std::string kind;
+        fields >> kind;
+
+        if ( kind == "gemm" ) {
+            TunedGemm t;
+            fields >> t.shape.rows >> t.shape.depth >> t.shape.cols
+                   >> t.params.block_rows >> t.params.block_depth >> t.params.threads >> t.us;
+            if ( fields && t.params.threads > 0 ) {
+                tuned.push_back( t );
+            }
+        }
+        else if ( kind == "parallel_flops" ) {
+            fields >> parallel_flops;
+        }
+        else if ( kind == "update_task_size" ) {
+            fields >> task_size;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool changed = false;
+
+    for ( auto& shape : gemm_shapes( net, batch ) ) {
+        bool cached = false;
+        for ( auto& t : tuned ) {
+            cached |= t.shape.rows == shape.rows && t.shape.depth == shape.depth && t.shape.cols == shape.cols;
+        }
+
+        if ( !cached ) {
+            tuned.push_back( tune_gemm( shape ) );
+            changed = true;
+        }
+    }
+
+    if ( task_size == 0 ) {
+        task_size = tune_task_size( net );
+        changed = true;
+    }
+
+    // Shapes not tuned are split between threads from the size of the
+    // smallest tuned shape that gained from threads
+    if ( parallel_flops == 0 || changed ) {
+        parallel_flops = std::numeric_limits< size_t >::max();
+        for ( auto& t : tuned ) {
+            if ( t.params.threads > 1 ) {
+                parallel_flops = std::min( parallel_flops, 2 * t.shape.rows * t.shape.depth * t.shape.cols );
+            }
+        }
+    }
+
+    gemm_tuning.shapes.clear();
+    for ( auto& t : tuned ) {
+        gemm_tuning.shapes.push_back( { t.shape.rows, t.shape.depth, t.shape.cols, t.params } );
+    }
+    gemm_tuning.fallback_threads = std::max< size_t >( 1, std::thread::hardware_concurrency() );
+    gemm_tuning.parallel_flops = parallel_flops;
+    AdamOptimizer::task_size = task_size;
+
+    if ( !changed ) {
+        std::cout << "Loaded tuning of " << tuned.size() << " gemm shapes for " << cpu << " from " << cache_path << "\n";
+        return true;
+    }
+
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    std::cout << "Tuned for " << cpu << " in " << seconds << " s:\n";
+    for ( auto& t : tuned ) {
+        std::cout << "   gemm " << t.shape.rows << "x" << t.shape.depth << "x" << t.shape.cols
+                  << ": blocks " << t.params.block_rows << "x" << t.params.block_depth
+                  << ", " << t.params.threads << " threads, " << t.us << " us\n";
+    }
+    std::cout << "   optimizer update tasks of " << task_size << " elements\n";
+
+    std::ofstream out( cache_path );
+    if ( !out.is_open() ) {
+        std::cout << "Cannot open file " << cache_path << "\n";
+        return false;
+    }
+
+    for ( auto& l : other_lines ) {
+        out << l << "\n";
+    }
+
+    for ( auto& t : tuned ) {
+        out << cpu << "\tgemm " << t.shape.rows << " " << t.shape.depth << " " << t.shape.cols << " "
+            << t.params.block_rows << " " << t.params.block_depth << " " << t.params.threads << " " << t.us << "\n";
+    }
+    out << cpu << "\tparallel_flops " << parallel_flops << "\n";
+    out << cpu << "\tupdate_task_size " << task_size << "\n";
+
+    return out.good();
+}
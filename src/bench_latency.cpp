@@ -0,0 +1,84 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "inference.hpp"
+#include "static_model.hpp"
+
+
+/*
+ * Single-sample latency benchmark of the 784-256-10 network.
+ *
+ * Compares NeuralNet::predict on one column with the packed GEMV engine and
+ * the compile-time StaticNeuralNet, reports p50 / p99 latencies in
+ * microseconds.
+ */
+
+template < typename func >
+void report( const std::string& name, size_t iterations, func f ) {
+
+    std::vector< double > latencies;
+    latencies.reserve( iterations );
+
+    for ( size_t i = 0; i < iterations; i++ ) {
+        auto start = std::chrono::steady_clock::now();
+        f( i );
+        auto end = std::chrono::steady_clock::now();
+        latencies.push_back( std::chrono::duration< double, std::micro >( end - start ).count() );
+    }
+
+    std::sort( latencies.begin(), latencies.end() );
+    std::cout << name << ": p50 " << latencies[iterations / 2] << " us, p99 "
+              << latencies[iterations * 99 / 100] << " us\n";
+}
+
+
+int main() {
+
+    rng.seed( 1 );
+
+    auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+    };
+
+    NeuralNet net( std::move( layers ) );
+    InferenceEngine engine( net );
+    InferenceEngine::Workspace ws = engine.workspace();
+
+    auto static_net = std::make_unique< StaticNeuralNet< Layer< 784, 256, ReLU >, Layer< 256, 10, Identity > > >();
+    if ( !static_net->set_layer_params( layer_params( net ) ) ) {
+        return 1;
+    }
+
+    // Normalized Fashion-MNIST like inputs
+    size_t samples = 256;
+    size_t iterations = 20000;
+    Matrix inputs( rng.normal_vec( 784 * samples, 0.f, 1.f ), 784, samples );
+
+    // All paths have to agree before timing them
+    for ( size_t i = 0; i < samples; i++ ) {
+        size_t expected = net.predict( inputs.col_range( i, 1 ) )[0];
+        if ( expected != engine.predict( inputs.column( i ), ws ) ||
+             expected != static_net->predict( inputs.column( i ) ) ) {
+            std::cout << "Prediction mismatch on sample " << i << "\n";
+            return 1;
+        }
+    }
+
+    size_t sink = 0;
+    report( "NeuralNet::predict", iterations, [&]( size_t i ){
+        sink += net.predict( inputs.col_range( i % samples, 1 ) )[0];
+    } );
+
+    report( "InferenceEngine::predict", iterations, [&]( size_t i ){
+        sink += engine.predict( inputs.column( i % samples ), ws );
+    } );
+
+    report( "StaticNeuralNet::predict", iterations, [&]( size_t i ){
+        sink += static_net->predict( inputs.column( i % samples ) );
+    } );
+
+    // Printed so that the timed predictions cannot be optimized away
+    std::cout << "Checksum of the predictions " << sink << "\n";
+    return 0;
+}
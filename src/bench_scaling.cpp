@@ -0,0 +1,227 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+#include "optimizer.hpp"
+#include "trainer.hpp"
+
+
+/*
+ * Scaling benchmark of data-parallel training.
+ *
+ *      scaling-bench [shm|tcp] [max world] [epochs]
+ *
+ * For world = 1, 2, 4, ... up to `max world` forks that many ranks, which
+ * train the 784-256-10 network on their shards of a synthetic dataset (a
+ * fixed amount of work split between the ranks) and time a series of
+ * gradient sized all-reduces. Reports the time per epoch, speedup and
+ * efficiency against one rank, the share of the all-reduce in the training
+ * time and its bus bandwidth, and checks that all ranks end with the same
+ * weights.
+ */
+
+struct RankReport {
+    double train_seconds;
+    double sync_seconds;
+    double all_reduce_us;
+    double checksum;
+};
+
+
+// Normal inputs labelled by a random linear teacher
+static Dataset synthetic_dataset( size_t samples, size_t dim, size_t classes ) {
+
+    Dataset res;
+    std::vector< float > teacher = rng.normal_vec( dim * classes, 0.f, 1.f );
+
+    for ( size_t i = 0; i < samples; i++ ) {
+        std::vector< float > x = rng.normal_vec( dim, 0.f, 1.f );
+
+        size_t label = 0;
+        float best = -std::numeric_limits< float >::infinity();
+        for ( size_t c = 0; c < classes; c++ ) {
+            float score = 0.f;
+            for ( size_t f = 0; f < dim; f++ ) {
+                score += teacher[c * dim + f] * x[f];
+            }
+            if ( score > best ) {
+                best = score;
+                label = c;
+            }
+        }
+
+        res.vectors.push_back( std::move( x ) );
+        res.labels.push_back( label );
+    }
+
+    return res;
+}
+
+
+static bool run_rank( const DistributedConfig& config, const Dataset& data, size_t epochs, RankReport& report ) {
+
+    auto transport = connect_ring( config );
+    if ( !transport ) {
+        return false;
+    }
+
+    RingAllReduce ring( std::move( transport ) );
+
+    rng.seed( 1 );
+    auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+    };
+
+    NeuralNet net( std::move( layers ) );
+    AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+
+    Trainer trainer( &net, &opt, shard_dataset( data, config.rank, config.world ) );
+    trainer.set_shuffle_stream( config.rank );
+    trainer.set_verbose( false );
+    trainer.set_gradient_sync( &ring );
+
+    if ( !ring.barrier() ) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    trainer.train( epochs, 64 );
+    report.train_seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    report.sync_seconds = ring.seconds();
+
+    // All-reduce alone, on a buffer of the size of the gradients
+    size_t count = 0;
+    for ( Matrix* m : net.grads() ) {
+        count += m->rows * m->cols;
+    }
+
+    std::vector< float > buffer( count, 1.f );
+    size_t repeats = 20;
+
+    ring.barrier();
+    start = std::chrono::steady_clock::now();
+    for ( size_t i = 0; i < repeats; i++ ) {
+        ring.all_reduce( buffer.data(), buffer.size() );
+    }
+    report.all_reduce_us = std::chrono::duration< double, std::micro >( std::chrono::steady_clock::now() - start ).count() / repeats;
+
+    report.checksum = 0.0;
+    for ( Matrix* m : net.params() ) {
+        for ( size_t col = 0; col < m->cols; col++ ) {
+            for ( size_t row = 0; row < m->rows; row++ ) {
+                report.checksum += m->column( col )[row] * double( row + col + 1 );
+            }
+        }
+    }
+
+    return ring.barrier();
+}
+
+
+int main( int argc, char** argv ) {
+
+    std::vector< std::string > args( argv + 1, argv + argc );
+    std::string transport = args.size() > 0 ? args[0] : "shm";
+    size_t max_world = args.size() > 1 ? std::stoul( args[1] ) : 4;
+    size_t epochs = args.size() > 2 ? std::stoul( args[2] ) : 3;
+
+    rng.seed( 7 );
+    Dataset data = synthetic_dataset( 8192, 784, 10 );
+
+    size_t gradient_floats = 784 * 256 + 256 + 256 * 10 + 10;
+
+    std::cout << "Transport " << transport << ", " << data.vectors.size() << " samples, " << epochs
+              << " epochs, " << std::thread::hardware_concurrency() << " cores\n";
+    std::cout << "world  epoch time  speedup  efficiency  all-reduce share  all-reduce     bus bw  weights\n";
+
+    double base_epoch = 0.0;
+
+    for ( size_t world = 1; world <= max_world; world *= 2 ) {
+
+        DistributedConfig config;
+        config.world = world;
+        config.transport = transport;
+        config.shm_name = "/neural-net-scaling-" + std::to_string( ::getpid() ) + "-" + std::to_string( world );
+        config.port = 29600 + 64 * world;
+
+        std::vector< int > pipes;
+        std::vector< pid_t > children;
+
+        for ( size_t rank = 0; rank < world; rank++ ) {
+            int fds[2];
+            if ( ::pipe( fds ) != 0 ) {
+                std::cout << "Cannot create a pipe\n";
+                return 1;
+            }
+
+            pid_t pid = ::fork();
+            if ( pid == 0 ) {
+                ::close( fds[0] );
+                config.rank = rank;
+
+                RankReport report{};
+                bool ok = run_rank( config, data, epochs, report );
+                if ( ok ) {
+                    ok = ::write( fds[1], &report, sizeof( report ) ) == sizeof( report );
+                }
+                ::_exit( ok ? 0 : 1 );
+            }
+
+            ::close( fds[1] );
+            pipes.push_back( fds[0] );
+            children.push_back( pid );
+        }
+
+        std::vector< RankReport > reports( world );
+        bool ok = true;
+        for ( size_t rank = 0; rank < world; rank++ ) {
+            ok &= ::read( pipes[rank], &reports[rank], sizeof( RankReport ) ) == sizeof( RankReport );
+            ::close( pipes[rank] );
+
+            int status = 0;
+            ::waitpid( children[rank], &status, 0 );
+            ok &= WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+        }
+
+        if ( !ok ) {
+            std::cout << "Run of " << world << " ranks failed\n";
+            return 1;
+        }
+
+        // The slowest rank determines the time
+        double train = 0.0, sync = 0.0, all_reduce = 0.0;
+        bool same = true;
+        for ( auto& r : reports ) {
+            train = std::max( train, r.train_seconds );
+            sync = std::max( sync, r.sync_seconds );
+            all_reduce = std::max( all_reduce, r.all_reduce_us );
+            same &= r.checksum == reports[0].checksum;
+        }
+
+        double epoch = train / epochs;
+        if ( world == 1 ) {
+            base_epoch = epoch;
+        }
+
+        // Bus bandwidth: bytes every rank sends per all-reduce over its time
+        double bus_gbs = world == 1 ? 0.0
+                       : 2.0 * ( world - 1 ) / world * gradient_floats * sizeof( float ) / ( all_reduce * 1e3 );
+
+        std::cout << std::fixed << std::setw( 5 ) << world
+                  << "  " << std::setw( 9 ) << std::setprecision( 3 ) << epoch << "s"
+                  << "  " << std::setw( 6 ) << std::setprecision( 2 ) << base_epoch / epoch << "x"
+                  << "  " << std::setw( 9 ) << std::setprecision( 1 ) << 100.0 * base_epoch / epoch / world << "%"
+                  << "  " << std::setw( 15 ) << 100.0 * sync / train << "%"
+                  << "  " << std::setw( 8 ) << std::setprecision( 0 ) << all_reduce << "us"
+                  << "  " << std::setw( 4 ) << std::setprecision( 2 ) << bus_gbs << " GB/s"
+                  << "  " << ( same ? "equal" : "DIFFER" ) << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include "cascade.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <numeric>
+
+
+std::vector< float > softmax_margins( const Matrix& logits ) {
+
+    std::vector< float > res( logits.cols, 1.f );
+    if ( logits.rows < 2 ) {
+        return res;
+    }
+
+    for ( size_t j = 0; j < logits.cols; j++ ) {
+        const float* z = logits.column( j );
+
+        // Largest and second largest logit, the softmax is monotonic
+        float first = std::max( z[0], z[1] );
+        float second = std::min( z[0], z[1] );
+        for ( size_t c = 2; c < logits.rows; c++ ) {
+            if ( z[c] > first ) {
+                second = first;
+                first = z[c];
+            }
+            else if ( z[c] > second ) {
+                second = z[c];
+            }
+        }
+
+        float denom = 0.f;
+        for ( size_t c = 0; c < logits.rows; c++ ) {
+            denom += std::exp( z[c] - first );
+        }
+
+        res[j] = ( 1.f - std::exp( second - first ) ) / denom;
+    }
+
+    return res;
+}
+
+
+// FLOPs of one sample through `net`, counted as in measure()
+static double sample_flops( NeuralNet& net ) {
+
+    double flops = 0.0;
+    for ( auto& layer : net.layers() ) {
+        flops += 2.0 * layer->_weights.rows * layer->_weights.cols;
+        if ( layer->has_bias ) {
+            flops += layer->_bias.rows;
+        }
+    }
+
+    return flops;
+}
+
+
+Cascade::Cascade( NeuralNet* cheap, NeuralNet* full, float threshold ) : _cheap( cheap )
+                                                                       , _full( full )
+                                                                       , _threshold( threshold ) {
+    _cheap->evaluation();
+    _full->evaluation();
+}
+
+
+std::vector< size_t > Cascade::predict( ConstMatrixView batch, size_t* escalated ) {
+
+    Matrix logits = _cheap->forward( batch );
+    std::vector< size_t > res = predictions( logits );
+    std::vector< float > margins = softmax_margins( logits );
+
+    std::vector< size_t > hard;
+    for ( size_t j = 0; j < margins.size(); j++ ) {
+        if ( margins[j] < _threshold ) {
+            hard.push_back( j );
+        }
+    }
+
+    if ( escalated ) {
+        *escalated = hard.size();
+    }
+
+    if ( hard.empty() ) {
+        return res;
+    }
+
+    // Compact the hard samples, the full model runs on them only
+    Matrix subset( batch.rows, hard.size() );
+    for ( size_t j = 0; j < hard.size(); j++ ) {
+        std::copy( batch.col( hard[j] ), batch.col( hard[j] ) + batch.rows, subset.column( j ) );
+    }
+
+    std::vector< size_t > full = _full->predict( std::move( subset ) );
+    for ( size_t j = 0; j < hard.size(); j++ ) {
+        res[hard[j]] = full[j];
+    }
+
+    return res;
+}
+
+
+/*
+ * Both models predict every sample once. With the samples sorted by the
+ * margin of the cheap model, a threshold escalates a prefix of them, and the
+ * accuracy of every prefix follows from a running count.
+ */
+float Cascade::calibrate( ConstMatrixView data, const std::vector< int >& labels, float max_drop ) {
+
+    size_t n = data.cols;
+    if ( n == 0 ) {
+        return _threshold;
+    }
+
+    Matrix logits = _cheap->forward( data );
+    std::vector< size_t > cheap = predictions( logits );
+    std::vector< float > margins = softmax_margins( logits );
+    std::vector< size_t > full = _full->predict( data );
+
+    std::vector< size_t > order( n );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ){ return margins[a] < margins[b]; } );
+
+    size_t full_correct = 0;
+    size_t correct = 0;
+    for ( size_t j = 0; j < n; j++ ) {
+        full_correct += full[j] == size_t( labels[j] );
+        correct += cheap[j] == size_t( labels[j] );
+    }
+
+    float target = float( full_correct ) / n - max_drop;
+
+    // Escalating order[0, i) is the threshold margins[order[i]], samples
+    // with equal margins go together
+    for ( size_t i = 0; i < n; i++ ) {
+        if ( ( i == 0 || margins[order[i]] > margins[order[i - 1]] ) && float( correct ) / n >= target ) {
+            _threshold = i == 0 ? 0.f : margins[order[i]];
+            return _threshold;
+        }
+
+        size_t j = order[i];
+        correct += ( full[j] == size_t( labels[j] ) ) - ( cheap[j] == size_t( labels[j] ) );
+    }
+
+    // Every sample goes to the full model
+    _threshold = std::nextafter( 1.f, 2.f );
+    return _threshold;
+}
+
+
+float Cascade::threshold() const {
+    return _threshold;
+}
+
+
+void Cascade::set_threshold( float threshold ) {
+    _threshold = threshold;
+}
+
+
+CascadeReport evaluate_cascade( Cascade& cascade, NeuralNet& cheap, NeuralNet& full, ConstMatrixView data,
+                                const std::vector< int >& labels, size_t batch ) {
+
+    CascadeReport report;
+    report.samples = data.cols;
+    report.threshold = cascade.threshold();
+    report.cheap_flops = sample_flops( cheap );
+    report.full_flops = sample_flops( full );
+
+    if ( data.cols == 0 ) {
+        return report;
+    }
+
+    batch = std::max< size_t >( 1, batch );
+
+    // Predict everything in batches, once to warm up and once timed
+    auto run = [&]( auto&& predict ){
+        std::vector< size_t > res;
+        double seconds = 0.0;
+
+        for ( int pass = 0; pass < 2; pass++ ) {
+            res.clear();
+            auto start = std::chrono::steady_clock::now();
+            for ( size_t first = 0; first < data.cols; first += batch ) {
+                auto preds = predict( data.col_range( first, std::min( batch, data.cols - first ) ) );
+                res.insert( res.end(), preds.begin(), preds.end() );
+            }
+            seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+        }
+
+        return std::make_pair( res, 1e6 * seconds / data.cols );
+    };
+
+    auto score = [&]( const std::vector< size_t >& preds ){
+        size_t correct = 0;
+        for ( size_t j = 0; j < preds.size(); j++ ) {
+            correct += preds[j] == size_t( labels[j] );
+        }
+        return float( correct ) / preds.size();
+    };
+
+    size_t escalated = 0;
+    auto cascaded = run( [&]( ConstMatrixView b ){
+        size_t count = 0;
+        auto preds = cascade.predict( b, &count );
+        escalated += count;
+        return preds;
+    } );
+
+    auto alone = run( [&]( ConstMatrixView b ){ return full.predict( b ); } );
+
+    // Both passes of the cascade counted
+    report.escalated = float( escalated ) / ( 2 * data.cols );
+    report.accuracy = score( cascaded.first );
+    report.full_accuracy = score( alone.first );
+    report.cheap_accuracy = score( cheap.predict( data ) );
+
+    report.flops = report.cheap_flops + report.escalated * report.full_flops;
+    report.us = cascaded.second;
+    report.full_us = alone.second;
+
+    return report;
+}
+
+
+void CascadeReport::print() const {
+
+    auto ratio = []( double a, double b ){ return b == 0 ? 0.0 : a / b; };
+
+    std::cout << "Cascade on " << samples << " samples, threshold " << threshold << ", "
+              << 100.f * escalated << " % escalated to the full model\n";
+
+    std::cout << "                  cheap         full      cascade\n";
+    std::cout << "Accuracy    " << std::setw( 11 ) << cheap_accuracy << "  " << std::setw( 11 ) << full_accuracy
+              << "  " << std::setw( 11 ) << accuracy << "\n";
+    std::cout << "FLOPs       " << std::setw( 11 ) << cheap_flops << "  " << std::setw( 11 ) << full_flops
+              << "  " << std::setw( 11 ) << flops << "\n";
+    std::cout << "us/sample   " << std::setw( 11 ) << "" << "  " << std::setw( 11 ) << full_us
+              << "  " << std::setw( 11 ) << us << "\n";
+
+    std::cout << "Cascade against the full model: " << ratio( full_flops, flops ) << "x fewer FLOPs, "
+              << ratio( full_us, us ) << "x faster per sample\n";
+}
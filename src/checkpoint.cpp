@@ -0,0 +1,238 @@
+#include "checkpoint.hpp"
+
+
+static const uint32_t CHECKPOINT_MAGIC = 0x4b434e4e; // "NNCK"
+static const uint32_t NORMALIZATION_MAGIC = 0x4d524f4e; // "NORM"
+
+
+std::vector< LayerParams > layer_params( const NeuralNet& net ) {
+    std::vector< LayerParams > res;
+    for ( auto& layer : net.layers() ) {
+        res.push_back( { layer->_act->kind(), layer->_weights,
+                         layer->has_bias ? layer->_bias : Matrix() } );
+    }
+
+    return res;
+}
+
+
+NeuralNet from_layer_params( std::vector< LayerParams >&& layers ) {
+    std::vector< std::shared_ptr< LinearLayer > > res;
+    for ( auto& layer : layers ) {
+        res.push_back( std::make_shared< LinearLayer >( std::move( layer.weights ),
+                                                        std::move( layer.bias ),
+                                                        get_activation( layer.act ) ) );
+    }
+
+    return NeuralNet( std::move( res ) );
+}
+
+
+void write_matrix( std::ofstream& f, const Matrix& m ) {
+    for ( size_t col = 0; col < m.cols; col++ ) {
+        f.write( reinterpret_cast< const char* >( m.column( col ) ), m.rows * sizeof( float ) );
+    }
+}
+
+void read_matrix( std::ifstream& f, Matrix& m ) {
+    for ( size_t col = 0; col < m.cols; col++ ) {
+        f.read( reinterpret_cast< char* >( m.column( col ) ), m.rows * sizeof( float ) );
+    }
+}
+
+
+size_t remaining_bytes( std::ifstream& f ) {
+
+    auto position = f.tellg();
+    if ( position < 0 ) {
+        return 0;
+    }
+
+    f.seekg( 0, std::ios::end );
+    auto end = f.tellg();
+    f.seekg( position );
+
+    return end > position ? size_t( end - position ) : 0;
+}
+
+
+bool valid_activation( uint32_t kind ) {
+    return kind <= static_cast< uint32_t >( ActivationKind::ReLU );
+}
+
+
+bool write_checkpoint( const std::string& path, const std::vector< LayerParams >& layers,
+                       const Normalization& norm ) {
+    std::ofstream f( path, std::ios::out | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    write_value< uint32_t >( f, CHECKPOINT_MAGIC );
+    write_value< uint32_t >( f, layers.size() );
+
+    for ( auto& layer : layers ) {
+        write_value< uint32_t >( f, static_cast< uint32_t >( layer.act ) );
+        write_value< uint64_t >( f, layer.weights.rows );
+        write_value< uint64_t >( f, layer.weights.cols );
+        write_value< uint8_t >( f, layer.bias.rows != 0 );
+
+        write_matrix( f, layer.weights );
+        if ( layer.bias.rows != 0 ) {
+            write_matrix( f, layer.bias );
+        }
+    }
+
+    if ( !norm.empty() ) {
+        write_value< uint32_t >( f, NORMALIZATION_MAGIC );
+        write_value< uint64_t >( f, norm.mean.size() );
+        f.write( reinterpret_cast< const char* >( norm.mean.data() ), norm.mean.size() * sizeof( float ) );
+        f.write( reinterpret_cast< const char* >( norm.scale.data() ), norm.scale.size() * sizeof( float ) );
+    }
+
+    return f.good();
+}
+
+
+bool read_checkpoint( const std::string& path, std::vector< LayerParams >& layers, Normalization* norm ) {
+    std::ifstream f( path, std::ios::in | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    if ( read_value< uint32_t >( f ) != CHECKPOINT_MAGIC ) {
+        std::cout << "File " << path << " is not a checkpoint\n";
+        return false;
+    }
+
+    size_t count = read_value< uint32_t >( f );
+    layers.clear();
+
+    if ( f.good() && count == 0 ) {
+        std::cout << "Checkpoint " << path << " has no layers\n";
+        return false;
+    }
+
+    // Activation kind, rows, cols and has_bias of every layer
+    const size_t header = sizeof( uint32_t ) + 2 * sizeof( uint64_t ) + sizeof( uint8_t );
+    if ( count > remaining_bytes( f ) / header ) {
+        std::cout << "Checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    for ( size_t i = 0; i < count && f.good(); i++ ) {
+        uint32_t kind = read_value< uint32_t >( f );
+        size_t rows = read_value< uint64_t >( f );
+        size_t cols = read_value< uint64_t >( f );
+        bool has_bias = read_value< uint8_t >( f );
+
+        if ( !f.good() ) {
+            break;
+        }
+
+        if ( !valid_activation( kind ) ) {
+            std::cout << "Checkpoint " << path << " has an unknown activation " << kind << " in layer " << i << "\n";
+            return false;
+        }
+
+        // The floats of the layer must be in the file, checked without overflow
+        size_t floats = remaining_bytes( f ) / sizeof( float );
+        if ( rows == 0 || cols == 0 || cols > floats / rows || rows * cols + ( has_bias ? rows : 0 ) > floats ) {
+            std::cout << "Checkpoint " << path << " is truncated or has an invalid shape in layer " << i << "\n";
+            return false;
+        }
+
+        if ( !layers.empty() && layers.back().weights.rows != cols ) {
+            std::cout << "Checkpoint " << path << ": layer " << i << " has " << cols
+                      << " inputs, the previous one " << layers.back().weights.rows << " outputs\n";
+            return false;
+        }
+
+        // Biases are read with the rows of the weights, so they always match
+        LayerParams layer = { static_cast< ActivationKind >( kind ), Matrix( rows, cols ),
+                              has_bias ? Matrix( rows, 1 ) : Matrix() };
+        read_matrix( f, layer.weights );
+        if ( has_bias ) {
+            read_matrix( f, layer.bias );
+        }
+
+        layers.push_back( std::move( layer ) );
+    }
+
+    if ( !f.good() ) {
+        std::cout << "Checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    if ( !norm ) {
+        return true;
+    }
+
+    *norm = Normalization();
+
+    // Checkpoints written before the normalization was stored end here
+    uint32_t magic = 0;
+    if ( !f.read( reinterpret_cast< char* >( &magic ), sizeof( magic ) ) ) {
+        return true;
+    }
+
+    size_t features = read_value< uint64_t >( f );
+    size_t inputs = layers.empty() ? 0 : layers[0].weights.cols;
+    if ( magic != NORMALIZATION_MAGIC || !f.good() || features != inputs ) {
+        std::cout << "Checkpoint " << path << " has an invalid normalization\n";
+        return false;
+    }
+
+    norm->mean.resize( features );
+    norm->scale.resize( features );
+    f.read( reinterpret_cast< char* >( norm->mean.data() ), features * sizeof( float ) );
+    f.read( reinterpret_cast< char* >( norm->scale.data() ), features * sizeof( float ) );
+
+    if ( !f.good() ) {
+        std::cout << "Checkpoint " << path << " is truncated\n";
+        *norm = Normalization();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool save_checkpoint( const NeuralNet& net, const std::string& path, const Normalization& norm ) {
+    return write_checkpoint( path, layer_params( net ), norm );
+}
+
+
+bool load_checkpoint( const std::string& path, NeuralNet& net, Normalization* norm ) {
+    std::vector< LayerParams > layers;
+    if ( !read_checkpoint( path, layers, norm ) ) {
+        return false;
+    }
+
+    net = from_layer_params( std::move( layers ) );
+    return true;
+}
+
+
+size_t checkpoint_bytes( const NeuralNet& net, const Normalization& norm ) {
+
+    // magic and layer count, then kind, rows, cols and has_bias per layer
+    size_t res = 2 * sizeof( uint32_t );
+    for ( auto& layer : net.layers() ) {
+        res += sizeof( uint32_t ) + 2 * sizeof( uint64_t ) + sizeof( uint8_t );
+        res += layer->_weights.rows * layer->_weights.cols * sizeof( float );
+        if ( layer->has_bias ) {
+            res += layer->_bias.rows * sizeof( float );
+        }
+    }
+
+    if ( !norm.empty() ) {
+        res += sizeof( uint32_t ) + sizeof( uint64_t ) + 2 * norm.mean.size() * sizeof( float );
+    }
+
+    return res;
+}
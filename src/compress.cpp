@@ -0,0 +1,271 @@
+#include "compress.hpp"
+#include "inference.hpp"
+
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+
+
+/*
+ * Cyclic Jacobi eigenvalue algorithm for a symmetric n x n matrix `a`
+ * (row-major, double precision). On return the diagonal of `a` holds the
+ * eigenvalues and the columns of `v` the corresponding eigenvectors.
+ */
+static void jacobi_eigen( std::vector< double >& a, std::vector< double >& v, size_t n ) {
+
+    v.assign( n * n, 0.0 );
+    for ( size_t i = 0; i < n; i++ ) {
+        v[i * n + i] = 1.0;
+    }
+
+    for ( size_t sweep = 0; sweep < 50; sweep++ ) {
+
+        double off = 0.0, diag = 0.0;
+        for ( size_t p = 0; p < n; p++ ) {
+            diag += a[p * n + p] * a[p * n + p];
+            for ( size_t q = p + 1; q < n; q++ ) {
+                off += a[p * n + q] * a[p * n + q];
+            }
+        }
+
+        // off-diagonal mass negligible relative to the eigenvalues
+        if ( off <= 1e-24 * diag ) {
+            break;
+        }
+
+        for ( size_t p = 0; p < n; p++ ) {
+            for ( size_t q = p + 1; q < n; q++ ) {
+
+                double apq = a[p * n + q];
+                if ( std::abs( apq ) < 1e-30 ) {
+                    continue;
+                }
+
+                // rotation angle that zeroes a[p][q]
+                double theta = ( a[q * n + q] - a[p * n + p] ) / ( 2 * apq );
+                double t = ( theta >= 0 ? 1.0 : -1.0 ) / ( std::abs( theta ) + std::sqrt( theta * theta + 1 ) );
+                double c = 1 / std::sqrt( t * t + 1 );
+                double s = t * c;
+
+                for ( size_t k = 0; k < n; k++ ) {
+                    double akp = a[k * n + p];
+                    double akq = a[k * n + q];
+                    a[k * n + p] = c * akp - s * akq;
+                    a[k * n + q] = s * akp + c * akq;
+                }
+
+                for ( size_t k = 0; k < n; k++ ) {
+                    double apk = a[p * n + k];
+                    double aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - s * aqk;
+                    a[q * n + k] = s * apk + c * aqk;
+                }
+
+                for ( size_t k = 0; k < n; k++ ) {
+                    double vkp = v[k * n + p];
+                    double vkq = v[k * n + q];
+                    v[k * n + p] = c * vkp - s * vkq;
+                    v[k * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+
+LowRankFactors decompose( const Matrix& weights ) {
+
+    LowRankFactors res;
+    res.left = weights.rows <= weights.cols;
+
+    size_t n = res.left ? weights.rows : weights.cols;
+    size_t inner = res.left ? weights.cols : weights.rows;
+
+    // element (i, k) of W if left, of W^T otherwise
+    auto w = [&]( size_t i, size_t k ){
+        return double( res.left ? weights.at( i, k ) : weights.at( k, i ) );
+    };
+
+    // Gram matrix of the smaller side
+    std::vector< double > gram( n * n, 0.0 );
+    for ( size_t i = 0; i < n; i++ ) {
+        for ( size_t j = i; j < n; j++ ) {
+            double sum = 0.0;
+            for ( size_t k = 0; k < inner; k++ ) {
+                sum += w( i, k ) * w( j, k );
+            }
+            gram[i * n + j] = gram[j * n + i] = sum;
+        }
+    }
+
+    std::vector< double > vectors;
+    jacobi_eigen( gram, vectors, n );
+
+    std::vector< size_t > order( n );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        return gram[a * n + a] > gram[b * n + b];
+    } );
+
+    res.basis = Matrix( n, n );
+    for ( size_t col = 0; col < n; col++ ) {
+        res.singular_values.push_back( std::sqrt( std::max( 0.0, gram[order[col] * n + order[col]] ) ) );
+        for ( size_t row = 0; row < n; row++ ) {
+            res.basis.at( row, col ) = vectors[row * n + order[col]];
+        }
+    }
+
+    return res;
+}
+
+
+size_t rank_for_energy( const LowRankFactors& factors, float energy ) {
+
+    double total = 0.0;
+    for ( float s : factors.singular_values ) {
+        total += double( s ) * s;
+    }
+
+    double kept = 0.0;
+    for ( size_t k = 0; k < factors.singular_values.size(); k++ ) {
+        kept += double( factors.singular_values[k] ) * factors.singular_values[k];
+        if ( kept >= energy * total ) {
+            return k + 1;
+        }
+    }
+
+    return factors.singular_values.size();
+}
+
+
+size_t break_even_rank( size_t rows, size_t cols ) {
+    return rows + cols == 0 ? 0 : ( rows * cols - 1 ) / ( rows + cols );
+}
+
+
+NeuralNet factorize( const NeuralNet& net, size_t layer,
+                     const LowRankFactors& factors, size_t rank ) {
+
+    std::vector< std::shared_ptr< LinearLayer > > layers;
+
+    for ( size_t i = 0; i < net.layers().size(); i++ ) {
+
+        const LinearLayer& original = *net.layers()[i];
+
+        if ( i != layer ) {
+            layers.push_back( std::make_shared< LinearLayer >( original ) );
+            continue;
+        }
+
+        const Matrix& w = original._weights;
+        Matrix basis( factors.basis.block( 0, 0, factors.basis.rows, rank ) );
+
+        // W ~ U_k ( U_k^T W )  or  W ~ ( W V_k ) V_k^T
+        Matrix first = factors.left ? basis.transpose().mult( w ) : basis.transpose();
+        Matrix second = factors.left ? basis : w.mult( basis );
+
+        layers.push_back( std::make_shared< LinearLayer >( std::move( first ), Matrix(),
+                                                           Identity::get_instance() ) );
+        layers.push_back( std::make_shared< LinearLayer >( std::move( second ),
+                                                           original.has_bias ? Matrix( original._bias ) : Matrix(),
+                                                           original._act ) );
+    }
+
+    return NeuralNet( std::move( layers ) );
+}
+
+
+float accuracy( NeuralNet& net, const Matrix& data, const std::vector< int >& labels ) {
+
+    size_t hits = 0;
+    size_t batch = 1024;
+
+    for ( size_t col = 0; col < data.cols; col += batch ) {
+        size_t count = std::min( batch, data.cols - col );
+        auto preds = net.predict( data.col_range( col, count ) );
+
+        for ( size_t i = 0; i < count; i++ ) {
+            hits += ( preds[i] == size_t( labels[col + i] ) );
+        }
+    }
+
+    return data.cols == 0 ? 0.f : float( hits ) / data.cols;
+}
+
+
+size_t rank_for_accuracy( NeuralNet& net, size_t layer,
+                          const LowRankFactors& factors,
+                          const Matrix& data, const std::vector< int >& labels,
+                          float max_drop ) {
+
+    float target = accuracy( net, data, labels ) - max_drop;
+
+    // accuracy grows (roughly) monotonically with the rank, binary search it
+    size_t lo = 1, hi = factors.singular_values.size();
+    while ( lo < hi ) {
+        size_t mid = ( lo + hi ) / 2;
+        NeuralNet candidate = factorize( net, layer, factors, mid );
+
+        if ( accuracy( candidate, data, labels ) >= target ) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+
+ModelCost measure( NeuralNet& net, const Matrix& data, const std::vector< int >& labels ) {
+
+    ModelCost cost = { 0, 0, 0.0, accuracy( net, data, labels ) };
+
+    for ( auto& layer : net.layers() ) {
+        size_t params = layer->_weights.rows * layer->_weights.cols;
+        cost.flops += 2 * params;
+        cost.bytes += params * sizeof( float );
+
+        if ( layer->has_bias ) {
+            cost.flops += layer->_bias.rows;
+            cost.bytes += layer->_bias.rows * sizeof( float );
+        }
+    }
+
+    // mean single-sample latency of the serving path
+    InferenceEngine engine( net );
+    InferenceEngine::Workspace ws = engine.workspace();
+
+    size_t samples = std::min< size_t >( data.cols, 2000 );
+
+    // warm up caches before timing
+    for ( size_t i = 0; i < samples; i++ ) {
+        engine.predict( data.column( i ), ws );
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for ( size_t i = 0; i < samples; i++ ) {
+        engine.predict( data.column( i ), ws );
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    cost.latency_us = samples == 0 ? 0.0 : std::chrono::duration< double, std::micro >( end - start ).count() / samples;
+
+    return cost;
+}
+
+
+void print_cost_comparison( const ModelCost& before, const ModelCost& after ) {
+
+    auto ratio = []( double a, double b ){ return b == 0 ? 0.0 : a / b; };
+
+    std::cout << "               before        after     ratio\n";
+    std::cout << "FLOPs     " << std::setw( 11 ) << before.flops << "  " << std::setw( 11 ) << after.flops
+              << "  " << std::setw( 8 ) << ratio( before.flops, after.flops ) << "x\n";
+    std::cout << "Bytes     " << std::setw( 11 ) << before.bytes << "  " << std::setw( 11 ) << after.bytes
+              << "  " << std::setw( 8 ) << ratio( before.bytes, after.bytes ) << "x\n";
+    std::cout << "Latency   " << std::setw( 9 ) << before.latency_us << "us  " << std::setw( 9 ) << after.latency_us
+              << "us  " << std::setw( 8 ) << ratio( before.latency_us, after.latency_us ) << "x\n";
+    std::cout << "Accuracy  " << std::setw( 11 ) << before.accuracy << "  " << std::setw( 11 ) << after.accuracy << "\n";
+}
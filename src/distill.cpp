@@ -0,0 +1,75 @@
+#include "distill.hpp"
+
+#include <cmath>
+
+
+size_t SoftTargets::samples() const {
+    return classes == 0 ? 0 : probabilities.size() / classes;
+}
+
+
+void SoftTargets::gather( const std::vector< size_t >& indices, MatrixView out ) const {
+
+    assert( out.rows == classes && out.cols == indices.size() );
+
+    const float unit = 1.f / 65535.f;
+    for ( size_t j = 0; j < indices.size(); j++ ) {
+        const uint16_t* p = probabilities.data() + indices[j] * classes;
+        float* col = out.col( j );
+        for ( size_t c = 0; c < classes; c++ ) {
+            col[c] = p[c] * unit;
+        }
+    }
+}
+
+
+SoftTargets compute_soft_targets( NeuralNet& teacher, const Dataset& data, const Normalization& norm,
+                                  float temperature, size_t batch ) {
+
+    SoftTargets res;
+    res.temperature = temperature;
+
+    if ( data.vectors.empty() || teacher.layers().empty() ) {
+        return res;
+    }
+
+    res.classes = teacher.layers().back()->_weights.rows;
+    res.probabilities.resize( data.vectors.size() * res.classes );
+
+    teacher.evaluation();
+    batch = std::max< size_t >( 1, batch );
+
+    for ( size_t first = 0; first < data.vectors.size(); first += batch ) {
+        size_t count = std::min( batch, data.vectors.size() - first );
+
+        Matrix input( data.vectors[first].size(), count );
+        for ( size_t j = 0; j < count; j++ ) {
+            std::copy( data.vectors[first + j].begin(), data.vectors[first + j].end(), input.column( j ) );
+        }
+
+        if ( !norm.empty() ) {
+            norm.apply( input );
+        }
+
+        Matrix logits = teacher.forward( std::move( input ) );
+
+        // Softmax of logits / T, stable by subtracting the maximum
+        for ( size_t j = 0; j < count; j++ ) {
+            const float* z = logits.column( j );
+            float max = *std::max_element( z, z + res.classes );
+
+            float denom = 0.f;
+            for ( size_t c = 0; c < res.classes; c++ ) {
+                denom += std::exp( ( z[c] - max ) / temperature );
+            }
+
+            uint16_t* p = res.probabilities.data() + ( first + j ) * res.classes;
+            for ( size_t c = 0; c < res.classes; c++ ) {
+                p[c] = uint16_t( std::lround( 65535.f * std::exp( ( z[c] - max ) / temperature ) / denom ) );
+            }
+        }
+    }
+
+    teacher.training();
+    return res;
+}
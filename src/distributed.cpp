@@ -0,0 +1,580 @@
+#include "distributed.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// How long ranks wait for each other while connecting, and for a
+// neighbour during an exchange before the job is given up
+static const auto CONNECT_TIMEOUT = std::chrono::seconds( 60 );
+static const auto EXCHANGE_TIMEOUT = std::chrono::seconds( 60 );
+
+
+/*
+ * Shared memory transport. The segment holds a mailbox per rank, written by
+ * its left neighbour. A mailbox holds one piece of up to MAILBOX_FLOATS
+ * values, `written` and `read` count the pieces put in and taken out.
+ */
+static const size_t MAILBOX_FLOATS = 1 << 16;
+static const uint32_t SHM_MAGIC = 0x52494e47; // "RING"
+
+struct ShmHeader {
+    std::atomic< uint32_t > magic;
+    uint32_t world;
+    std::atomic< uint32_t > joined;
+};
+
+struct Mailbox {
+    alignas( 64 ) std::atomic< uint64_t > written;
+    alignas( 64 ) std::atomic< uint64_t > read;
+    alignas( 64 ) float data[MAILBOX_FLOATS];
+};
+
+
+// Spin briefly, then leave the core to the other ranks. False if not ready
+// by the deadline, the clock is only read while yielding.
+template < typename condition >
+static bool wait_until( condition ready, std::chrono::steady_clock::time_point deadline ) {
+    for ( size_t spins = 0; !ready(); spins++ ) {
+        if ( spins > 64 ) {
+            if ( spins % 1024 == 0 && std::chrono::steady_clock::now() > deadline ) {
+                return ready();
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    return true;
+}
+
+
+class ShmTransport : public Transport {
+
+    size_t _rank;
+    size_t _world;
+
+    void* _segment = MAP_FAILED;
+    size_t _size = 0;
+
+    Mailbox* _inbox = nullptr;
+    Mailbox* _outbox = nullptr;
+
+public:
+    ShmTransport( size_t rank, size_t world ) : _rank( rank ), _world( world ) {}
+
+    ~ShmTransport() {
+        if ( _segment != MAP_FAILED ) {
+            ::munmap( _segment, _size );
+        }
+    }
+
+    bool connect( const std::string& name );
+
+    size_t rank() const override {
+        return _rank;
+    }
+
+    size_t world() const override {
+        return _world;
+    }
+
+    bool exchange( const float* send, size_t send_count, float* recv, size_t recv_count ) override;
+};
+
+
+bool ShmTransport::connect( const std::string& name ) {
+
+    _size = sizeof( ShmHeader ) + _world * sizeof( Mailbox );
+    _size = ( _size + 4095 ) / 4096 * 4096;
+
+    int fd = -1;
+    auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+
+    if ( _rank == 0 ) {
+        // A segment left over by a failed job must not be joined
+        ::shm_unlink( name.c_str() );
+        fd = ::shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+        if ( fd < 0 || ::ftruncate( fd, _size ) != 0 ) {
+            std::cout << "Cannot create shared memory " << name << "\n";
+            return false;
+        }
+    }
+    else {
+        // Wait for rank 0 to create and size the segment
+        struct stat st;
+        while ( ( fd = ::shm_open( name.c_str(), O_RDWR, 0600 ) ) < 0 ||
+                ::fstat( fd, &st ) != 0 || size_t( st.st_size ) < _size ) {
+            if ( fd >= 0 ) {
+                ::close( fd );
+            }
+
+            if ( std::chrono::steady_clock::now() > deadline ) {
+                std::cout << "Cannot open shared memory " << name << "\n";
+                return false;
+            }
+            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+        }
+    }
+
+    _segment = ::mmap( nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    ::close( fd );
+
+    if ( _segment == MAP_FAILED ) {
+        std::cout << "Cannot map shared memory " << name << "\n";
+        return false;
+    }
+
+    // The new segment is zero filled, which is a valid initial state
+    auto* header = static_cast< ShmHeader* >( _segment );
+    Mailbox* mailboxes = reinterpret_cast< Mailbox* >( header + 1 );
+
+    if ( _rank == 0 ) {
+        header->world = _world;
+        header->magic.store( SHM_MAGIC, std::memory_order_release );
+    }
+
+    bool ready = wait_until( [&](){ return header->magic.load( std::memory_order_acquire ) == SHM_MAGIC; },
+                             deadline );
+
+    if ( !ready || header->world != _world ) {
+        std::cout << "Shared memory " << name << " belongs to another job\n";
+        return false;
+    }
+
+    _inbox = &mailboxes[_rank];
+    _outbox = &mailboxes[( _rank + 1 ) % _world];
+
+    // Once everybody mapped the segment its name is not needed anymore
+    header->joined.fetch_add( 1 );
+    if ( !wait_until( [&](){ return header->joined.load() == _world; }, deadline ) ) {
+        std::cout << "Only " << header->joined.load() << " of " << _world << " ranks joined\n";
+        return false;
+    }
+
+    if ( _rank == 0 ) {
+        ::shm_unlink( name.c_str() );
+    }
+
+    return true;
+}
+
+
+bool ShmTransport::exchange( const float* send, size_t send_count, float* recv, size_t recv_count ) {
+
+    size_t send_pieces = ( send_count + MAILBOX_FLOATS - 1 ) / MAILBOX_FLOATS;
+    size_t recv_pieces = ( recv_count + MAILBOX_FLOATS - 1 ) / MAILBOX_FLOATS;
+
+    // A dead neighbour never moves its counters
+    auto deadline = std::chrono::steady_clock::now() + EXCHANGE_TIMEOUT;
+
+    // Piece i goes out before piece i comes in, the right neighbour has
+    // taken piece i - 1 before it could send its own piece i - 1 to us
+    for ( size_t piece = 0; piece < std::max( send_pieces, recv_pieces ); piece++ ) {
+
+        if ( piece < send_pieces ) {
+            uint64_t sent = _outbox->written.load( std::memory_order_relaxed );
+            if ( !wait_until( [&](){ return _outbox->read.load( std::memory_order_acquire ) == sent; }, deadline ) ) {
+                std::cout << "Rank " << ( _rank + 1 ) % _world << " stopped receiving\n";
+                return false;
+            }
+
+            size_t offset = piece * MAILBOX_FLOATS;
+            size_t count = std::min( MAILBOX_FLOATS, send_count - offset );
+            std::copy( send + offset, send + offset + count, _outbox->data );
+            _outbox->written.store( sent + 1, std::memory_order_release );
+        }
+
+        if ( piece < recv_pieces ) {
+            uint64_t taken = _inbox->read.load( std::memory_order_relaxed );
+            if ( !wait_until( [&](){ return _inbox->written.load( std::memory_order_acquire ) > taken; }, deadline ) ) {
+                std::cout << "Rank " << ( _rank + _world - 1 ) % _world << " stopped sending\n";
+                return false;
+            }
+
+            size_t offset = piece * MAILBOX_FLOATS;
+            size_t count = std::min( MAILBOX_FLOATS, recv_count - offset );
+            std::copy( _inbox->data, _inbox->data + count, recv + offset );
+            _inbox->read.store( taken + 1, std::memory_order_release );
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * TCP transport. Rank r listens on port + r, connects to its right
+ * neighbour and accepts its left one, which identifies itself by its rank.
+ */
+class TcpTransport : public Transport {
+
+    size_t _rank;
+    size_t _world;
+
+    int _left = -1;
+    int _right = -1;
+
+public:
+    TcpTransport( size_t rank, size_t world ) : _rank( rank ), _world( world ) {}
+
+    ~TcpTransport() {
+        for ( int fd : { _left, _right } ) {
+            if ( fd >= 0 ) {
+                ::close( fd );
+            }
+        }
+    }
+
+    bool connect( const DistributedConfig& config );
+
+    size_t rank() const override {
+        return _rank;
+    }
+
+    size_t world() const override {
+        return _world;
+    }
+
+    bool exchange( const float* send, size_t send_count, float* recv, size_t recv_count ) override;
+};
+
+
+static std::string host_of( const DistributedConfig& config, size_t rank ) {
+    return rank < config.hosts.size() ? config.hosts[rank] : config.host;
+}
+
+
+bool TcpTransport::connect( const DistributedConfig& config ) {
+
+    auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+
+    int listener = ::socket( AF_INET, SOCK_STREAM, 0 );
+    int one = 1;
+    ::setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    addr.sin_port = htons( config.port + _rank );
+
+    if ( listener < 0 || ::bind( listener, reinterpret_cast< sockaddr* >( &addr ), sizeof( addr ) ) != 0 ||
+         ::listen( listener, 1 ) != 0 ) {
+        std::cout << "Cannot listen on port " << config.port + _rank << "\n";
+        if ( listener >= 0 ) {
+            ::close( listener );
+        }
+        return false;
+    }
+
+    // Connect to the right neighbour, which may not be listening yet
+    size_t right = ( _rank + 1 ) % _world;
+    std::string host = host_of( config, right );
+    std::string port = std::to_string( config.port + right );
+
+    while ( _right < 0 ) {
+        addrinfo hints{}, *found = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ( ::getaddrinfo( host.c_str(), port.c_str(), &hints, &found ) == 0 ) {
+            int fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+            if ( fd >= 0 && ::connect( fd, found->ai_addr, found->ai_addrlen ) == 0 ) {
+                _right = fd;
+            }
+            else if ( fd >= 0 ) {
+                ::close( fd );
+            }
+            ::freeaddrinfo( found );
+        }
+
+        if ( _right < 0 ) {
+            if ( std::chrono::steady_clock::now() > deadline ) {
+                std::cout << "Cannot connect to rank " << right << " at " << host << ":" << port << "\n";
+                ::close( listener );
+                return false;
+            }
+            std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+        }
+    }
+
+    uint32_t id = _rank;
+    bool sent = ::send( _right, &id, sizeof( id ), MSG_NOSIGNAL ) == sizeof( id );
+
+    // Accept the left neighbour
+    pollfd pfd{ listener, POLLIN, 0 };
+    auto left_ms = std::chrono::duration_cast< std::chrono::milliseconds >( deadline - std::chrono::steady_clock::now() );
+    if ( sent && ::poll( &pfd, 1, std::max< int >( 0, left_ms.count() ) ) > 0 ) {
+        _left = ::accept( listener, nullptr, nullptr );
+    }
+    ::close( listener );
+
+    size_t left = ( _rank + _world - 1 ) % _world;
+    if ( _left < 0 || ::recv( _left, &id, sizeof( id ), MSG_WAITALL ) != sizeof( id ) || id != left ) {
+        std::cout << "Rank " << left << " did not connect\n";
+        return false;
+    }
+
+    for ( int fd : { _left, _right } ) {
+        ::setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+        ::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    }
+
+    return true;
+}
+
+
+bool TcpTransport::exchange( const float* send, size_t send_count, float* recv, size_t recv_count ) {
+
+    // Both directions at once, all ranks sending first could fill the
+    // socket buffers and wait for each other forever
+    const char* out = reinterpret_cast< const char* >( send );
+    char* in = reinterpret_cast< char* >( recv );
+    size_t to_send = send_count * sizeof( float );
+    size_t to_recv = recv_count * sizeof( float );
+
+    auto deadline = std::chrono::steady_clock::now() + EXCHANGE_TIMEOUT;
+
+    while ( to_send > 0 || to_recv > 0 ) {
+
+        pollfd fds[2] = { { _right, short( to_send > 0 ? POLLOUT : 0 ), 0 },
+                          { _left, short( to_recv > 0 ? POLLIN : 0 ), 0 } };
+
+        auto left_ms = std::chrono::duration_cast< std::chrono::milliseconds >( deadline - std::chrono::steady_clock::now() );
+        int ready = ::poll( fds, 2, std::max< int >( 0, left_ms.count() ) );
+        if ( ready < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            std::cout << "Ring connection failed\n";
+            return false;
+        }
+
+        if ( ready == 0 ) {
+            std::cout << "Ring neighbours did not answer\n";
+            return false;
+        }
+
+        const short failed = POLLERR | POLLHUP | POLLNVAL;
+        if ( ( to_send > 0 && ( fds[0].revents & failed ) ) ||
+             ( to_recv > 0 && ( fds[1].revents & failed ) && !( fds[1].revents & POLLIN ) ) ) {
+            std::cout << "Ring connection closed\n";
+            return false;
+        }
+
+        if ( fds[0].revents & POLLOUT ) {
+            ssize_t n = ::send( _right, out, to_send, MSG_NOSIGNAL );
+            if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+                std::cout << "Ring connection failed\n";
+                return false;
+            }
+            if ( n > 0 ) {
+                out += n;
+                to_send -= n;
+            }
+        }
+
+        if ( fds[1].revents & POLLIN ) {
+            ssize_t n = ::recv( _left, in, to_recv, 0 );
+            if ( n == 0 || ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+                std::cout << "Ring connection closed\n";
+                return false;
+            }
+            if ( n > 0 ) {
+                in += n;
+                to_recv -= n;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * A single rank needs no connections
+ */
+class LocalTransport : public Transport {
+
+public:
+    size_t rank() const override {
+        return 0;
+    }
+
+    size_t world() const override {
+        return 1;
+    }
+
+    bool exchange( const float*, size_t, float*, size_t ) override {
+        return true;
+    }
+};
+
+
+std::unique_ptr< Transport > connect_ring( const DistributedConfig& config ) {
+
+    if ( config.world == 0 || config.rank >= config.world ) {
+        std::cout << "Rank " << config.rank << " is not in a world of " << config.world << "\n";
+        return nullptr;
+    }
+
+    if ( config.world == 1 ) {
+        return std::make_unique< LocalTransport >();
+    }
+
+    if ( config.transport == "shm" ) {
+        auto transport = std::make_unique< ShmTransport >( config.rank, config.world );
+        return transport->connect( config.shm_name ) ? std::move( transport ) : nullptr;
+    }
+
+    if ( config.transport == "tcp" ) {
+        auto transport = std::make_unique< TcpTransport >( config.rank, config.world );
+        return transport->connect( config ) ? std::move( transport ) : nullptr;
+    }
+
+    std::cout << "Unknown transport " << config.transport << "\n";
+    return nullptr;
+}
+
+
+/*
+ * Ring all-reduce
+ */
+RingAllReduce::RingAllReduce( std::unique_ptr< Transport >&& transport ) : _transport( std::move( transport ) ) {}
+
+
+size_t RingAllReduce::rank() const {
+    return _transport->rank();
+}
+
+
+size_t RingAllReduce::world() const {
+    return _transport->world();
+}
+
+
+bool RingAllReduce::all_reduce( float* data, size_t count ) {
+
+    size_t world = _transport->world();
+    size_t rank = _transport->rank();
+
+    if ( world == 1 ) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto begin = [&]( size_t chunk ){ return chunk * count / world; };
+    auto size = [&]( size_t chunk ){ return begin( chunk + 1 ) - begin( chunk ); };
+
+    _received.resize( size( 0 ) + 1 );
+
+    // Reduce-scatter: pass chunk rank - step on, add the incoming partial
+    // sum of chunk rank - step - 1 to our values
+    for ( size_t step = 0; step + 1 < world; step++ ) {
+        size_t out = ( rank + world - step ) % world;
+        size_t in = ( rank + world - step - 1 ) % world;
+
+        if ( !_transport->exchange( data + begin( out ), size( out ), _received.data(), size( in ) ) ) {
+            return false;
+        }
+
+        float* values = data + begin( in );
+        for ( size_t i = 0; i < size( in ); i++ ) {
+            values[i] = _received[i] + values[i];
+        }
+    }
+
+    // All-gather: rank holds the sum of chunk rank + 1, pass the sums around
+    for ( size_t step = 0; step + 1 < world; step++ ) {
+        size_t out = ( rank + 1 + world - step ) % world;
+        size_t in = ( rank + world - step ) % world;
+
+        if ( !_transport->exchange( data + begin( out ), size( out ), data + begin( in ), size( in ) ) ) {
+            return false;
+        }
+    }
+
+    _seconds += std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    _bytes += 2 * ( world - 1 ) * count / world * sizeof( float );
+
+    return true;
+}
+
+
+bool RingAllReduce::average( const std::vector< Matrix* >& matrices ) {
+
+    if ( world() == 1 ) {
+        return true;
+    }
+
+    _buffer.clear();
+    for ( const Matrix* m : matrices ) {
+        for ( size_t col = 0; col < m->cols; col++ ) {
+            _buffer.insert( _buffer.end(), m->column( col ), m->column( col ) + m->rows );
+        }
+    }
+
+    if ( !all_reduce( _buffer.data(), _buffer.size() ) ) {
+        return false;
+    }
+
+    float scale = 1.f / world();
+    const float* values = _buffer.data();
+    for ( Matrix* m : matrices ) {
+        for ( size_t col = 0; col < m->cols; col++ ) {
+            float* column = m->column( col );
+            for ( size_t row = 0; row < m->rows; row++ ) {
+                column[row] = values[row] * scale;
+            }
+            values += m->rows;
+        }
+    }
+
+    return true;
+}
+
+
+bool RingAllReduce::barrier() {
+    // A value per rank, so that every exchange carries data
+    std::vector< float > tokens( world() );
+    return all_reduce( tokens.data(), tokens.size() );
+}
+
+
+double RingAllReduce::seconds() const {
+    return _seconds;
+}
+
+
+size_t RingAllReduce::bytes() const {
+    return _bytes;
+}
+
+
+std::shared_ptr< const Dataset > shard_dataset( const Dataset& data, size_t rank, size_t world ) {
+
+    auto shard = std::make_shared< Dataset >();
+    size_t per_rank = data.vectors.size() / world;
+
+    for ( size_t i = 0; i < per_rank; i++ ) {
+        shard->vectors.push_back( data.vectors[i * world + rank] );
+        shard->labels.push_back( data.labels[i * world + rank] );
+    }
+
+    return shard;
+}
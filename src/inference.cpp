@@ -0,0 +1,258 @@
+#include "inference.hpp"
+
+#include <array>
+#include <utility>
+
+
+// GCC vector extension, lets each accumulator of a panel live in one register
+typedef float simd_float __attribute__(( vector_size( SIMD_FLOATS * sizeof( float ) ) ));
+
+
+/*
+ * Repack a column-major weight matrix into streaming panels.
+ */
+PackedLayer::PackedLayer( const Matrix& w, const Matrix& b, ActivationKind act ) : act( act ) {
+
+    input_dim = w.cols;
+    output_dim = w.rows;
+    padded_dim = ( output_dim + SIMD_FLOATS - 1 ) / SIMD_FLOATS * SIMD_FLOATS;
+
+    size_t offset = 0;
+    for ( size_t row = 0; row < padded_dim; row += PANEL_VECTORS * SIMD_FLOATS ){
+        size_t vectors = std::min( PANEL_VECTORS, ( padded_dim - row ) / SIMD_FLOATS );
+        panels.push_back( { row, vectors, offset } );
+        offset += input_dim * vectors * SIMD_FLOATS;
+    }
+
+    weights = aligned_vector( offset, 0.f );
+    bias = aligned_vector( padded_dim, 0.f );
+
+    for ( const Panel& panel : panels ){
+        size_t width = panel.vectors * SIMD_FLOATS;
+        size_t rows = std::min( width, output_dim - panel.row );
+
+        for ( size_t col = 0; col < input_dim; col++ ){
+            for ( size_t lane = 0; lane < rows; lane++ ){
+                weights[panel.offset + col * width + lane] = w.at( panel.row + lane, col );
+            }
+        }
+    }
+
+    for ( size_t row = 0; b.rows != 0 && row < output_dim; row++ ){
+        bias[row] = b.at( row, 0 );
+    }
+}
+
+
+template < size_t V, ActivationKind act >
+static void panel_gemv( const float* w, const float* bias, const uint32_t* indices,
+                        const float* values, size_t nonzeros, float* out ) {
+
+    simd_float acc[V];
+
+    for ( size_t v = 0; v < V; v++ ){
+        acc[v] = reinterpret_cast< const simd_float* >( bias )[v];
+    }
+
+    for ( size_t i = 0; i < nonzeros; i++ ){
+        const simd_float* col = reinterpret_cast< const simd_float* >( w + indices[i] * V * SIMD_FLOATS );
+        const float x = values[i];
+
+        for ( size_t v = 0; v < V; v++ ){
+            acc[v] += col[v] * x;
+        }
+    }
+
+    // fused activation
+    for ( size_t v = 0; v < V; v++ ){
+        if ( act == ActivationKind::ReLU ) {
+            simd_float zero = {};
+            acc[v] = acc[v] > zero ? acc[v] : zero;
+        }
+
+        reinterpret_cast< simd_float* >( out )[v] = acc[v];
+    }
+}
+
+
+using panel_kernel = void (*)( const float*, const float*, const uint32_t*,
+                               const float*, size_t, float* );
+
+template < ActivationKind act, size_t... V >
+static constexpr std::array< panel_kernel, sizeof...( V ) > panel_kernels( std::index_sequence< V... > ) {
+    return { { &panel_gemv< V + 1, act >... } };
+}
+
+// Kernels for panels of 1 .. PANEL_VECTORS vectors
+static constexpr auto relu_kernels = panel_kernels< ActivationKind::ReLU >( std::make_index_sequence< PANEL_VECTORS >() );
+static constexpr auto id_kernels = panel_kernels< ActivationKind::Identity >( std::make_index_sequence< PANEL_VECTORS >() );
+
+
+void PackedLayer::forward( const uint32_t* indices, const float* values,
+                           size_t nonzeros, float* out ) const {
+
+    const auto& kernels = ( act == ActivationKind::ReLU ) ? relu_kernels : id_kernels;
+
+    for ( const Panel& panel : panels ){
+        kernels[panel.vectors - 1]( weights.data() + panel.offset, bias.data() + panel.row,
+                                    indices, values, nonzeros, out + panel.row );
+    }
+}
+
+
+/*
+ *  INFERENCE ENGINE
+ */
+InferenceEngine::InferenceEngine( const NeuralNet& net ) {
+    for ( auto& layer : net.layers() ) {
+        add_layer( PackedLayer( layer->_weights, layer->_bias, layer->_act->kind() ) );
+    }
+}
+
+
+InferenceEngine::InferenceEngine( const std::vector< LayerParams >& layers ) {
+    for ( auto& layer : layers ) {
+        add_layer( PackedLayer( layer.weights, layer.bias, layer.act ) );
+    }
+}
+
+
+void InferenceEngine::add_layer( PackedLayer&& layer ) {
+    assert( _layers.empty() || _layers.back().output_dim == layer.input_dim );
+
+    _max_dim = std::max( { _max_dim, layer.input_dim, layer.padded_dim } );
+    _layers.push_back( std::move( layer ) );
+}
+
+
+size_t InferenceEngine::input_dim() const {
+    return _layers.empty() ? 0 : _layers.front().input_dim;
+}
+
+size_t InferenceEngine::output_dim() const {
+    return _layers.empty() ? 0 : _layers.back().output_dim;
+}
+
+const std::vector< PackedLayer >& InferenceEngine::layers() const {
+    return _layers;
+}
+
+
+InferenceEngine::Workspace InferenceEngine::workspace() const {
+    Workspace ws;
+    ws.buffers[0] = aligned_vector( _max_dim, 0.f );
+    ws.buffers[1] = aligned_vector( _max_dim, 0.f );
+    ws.indices = std::vector< uint32_t >( _max_dim, 0 );
+    ws.values = aligned_vector( _max_dim, 0.f );
+
+    return ws;
+}
+
+
+const float* InferenceEngine::forward( const float* input, Workspace& ws ) const {
+
+    const float* in = input;
+    size_t in_dim = input_dim();
+
+    for ( size_t i = 0; i < _layers.size(); i++ ){
+
+        // Compact the nonzero inputs of this layer
+        size_t nonzeros = 0;
+        for ( size_t k = 0; k < in_dim; k++ ){
+            ws.indices[nonzeros] = k;
+            ws.values[nonzeros] = in[k];
+            nonzeros += ( in[k] != 0.f );
+        }
+
+        float* out = ws.buffers[i % 2].data();
+        _layers[i].forward( ws.indices.data(), ws.values.data(), nonzeros, out );
+
+        in = out;
+        in_dim = _layers[i].output_dim;
+    }
+
+    return in;
+}
+
+
+size_t InferenceEngine::predict( const float* input, Workspace& ws ) const {
+    const float* logits = forward( input, ws );
+    return std::max_element( logits, logits + output_dim() ) - logits;
+}
+
+
+/*
+ *  COMPILE STEP
+ */
+static void fold_normalization( LayerParams& layer, const Normalization& norm ) {
+
+    Matrix& w = layer.weights;
+    assert( norm.mean.size() == w.cols );
+
+    if ( layer.bias.rows == 0 ) {
+        layer.bias = Matrix( w.rows, 1 );
+    }
+
+    for ( size_t col = 0; col < w.cols; col++ ) {
+        float* weights = w.column( col );
+        for ( size_t row = 0; row < w.rows; row++ ) {
+            weights[row] *= norm.scale[col];
+            layer.bias.at( row, 0 ) -= weights[row] * norm.mean[col];
+        }
+    }
+}
+
+
+// Merge `second` into `first`, which has Identity activation
+static LayerParams merge_layers( const LayerParams& first, const LayerParams& second ) {
+
+    LayerParams res = { second.act, second.weights.mult( first.weights ), Matrix() };
+
+    if ( first.bias.rows != 0 ) {
+        res.bias = second.weights.mult( first.bias );
+    }
+
+    if ( second.bias.rows != 0 ) {
+        if ( res.bias.rows == 0 ) {
+            res.bias = second.bias;
+        }
+        else {
+            res.bias.cwise_add( second.bias );
+        }
+    }
+
+    return res;
+}
+
+
+std::vector< LayerParams > compile_layers( std::vector< LayerParams >&& layers,
+                                           const Normalization& norm ) {
+
+    if ( !norm.empty() && !layers.empty() ) {
+        fold_normalization( layers[0], norm );
+    }
+
+    std::vector< LayerParams > res;
+    for ( auto& layer : layers ) {
+
+        if ( !res.empty() && res.back().act == ActivationKind::Identity ) {
+            const Matrix& w1 = res.back().weights;
+            const Matrix& w2 = layer.weights;
+
+            if ( w2.rows * w1.cols <= w1.rows * w1.cols + w2.rows * w2.cols ) {
+                res.back() = merge_layers( res.back(), layer );
+                continue;
+            }
+        }
+
+        res.push_back( std::move( layer ) );
+    }
+
+    return res;
+}
+
+
+InferenceEngine compile( const NeuralNet& net, const Normalization& norm ) {
+
+    return InferenceEngine( compile_layers( layer_params( net ), norm ) );
+}
@@ -0,0 +1,31 @@
+#include <iostream>
+#include <string>
+
+#include "loader.hpp"
+#include "server.hpp"
+
+
+/*
+ * Load generator for `neural-net serve <socket>`.
+ *
+ *      load-gen <socket path> [clients] [requests per client]
+ *
+ * Sends raw test samples from many concurrent connections and reports
+ * latency and throughput as seen by the clients and by the server.
+ */
+int main( int argc, char** argv ) {
+
+    if ( argc < 2 ) {
+        std::cout << "Usage: load-gen <socket path> [clients] [requests per client]\n";
+        return 1;
+    }
+
+    size_t clients = argc > 2 ? std::stoul( argv[2] ) : 16;
+    size_t requests = argc > 3 ? std::stoul( argv[3] ) : 1000;
+
+    Loader load;
+    auto samples = load.load_vectors_from_csv( "../data/fashion_mnist_test_vectors.csv" );
+    auto labels = load.load_labels_from_csv( "../data/fashion_mnist_test_labels.csv" );
+
+    return run_load_generator( argv[1], samples, labels, clients, requests );
+}
@@ -1,17 +1,199 @@
+#include <cctype>
+#include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <string>
 #include <vector>
 
 
+#include "autotune.hpp"
+#include "cascade.hpp"
+#include "checkpoint.hpp"
+#include "compress.hpp"
+#include "distill.hpp"
+#include "distributed.hpp"
+#include "inference.hpp"
 #include "loader.hpp"
+#include "memory.hpp"
+#include "online.hpp"
 #include "optimizer.hpp"
+#include "pruning.hpp"
+#include "server.hpp"
+#include "stream.hpp"
+#include "sweep.hpp"
 #include "trainer.hpp"
 
 
-int main() {
+/*
+ * Usage:
+ *
+ *      neural-net [train [sparse] [accumulate <steps>] [overlap [threads]] [validate [patience]]]
+ *          train with the default hyperparameters, write predictions,
+ *          model.ckpt and the compiled model_inference.ckpt; with `sparse`
+ *          inputs are only scaled, keep their zeros and go through the
+ *          sparse first layer kernels, the first bias learns the mean; with
+ *          `accumulate` the gradients of <steps> batches of 64 are summed
+ *          per optimizer step; with `overlap` the optimizer updates run on a
+ *          pool during the backward pass, with `validate` the last 10% of
+ *          the training set are held out and evaluated in the background
+ *          after every epoch (curves written to validation_log.csv),
+ *          stopping early after `patience` epochs without improvement
+ *          (0 = never); kernels are tuned for this machine on the first
+ *          run, see autotune.cache
+ *
+ *      neural-net check
+ *          compare the sparse input path with the dense one, gradient
+ *          accumulation with a single large batch and activation
+ *          recomputation with kept activations on random data, print the
+ *          largest differences of logits, gradients and weights
+ *
+ *      neural-net tune [batch]
+ *          retune the kernels for the default net, overwriting the entries
+ *          of this machine in autotune.cache
+ *
+ *      neural-net memory [batch] [epochs] [accumulation steps] [recompute segment]
+ *          predict the memory of training the default net, then train it
+ *          with the memory tracker on and report live / peak bytes by
+ *          category and layer and the allocations per step; the peak
+ *          depends on `batch` only, not on the accumulated steps. With a
+ *          recompute segment > 1 only every segment-th layer keeps its
+ *          activations, the others are recomputed in the backward pass, and
+ *          the activation memory saved and flops added are reported
+ *
+ *      neural-net compress energy <fraction> [finetune epochs]
+ *      neural-net compress accuracy <max drop> [finetune epochs]
+ *          replace the first layer of model.ckpt by a low-rank factorization,
+ *          the rank chosen on the last 10% of the training set, report cost
+ *          before / after on the test set and write model_lowrank.ckpt;
+ *          fails if the rank is past break-even
+ *
+ *      neural-net distill [hidden] [temperature] [alpha] [epochs]
+ *          train a 784-hidden-10 student on the soft targets of model.ckpt
+ *          and, for comparison, the same student on the labels alone;
+ *          report accuracy and inference cost against the teacher, write
+ *          model_student.ckpt
+ *
+ *      neural-net cascade [cheap checkpoint] [max drop] [batch]
+ *          predict with the cheap model (model_student.ckpt by default) and
+ *          escalate the samples it is unsure of to model.ckpt; the threshold
+ *          is calibrated on the first half of the test set to lose at most
+ *          `max drop` accuracy against model.ckpt alone, the second half
+ *          reports the escalated fraction, accuracy and cost per sample
+ *
+ *      neural-net prune <sparsity> [finetune epochs]
+ *          gradually prune model.ckpt to the target sparsity while fine-tuning,
+ *          compare dense and block-sparse inference, write model_sparse.ckpt
+ *
+ *      neural-net stream <memory budget MiB> [epochs] [samples per shard]
+ *          convert the training set to binary shards (if not present), train
+ *          on them streamed from disk within the budget, write predictions
+ *
+ *      neural-net distributed <rank> <world> shm|tcp [epochs]
+ *          one of `world` processes of data-parallel training, each on its
+ *          shard of the training set, gradients averaged over shared memory
+ *          or TCP loopback (ports 29500 + rank); rank 0 writes predictions
+ *          and model.ckpt
+ *
+ *      neural-net sweep [trials] [max epochs] [threads]
+ *          train random hyperparameter configurations concurrently with
+ *          successive halving, scored on the last 10% of the training set,
+ *          print a summary and write sweep_results.csv
+ *
+ *      neural-net online <source> [follow [idle seconds]] [serve <socket path>]
+ *          keep training model.ckpt (a new net if there is none) on lines
+ *          "label,x1,...,xn" read from <source> (a file, FIFO or - for
+ *          stdin), e.g. made by paste -d, labels.csv vectors.csv; with
+ *          `follow` a file is tailed for appended lines. The normalization
+ *          stored in model.ckpt is kept, a new net estimates it from the
+ *          first samples of the stream. Snapshots are published atomically
+ *          to model_inference.ckpt, or with `serve` swapped into a server on
+ *          the socket, which runs until Ctrl-C. Writes model.ckpt and the
+ *          Adam moments to model.adam at the end, the next run continues
+ *          both.
+ *
+ *      neural-net serve stdin|<socket path> [max batch] [max wait us] [workers]
+ *          serve predictions of model_inference.ckpt with dynamic batching,
+ *          see server.hpp for the protocols and load-gen for a client
+ */
 
 
-    int seed = 1;
-    rng.seed( seed );
+// Fashion-MNIST, raw data with the normalization by statistics of the
+// training set, which is applied as samples are used
+struct FashionMnist {
+    std::vector< std::vector< float > > train_data;
+    std::vector< int > train_labels;
+
+    std::vector< std::vector< float > > test_data;
+    std::vector< int > test_labels;
+
+    Normalization norm;
+};
+
+
+FashionMnist load_fashion_mnist() {
+
+    Loader load;
+    FashionMnist res;
+
+    res.train_data = load.load_vectors_from_csv( "../data/fashion_mnist_train_vectors.csv" );
+    res.train_labels = load.load_labels_from_csv( "../data/fashion_mnist_train_labels.csv" );
+
+    res.test_data = load.load_vectors_from_csv( "../data/fashion_mnist_test_vectors.csv" );
+    res.test_labels = load.load_labels_from_csv( "../data/fashion_mnist_test_labels.csv" );
+
+    res.norm = Normalization::global( compute_statistics( res.train_data ) );
+
+    return res;
+}
+
+
+// Compile the net for serving (normalization folded in), the compiled
+// layers are saved as model_inference.ckpt and take raw samples
+InferenceEngine compile_for_serving( const NeuralNet& net, const Normalization& norm ) {
+
+    std::vector< LayerParams > layers = compile_layers( layer_params( net ), norm );
+    std::cout << "Compiled " << net.layers().size() << " layers into " << layers.size() << "\n";
+
+    write_checkpoint( "model_inference.ckpt", layers );
+    return InferenceEngine( layers );
+}
+
+
+// Predict raw samples one at a time
+void write_predictions( const InferenceEngine& engine, const std::vector< std::vector< float > >& data,
+                        const std::string& path ) {
+
+    InferenceEngine::Workspace ws = engine.workspace();
+
+    std::ofstream output( path );
+    for ( size_t i = 0; i < data.size(); i++ ) {
+        output << engine.predict( data[i].data(), ws ) << "\n";
+    }
+}
+
+
+// Test data as a matrix, normalized
+Matrix normalized_test_data( const FashionMnist& data ) {
+    Loader load;
+    Matrix res = load.to_matrix( data.test_data );
+    data.norm.apply( res );
+    return res;
+}
+
+
+struct TrainOptions {
+    bool sparse = false;
+    size_t accumulation_steps = 1;
+
+    bool overlap = false;
+    size_t update_threads = 0;
+
+    bool validate = false;
+    size_t patience = 0;
+};
+
+
+int train( FashionMnist& data, const TrainOptions& options ) {
 
     auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
                     std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
@@ -32,35 +214,781 @@ int main() {
     size_t epochs = 40;
     size_t batch_size = 64;
 
+    AdamOptimizer opt( &net, lr, beta1, beta2 );
+
+    autotune( net, batch_size, "autotune.cache" );
+
+    size_t held_out = options.validate ? data.train_data.size() / 10 : 0;
+    size_t train_size = data.train_data.size() - held_out;
+
+    std::vector< std::vector< float > > train_data( data.train_data.begin(), data.train_data.begin() + train_size );
+    std::vector< int > train_labels( data.train_labels.begin(), data.train_labels.begin() + train_size );
+
+    // Sparse inputs are scaled up front, without the mean shift zeros stay
+    // zeros. The shift is a constant input to the first layer, which its
+    // bias absorbs, the model is the same.
+    Normalization norm = data.norm;
+    if ( options.sparse ) {
+        std::fill( norm.mean.begin(), norm.mean.end(), 0.f );
+        for ( auto& sample : train_data ) {
+            norm.apply( sample.data(), sample.data() );
+        }
+    }
+
+    Trainer trainer( &net, &opt, std::move( train_data ), std::move( train_labels ) );
+    if ( options.sparse ) {
+        trainer.set_sparse_inputs( true );
+    }
+    else {
+        trainer.set_normalization( norm );
+    }
+    trainer.set_overlapped_updates( options.overlap, options.update_threads );
+
+    std::unique_ptr< BackgroundValidator > validator;
+    if ( options.validate ) {
+        Loader load;
+        std::vector< std::vector< float > > samples( data.train_data.begin() + train_size, data.train_data.end() );
+        validator = std::make_unique< BackgroundValidator >(
+            load.to_matrix( samples ), std::vector< int >( data.train_labels.begin() + train_size, data.train_labels.end() ),
+            norm );
+
+        EarlyStopping stopping;
+        stopping.patience = options.patience;
+        trainer.set_validation( validator.get(), stopping );
+    }
+
+    trainer.train( epochs, batch_size, options.accumulation_steps );
+
+    if ( validator ) {
+        validator->write_csv( "validation_log.csv" );
+    }
+
+    save_checkpoint( net, "model.ckpt", norm );
+
+    InferenceEngine engine = compile_for_serving( net, norm );
+    write_predictions( engine, data.test_data, "test_predictions.csv" );
+    write_predictions( engine, data.train_data, "train_predictions.csv" );
+
+    return 0;
+}
+
+
+static float max_difference( const Matrix& a, const Matrix& b ) {
+
+    float res = 0.f;
+    for ( size_t col = 0; col < a.cols; col++ ) {
+        for ( size_t row = 0; row < a.rows; row++ ) {
+            res = std::max( res, std::abs( a.column( col )[row] - b.column( col )[row] ) );
+        }
+    }
+
+    return res;
+}
+
+
+static float max_difference( const std::vector< Matrix* >& a, const std::vector< Matrix* >& b ) {
+
+    float res = 0.f;
+    for ( size_t i = 0; i < a.size(); i++ ) {
+        res = std::max( res, max_difference( *a[i], *b[i] ) );
+    }
+
+    return res;
+}
+
+
+// Random 784-64-10 net
+static NeuralNet check_net() {
+    auto layers = { std::make_shared< LinearLayer >( 784, 64, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 64, 10, "id", "he" ),
+    };
+
+    return NeuralNet( std::move( layers ) );
+}
+
+
+// Random samples, about 60% of the features zero like Fashion-MNIST
+static Matrix check_inputs( size_t samples ) {
+    std::vector< float > values = rng.normal_vec( 784 * samples, 0.f, 1.f );
+    for ( float& x : values ) {
+        x = x < 0.25f ? 0.f : x;
+    }
+
+    return Matrix( std::move( values ), 784, samples );
+}
+
+
+/*
+ * Equivalence checks of the alternative training paths against the plain
+ * one, differences are rounding only.
+ */
+int check() {
+
+    rng.seed( 3 );
+    bool ok = true;
+    auto report = [&]( const std::string& what, float difference ){
+        bool pass = difference < 1e-4f;
+        ok = ok && pass;
+        std::cout << std::setw( 40 ) << std::left << what << std::right << std::setw( 12 ) << difference
+                  << ( pass ? "  ok\n" : "  FAILED\n" );
+    };
+
+    // Sparse inputs against dense ones
+    {
+        NeuralNet dense = check_net();
+        NeuralNet sparse = from_layer_params( layer_params( dense ) );
+
+        Matrix input = check_inputs( 32 );
+        Matrix derivatives( rng.normal_vec( 10 * 32, 0.f, 1.f ), 10, 32 );
+
+        Matrix dense_logits = dense.forward( input.view() );
+        Matrix sparse_logits = sparse.forward( SparseMatrix::from_dense( input ) );
+        dense.backward( Matrix( derivatives ) );
+        sparse.backward( Matrix( derivatives ) );
+
+        report( "sparse inputs, logits", max_difference( dense_logits, sparse_logits ) );
+        report( "sparse inputs, gradients", max_difference( dense.grads(), sparse.grads() ) );
+    }
+
+    // Four accumulated batches of 16 against single batches of 64, the
+    // same samples in the same order
+    {
+        std::vector< std::vector< float > > samples;
+        std::vector< int > labels;
+        Matrix inputs = check_inputs( 640 );
+        for ( size_t j = 0; j < inputs.cols; j++ ) {
+            samples.emplace_back( inputs.column( j ), inputs.column( j ) + inputs.rows );
+            labels.push_back( int( j % 10 ) );
+        }
+
+        NeuralNet single = check_net();
+        NeuralNet accumulated = from_layer_params( layer_params( single ) );
+
+        auto train = [&]( NeuralNet& net, size_t batch, size_t steps ){
+            AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+            Trainer trainer( &net, &opt, samples, labels );
+            trainer.set_verbose( false );
+            trainer.train( 1, batch, steps );
+        };
+
+        train( single, 64, 1 );
+        train( accumulated, 16, 4 );
+
+        std::vector< Matrix* > single_weights, accumulated_weights;
+        for ( size_t i = 0; i < single.layers().size(); i++ ) {
+            single_weights.push_back( &single.layers()[i]->_weights );
+            accumulated_weights.push_back( &accumulated.layers()[i]->_weights );
+        }
+
+        report( "accumulated batches, weights", max_difference( single_weights, accumulated_weights ) );
+    }
+
+    // A deeper net recomputing all but every second layer's activations
+    {
+        std::vector< std::shared_ptr< LinearLayer > > layers = {
+            std::make_shared< LinearLayer >( 784, 64, "relu", "he" ) };
+        for ( size_t i = 0; i < 4; i++ ) {
+            layers.push_back( std::make_shared< LinearLayer >( 64, 64, "relu", "he" ) );
+        }
+        layers.push_back( std::make_shared< LinearLayer >( 64, 10, "id", "he" ) );
+
+        NeuralNet kept( std::move( layers ) );
+        NeuralNet recomputed = from_layer_params( layer_params( kept ) );
+        recomputed.set_recompute( 2 );
+
+        Matrix input = check_inputs( 32 );
+        Matrix derivatives( rng.normal_vec( 10 * 32, 0.f, 1.f ), 10, 32 );
+
+        Matrix kept_logits = kept.forward( input.view() );
+        Matrix recomputed_logits = recomputed.forward( input.view() );
+        kept.backward( Matrix( derivatives ) );
+        recomputed.backward( Matrix( derivatives ) );
+
+        report( "recomputed activations, logits", max_difference( kept_logits, recomputed_logits ) );
+        report( "recomputed activations, gradients", max_difference( kept.grads(), recomputed.grads() ) );
+        recomputed.recompute_stats().print();
+    }
+
+    return ok ? 0 : 1;
+}
+
+
+int memory( size_t batch_size, size_t epochs, size_t accumulation_steps, size_t recompute_segment ) {
+
+    memory_tracker.enable();
+
+    FashionMnist data = load_fashion_mnist();
+
+    MemoryEstimate estimate = estimate_training_memory( { 784, 256, 10 }, batch_size, data.train_data.size() );
+    estimate.print();
+
+    auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+    };
+
+    NeuralNet net( std::move( layers ) );
+    net.set_recompute( recompute_segment );
+    AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+
+    // Prints the recomputation stats at the end if any layer recomputes
+    Trainer trainer( &net, &opt, std::move( data.train_data ), std::move( data.train_labels ) );
+    trainer.set_normalization( data.norm );
+    trainer.train( epochs, batch_size, accumulation_steps );
+
+    if ( accumulation_steps > 1 ) {
+        std::cout << "Batches of " << batch_size << " accumulated over " << accumulation_steps
+                  << " steps, effective batch " << batch_size * accumulation_steps << "\n";
+    }
+
+    memory_tracker.print();
+
+    size_t peak = memory_tracker.total().peak;
+    std::cout << "Peak " << ( peak >> 10 ) << " KiB, estimated " << ( estimate.total() >> 10 ) << " KiB ("
+              << 100.0 * ( double( estimate.total() ) - double( peak ) ) / std::max< size_t >( 1, peak ) << "%)\n";
+
+    return 0;
+}
+
+
+int compress( FashionMnist& data, const std::string& criterion, float value, size_t finetune_epochs ) {
+
+    NeuralNet net;
+    if ( !load_checkpoint( "model.ckpt", net ) ) {
+        return 1;
+    }
+
+    // The rank is chosen on the last 10% of the training set (unseen with
+    // `train validate`), the test split is kept for the report
+    size_t calibration_size = data.train_data.size() / 10;
     Loader load;
-    std::vector< std::vector< float > > train_data = load.load_vectors_from_csv( "../data/fashion_mnist_train_vectors.csv" );
-    std::vector< int > train_labels = load.load_labels_from_csv( "../data/fashion_mnist_train_labels.csv" );
+    std::vector< std::vector< float > > samples( data.train_data.end() - calibration_size, data.train_data.end() );
+    std::vector< int > calibration_labels( data.train_labels.end() - calibration_size, data.train_labels.end() );
+    Matrix calibration = load.to_matrix( samples );
+    data.norm.apply( calibration );
 
-    std::vector< std::vector< float > > test_data = load.load_vectors_from_csv( "../data/fashion_mnist_test_vectors.csv" );
-    std::vector< int > test_labels = load.load_labels_from_csv( "../data/fashion_mnist_test_labels.csv" );
+    Matrix held_out = normalized_test_data( data );
 
-    auto [mean, sd] = load.normalize_dataset(train_data);
-    load.normalize_dataset(test_data, mean, sd);
+    const Matrix& weights = net.layers()[0]->_weights;
+    LowRankFactors factors = decompose( weights );
+    size_t rank = ( criterion == "energy" )
+                ? rank_for_energy( factors, value )
+                : rank_for_accuracy( net, 0, factors, calibration, calibration_labels, value );
 
-    AdamOptimizer opt( &net, lr, beta1, beta2 );
+    std::cout << "Rank " << rank << " of " << factors.singular_values.size() << "\n";
+
+    size_t limit = break_even_rank( weights.rows, weights.cols );
+    if ( rank > limit ) {
+        std::cout << "Compression does not pay off: above rank " << limit << " the factors of the "
+                  << weights.rows << "x" << weights.cols << " layer have more weights than the layer itself\n";
+        return 1;
+    }
+
+    NeuralNet compressed = factorize( net, 0, factors, rank );
+
+    ModelCost before = measure( net, held_out, data.test_labels );
+    ModelCost after = measure( compressed, held_out, data.test_labels );
+    print_cost_comparison( before, after );
 
-    Trainer trainer( &net, &opt, train_data, train_labels );
-    trainer.train( epochs, batch_size );
+    if ( finetune_epochs > 0 ) {
+        compressed.training();
+        AdamOptimizer opt( &compressed, 0.0001, 0.9, 0.999 );
+        Trainer trainer( &compressed, &opt, data.train_data, data.train_labels );
+        trainer.set_normalization( data.norm );
+        trainer.train( finetune_epochs, 64 );
 
-    // Output predictions of the model
-    std::ofstream test_output("test_predictions.csv");
-    for ( size_t i = 0; i < test_data.size(); i++ ) {
-        Matrix input(test_data[i], test_data[i].size(), 1);
-        auto res = net.predict( std::move(input) );
-        test_output << res[0] << "\n";
+        std::cout << "After fine-tuning:\n";
+        print_cost_comparison( before, measure( compressed, held_out, data.test_labels ) );
     }
 
-    std::ofstream train_output("train_predictions.csv");
-    for ( size_t i = 0; i < train_data.size(); i++ ) {
-        Matrix input(train_data[i], train_data[i].size(), 1);
-        auto res = net.predict( std::move(input) );
-        train_output << res[0] << "\n";
+    save_checkpoint( compressed, "model_lowrank.ckpt" );
+    return 0;
+}
+
+
+int distill( FashionMnist& data, size_t hidden, float temperature, float alpha, size_t epochs ) {
+
+    NeuralNet teacher;
+    if ( !load_checkpoint( "model.ckpt", teacher ) ) {
+        return 1;
     }
 
+    auto train = std::make_shared< const Dataset >( Dataset{ data.train_data, data.train_labels } );
+
+    auto start = std::chrono::steady_clock::now();
+    auto targets = std::make_shared< const SoftTargets >(
+        compute_soft_targets( teacher, *train, data.norm, temperature ) );
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    std::cout << "Soft targets at T = " << temperature << " of " << targets->samples() << " samples in "
+              << seconds << " s, " << ( targets->probabilities.size() * sizeof( uint16_t ) >> 10 ) << " KiB\n";
+
+    // Both students start from the same weights and see the same batches
+    auto train_student = [&]( bool distilled ){
+        rng.seed( 2 );
+        auto layers = { std::make_shared< LinearLayer >( 784, hidden, "relu", "he" ),
+                        std::make_shared< LinearLayer >( hidden, 10, "id", "he" ),
+        };
+
+        NeuralNet student( std::move( layers ) );
+        AdamOptimizer opt( &student, 0.001, 0.9, 0.999 );
+
+        Trainer trainer( &student, &opt, train );
+        trainer.set_normalization( data.norm );
+        trainer.set_verbose( false );
+        if ( distilled ) {
+            trainer.set_distillation( targets, alpha );
+        }
+
+        trainer.train( epochs, 64 );
+        return student;
+    };
+
+    NeuralNet student = train_student( true );
+    NeuralNet baseline = train_student( false );
+
+    Matrix held_out = normalized_test_data( data );
+    ModelCost teacher_cost = measure( teacher, held_out, data.test_labels );
+    ModelCost student_cost = measure( student, held_out, data.test_labels );
+
+    std::cout << "Teacher (before) against the distilled 784-" << hidden << "-10 student (after):\n";
+    print_cost_comparison( teacher_cost, student_cost );
+    std::cout << "Same student trained on the labels only: accuracy "
+              << measure( baseline, held_out, data.test_labels ).accuracy << "\n";
+
+    save_checkpoint( student, "model_student.ckpt" );
     return 0;
 }
+
+
+int cascade( FashionMnist& data, const std::string& cheap_path, float max_drop, size_t batch ) {
+
+    NeuralNet cheap;
+    NeuralNet full;
+    if ( !load_checkpoint( cheap_path, cheap ) || !load_checkpoint( "model.ckpt", full ) ) {
+        return 1;
+    }
+
+    Matrix test = normalized_test_data( data );
+    size_t half = test.cols / 2;
+
+    std::vector< int > calibration_labels( data.test_labels.begin(), data.test_labels.begin() + half );
+    std::vector< int > evaluation_labels( data.test_labels.begin() + half, data.test_labels.end() );
+
+    Cascade cascade( &cheap, &full );
+    float threshold = cascade.calibrate( test.view().col_range( 0, half ), calibration_labels, max_drop );
+    std::cout << "Calibrated on " << half << " samples for an accuracy drop of at most " << max_drop
+              << ": threshold " << threshold << "\n";
+
+    evaluate_cascade( cascade, cheap, full, test.view().col_range( half, test.cols - half ),
+                      evaluation_labels, batch ).print();
+    return 0;
+}
+
+
+int prune( FashionMnist& data, float sparsity, size_t finetune_epochs ) {
+
+    NeuralNet net;
+    if ( !load_checkpoint( "model.ckpt", net ) ) {
+        return 1;
+    }
+
+    PruningSchedule schedule;
+    schedule.target_sparsity = sparsity;
+    schedule.start_epoch = 0;
+    schedule.end_epoch = finetune_epochs > 0 ? finetune_epochs - 1 : 0;
+
+    if ( finetune_epochs > 0 ) {
+        AdamOptimizer opt( &net, 0.0005, 0.9, 0.999 );
+        Trainer trainer( &net, &opt, data.train_data, data.train_labels );
+        trainer.set_normalization( data.norm );
+        trainer.set_pruning( schedule );
+        trainer.train( finetune_epochs, 64 );
+    }
+    else {
+        for ( auto& layer : net.layers() ) {
+            prune_layer( *layer, sparsity, schedule.block_rows );
+        }
+    }
+
+    for ( size_t i = 0; i < net.layers().size(); i++ ) {
+        std::cout << "Layer " << i << " sparsity " << weight_sparsity( *net.layers()[i] ) << "\n";
+    }
+
+    SparseNet sparse( net );
+    compare_sparse( net, sparse, normalized_test_data( data ), data.test_labels );
+
+    sparse.save( "model_sparse.ckpt" );
+    return 0;
+}
+
+
+int stream( size_t budget_mib, size_t epochs, size_t samples_per_shard ) {
+
+    // Reuse shards of an earlier run, the first one tells they exist
+    std::vector< Shard > shards;
+    for ( size_t i = 0; std::ifstream( "train_shard_" + std::to_string( i ) + ".bin" ).good(); i++ ) {
+        shards.push_back( { "train_shard_" + std::to_string( i ) + ".bin", "" } );
+    }
+
+    if ( shards.empty() ) {
+        shards = shard_csv( "../data/fashion_mnist_train_vectors.csv",
+                            "../data/fashion_mnist_train_labels.csv",
+                            "train_shard", samples_per_shard );
+        if ( shards.empty() ) {
+            return 1;
+        }
+    }
+
+    Normalization norm = Normalization::global( shard_statistics( shards ) );
+
+    StreamingDataset data( shards, budget_mib << 20 );
+    if ( data.dim() == 0 ) {
+        return 1;
+    }
+
+    data.set_normalization( norm );
+    std::cout << shards.size() << " shards, streaming within " << ( data.memory_bytes() >> 10 ) << " KiB\n";
+
+    auto layers = { std::make_shared< LinearLayer >( data.dim(), 256, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+    };
+
+    NeuralNet net( std::move( layers ) );
+    AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+
+    Trainer trainer( &net, &opt, &data );
+    trainer.train( epochs, 64 );
+
+    save_checkpoint( net, "model.ckpt", norm );
+
+    // The test set is small, predict it from memory
+    Loader load;
+    auto test_data = load.load_vectors_from_csv( "../data/fashion_mnist_test_vectors.csv" );
+    write_predictions( compile_for_serving( net, norm ), test_data, "test_predictions.csv" );
+
+    return 0;
+}
+
+
+int distributed( FashionMnist& data, const DistributedConfig& config, size_t epochs ) {
+
+    auto transport = connect_ring( config );
+    if ( !transport ) {
+        return 1;
+    }
+
+    RingAllReduce ring( std::move( transport ) );
+
+    Dataset all{ std::move( data.train_data ), data.train_labels };
+    auto shard = shard_dataset( all, config.rank, config.world );
+    data.train_data = std::move( all.vectors );
+
+    // Every rank draws the same initial weights from the same seed
+    auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                    std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+    };
+
+    NeuralNet net( std::move( layers ) );
+    AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+
+    Trainer trainer( &net, &opt, shard );
+    trainer.set_shuffle_stream( config.rank );
+    trainer.set_normalization( data.norm );
+    trainer.set_gradient_sync( &ring );
+    trainer.set_verbose( config.rank == 0 );
+
+    auto start = std::chrono::steady_clock::now();
+    if ( !trainer.train( epochs, 64 ) ) {
+        std::cout << "Rank " << config.rank << " of " << config.world << " failed\n";
+        return 1;
+    }
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    std::cout << "Rank " << config.rank << " of " << config.world << ": " << shard->vectors.size()
+              << " samples, " << seconds << " s, all-reduce " << ring.seconds() << " s for "
+              << ( ring.bytes() >> 20 ) << " MiB sent\n";
+
+    if ( !ring.barrier() ) {
+        return 1;
+    }
+
+    if ( config.rank == 0 ) {
+        save_checkpoint( net, "model.ckpt", data.norm );
+        write_predictions( compile_for_serving( net, data.norm ), data.test_data, "test_predictions.csv" );
+    }
+
+    return 0;
+}
+
+
+int sweep( FashionMnist& data, size_t trials, size_t max_epochs, size_t threads ) {
+
+    // Normalized once, all trials read the same samples. The last 10% of
+    // the training set are held out for scoring.
+    size_t held_out = data.train_data.size() / 10;
+    size_t train_size = data.train_data.size() - held_out;
+
+    auto train = std::make_shared< Dataset >();
+    for ( size_t i = 0; i < train_size; i++ ) {
+        data.norm.apply( data.train_data[i].data(), data.train_data[i].data() );
+        train->vectors.push_back( std::move( data.train_data[i] ) );
+        train->labels.push_back( data.train_labels[i] );
+    }
+
+    Loader load;
+    std::vector< std::vector< float > > validation_data( data.train_data.begin() + train_size, data.train_data.end() );
+    std::vector< int > validation_labels( data.train_labels.begin() + train_size, data.train_labels.end() );
+
+    Matrix validation = load.to_matrix( validation_data );
+    data.norm.apply( validation );
+
+    data.train_data.clear();
+
+    SweepConfig config;
+    config.max_epochs = max_epochs;
+    config.threads = threads;
+
+    auto start = std::chrono::steady_clock::now();
+    auto results = run_sweep( train, validation, validation_labels, sample_trials( trials, 7 ), config );
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    print_sweep( results );
+
+    double trial_seconds = 0.0;
+    for ( auto& r : results ) {
+        trial_seconds += r.seconds;
+    }
+    std::cout << "Sweep took " << seconds << " s, " << trial_seconds << " s of training in trials\n";
+
+    return write_sweep_csv( results, "sweep_results.csv" ) ? 0 : 1;
+}
+
+
+int online( const std::string& source_path, const OnlineConfig& config, const std::string& socket_path ) {
+
+    NeuralNet net;
+    Normalization norm;
+    bool continuing = std::ifstream( "model.ckpt" ).good();
+    if ( continuing ) {
+        if ( !load_checkpoint( "model.ckpt", net, &norm ) ) {
+            return 1;
+        }
+        std::cout << "Continuing model.ckpt\n";
+
+        if ( norm.empty() ) {
+            std::cout << "model.ckpt has no normalization, it is estimated from the stream\n";
+        }
+    }
+    else {
+        auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                        std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+        };
+        net = NeuralNet( std::move( layers ) );
+    }
+
+    // The moments of the previous run, if it left them for this model.ckpt
+    AdamOptimizer opt( &net, 0.001, 0.9, 0.999 );
+    if ( continuing && std::ifstream( "model.adam" ).good() ) {
+        if ( opt.load( "model.adam" ) ) {
+            std::cout << "Continuing the optimizer state of model.adam\n";
+        }
+        else {
+            std::cout << "Starting with a fresh optimizer state\n";
+        }
+    }
+
+    OnlineLearner learner( &net, &opt, config );
+    if ( !norm.empty() ) {
+        learner.set_normalization( norm );
+    }
+
+    LineSource source;
+    if ( !source.open( source_path, config ) ) {
+        return 1;
+    }
+
+    std::atomic< bool > stop{ false };
+    auto start = std::chrono::steady_clock::now();
+
+    if ( socket_path.empty() ) {
+        learner.set_publisher( []( std::vector< LayerParams >&& layers ){
+            publish_checkpoint( "model_inference.ckpt", layers );
+        } );
+        learner.run( source, stop );
+    }
+    else {
+        // Serves the initial weights until the first snapshot arrives
+        BatchingServer server( compile_layers( layer_params( net ), norm ), ServerConfig() );
+        learner.set_publisher( [&]( std::vector< LayerParams >&& layers ){
+            server.update_model( std::move( layers ) );
+        } );
+
+        std::thread learning( [&](){ learner.run( source, stop ); } );
+        int res = serve_socket( server, socket_path );
+
+        stop = true;
+        learning.join();
+        if ( res != 0 ) {
+            return res;
+        }
+    }
+
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    const OnlineStats& stats = learner.stats();
+
+    std::cout << "Learned " << stats.samples << " samples in " << stats.steps << " steps, "
+              << stats.published << " snapshots published, " << stats.rejected << " lines rejected\n";
+    std::cout << "Accuracy on new samples " << float( stats.correct ) / std::max< size_t >( 1, stats.samples )
+              << ", training " << stats.seconds << " s of " << seconds << " s\n";
+
+    if ( !save_checkpoint( net, "model.ckpt", learner.normalization() ) || !opt.save( "model.adam" ) ) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int serve( const std::string& where, const ServerConfig& config ) {
+
+    std::vector< LayerParams > layers;
+    if ( !read_checkpoint( "model_inference.ckpt", layers ) ) {
+        return 1;
+    }
+
+    BatchingServer server( std::move( layers ), config );
+    return where == "stdin" ? serve_stdin( server ) : serve_socket( server, where );
+}
+
+
+int main( int argc, char** argv ) {
+
+    int seed = 1;
+    rng.seed( seed );
+
+    std::vector< std::string > args( argv + 1, argv + argc );
+    std::string mode = args.empty() ? "train" : args[0];
+
+    if ( mode == "train" ) {
+        FashionMnist data = load_fashion_mnist();
+        TrainOptions options;
+        auto number_at = [&]( size_t i ){
+            return i < args.size() && !args[i].empty() && std::isdigit( args[i][0] );
+        };
+
+        for ( size_t i = 1; i < args.size(); i++ ) {
+            if ( args[i] == "sparse" ) {
+                options.sparse = true;
+            }
+            else if ( args[i] == "accumulate" && number_at( i + 1 ) ) {
+                options.accumulation_steps = std::stoul( args[++i] );
+            }
+            else if ( args[i] == "overlap" ) {
+                options.overlap = true;
+                options.update_threads = number_at( i + 1 ) ? std::stoul( args[++i] ) : 0;
+            }
+            else if ( args[i] == "validate" ) {
+                options.validate = true;
+                options.patience = number_at( i + 1 ) ? std::stoul( args[++i] ) : 0;
+            }
+        }
+
+        return train( data, options );
+    }
+
+    if ( mode == "check" ) {
+        return check();
+    }
+
+    if ( mode == "tune" ) {
+        auto layers = { std::make_shared< LinearLayer >( 784, 256, "relu", "he" ),
+                        std::make_shared< LinearLayer >( 256, 10, "id", "he" ),
+        };
+
+        NeuralNet net( std::move( layers ) );
+        return autotune( net, args.size() > 1 ? std::stoul( args[1] ) : 64, "autotune.cache", true ) ? 0 : 1;
+    }
+
+    if ( mode == "memory" ) {
+        return memory( args.size() > 1 ? std::stoul( args[1] ) : 64, args.size() > 2 ? std::stoul( args[2] ) : 1,
+                       args.size() > 3 ? std::stoul( args[3] ) : 1, args.size() > 4 ? std::stoul( args[4] ) : 0 );
+    }
+
+    if ( mode == "compress" && args.size() >= 3 && ( args[1] == "energy" || args[1] == "accuracy" ) ) {
+        FashionMnist data = load_fashion_mnist();
+        return compress( data, args[1], std::stof( args[2] ),
+                         args.size() > 3 ? std::stoul( args[3] ) : 0 );
+    }
+
+    if ( mode == "distill" ) {
+        FashionMnist data = load_fashion_mnist();
+        return distill( data, args.size() > 1 ? std::stoul( args[1] ) : 64,
+                        args.size() > 2 ? std::stof( args[2] ) : 4.f,
+                        args.size() > 3 ? std::stof( args[3] ) : 0.7f,
+                        args.size() > 4 ? std::stoul( args[4] ) : 40 );
+    }
+
+    if ( mode == "cascade" ) {
+        FashionMnist data = load_fashion_mnist();
+        return cascade( data, args.size() > 1 ? args[1] : "model_student.ckpt",
+                        args.size() > 2 ? std::stof( args[2] ) : 0.005f,
+                        args.size() > 3 ? std::stoul( args[3] ) : 256 );
+    }
+
+    if ( mode == "prune" && args.size() >= 2 ) {
+        FashionMnist data = load_fashion_mnist();
+        return prune( data, std::stof( args[1] ), args.size() > 2 ? std::stoul( args[2] ) : 0 );
+    }
+
+    if ( mode == "stream" && args.size() >= 2 ) {
+        return stream( std::stoul( args[1] ), args.size() > 2 ? std::stoul( args[2] ) : 40,
+                       args.size() > 3 ? std::stoul( args[3] ) : 10000 );
+    }
+
+    if ( mode == "distributed" && args.size() >= 4 ) {
+        DistributedConfig config;
+        config.rank = std::stoul( args[1] );
+        config.world = std::stoul( args[2] );
+        config.transport = args[3];
+
+        FashionMnist data = load_fashion_mnist();
+        return distributed( data, config, args.size() > 4 ? std::stoul( args[4] ) : 40 );
+    }
+
+    if ( mode == "sweep" ) {
+        FashionMnist data = load_fashion_mnist();
+        return sweep( data, args.size() > 1 ? std::stoul( args[1] ) : 27,
+                      args.size() > 2 ? std::stoul( args[2] ) : 18,
+                      args.size() > 3 ? std::stoul( args[3] ) : 0 );
+    }
+
+    if ( mode == "online" && args.size() >= 2 ) {
+        OnlineConfig config;
+        std::string socket_path;
+
+        for ( size_t i = 2; i < args.size(); i++ ) {
+            if ( args[i] == "follow" ) {
+                config.follow = true;
+                if ( i + 1 < args.size() && std::isdigit( args[i + 1][0] ) ) {
+                    config.idle_ms = 1000 * std::stoul( args[++i] );
+                }
+            }
+            else if ( args[i] == "serve" && i + 1 < args.size() ) {
+                socket_path = args[++i];
+            }
+        }
+
+        return online( args[1], config, socket_path );
+    }
+
+    if ( mode == "serve" && args.size() >= 2 ) {
+        ServerConfig config;
+        config.max_batch = args.size() > 2 ? std::stoul( args[2] ) : config.max_batch;
+        config.max_wait_us = args.size() > 3 ? std::stoul( args[3] ) : config.max_wait_us;
+        config.workers = args.size() > 4 ? std::stoul( args[4] ) : config.workers;
+        return serve( args[1], config );
+    }
+
+    std::cout << "Unknown mode, see the top of main.cpp for usage\n";
+    return 1;
+}
@@ -0,0 +1,359 @@
+#include "memory.hpp"
+
+#include <iomanip>
+
+
+MemoryTracker memory_tracker;
+
+
+MemoryTracker::~MemoryTracker() {
+    matrix_memory_hooks = MatrixMemoryHooks();
+}
+
+
+// Scope of the calling thread
+static thread_local MemoryCategory current_category = MemoryCategory::other;
+static thread_local int current_layer = NO_LAYER;
+
+
+const char* category_name( MemoryCategory category ) {
+    switch ( category ) {
+        case MemoryCategory::weights:       return "weights";
+        case MemoryCategory::gradients:     return "gradients";
+        case MemoryCategory::optimizer:     return "optimizer";
+        case MemoryCategory::activations:   return "activations";
+        case MemoryCategory::dataset:       return "dataset";
+        default:                            return "other";
+    }
+}
+
+
+MemoryScope::MemoryScope( MemoryCategory category, int layer ) : _category( current_category ),
+                                                                 _layer( current_layer ) {
+    current_category = category;
+    current_layer = layer;
+}
+
+
+MemoryScope::~MemoryScope() {
+    current_category = _category;
+    current_layer = _layer;
+}
+
+
+static void on_allocated( const void* ptr, size_t bytes ) {
+    memory_tracker.allocated( ptr, bytes );
+}
+
+
+static void on_freed( const void* ptr ) {
+    memory_tracker.freed( ptr );
+}
+
+
+void MemoryTracker::enable() {
+    std::lock_guard< std::mutex > lock( _mutex );
+    _enabled = true;
+    matrix_memory_hooks.allocated = on_allocated;
+    matrix_memory_hooks.freed = on_freed;
+}
+
+
+void MemoryTracker::disable() {
+    std::lock_guard< std::mutex > lock( _mutex );
+    _enabled = false;
+    matrix_memory_hooks = MatrixMemoryHooks();
+}
+
+
+bool MemoryTracker::enabled() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _enabled;
+}
+
+
+void MemoryTracker::reset() {
+    std::lock_guard< std::mutex > lock( _mutex );
+    _blocks.clear();
+    _total = MemoryUsage();
+    _categories = {};
+    _layers.clear();
+    _step_count = _step_bytes = 0;
+    _steps = StepAllocations();
+}
+
+
+void MemoryTracker::reset_peaks() {
+    std::lock_guard< std::mutex > lock( _mutex );
+
+    _total.peak = _total.live;
+    for ( auto& usage : _categories ) {
+        usage.peak = usage.live;
+    }
+
+    for ( auto& [layer, usages] : _layers ) {
+        for ( auto& usage : usages ) {
+            usage.peak = usage.live;
+        }
+    }
+}
+
+
+void MemoryTracker::add( const void* ptr, const Block& block ) {
+
+    auto account = [&]( MemoryUsage& usage ){
+        usage.live += block.bytes;
+        usage.peak = std::max( usage.peak, usage.live );
+        usage.allocations++;
+    };
+
+    _blocks[ptr] = block;
+    account( _total );
+    account( _categories[size_t( block.category )] );
+    account( _layers[block.layer][size_t( block.category )] );
+}
+
+
+void MemoryTracker::remove( const void* ptr ) {
+
+    auto it = _blocks.find( ptr );
+    if ( it == _blocks.end() ) {
+        return;
+    }
+
+    const Block& block = it->second;
+    _total.live -= block.bytes;
+    _categories[size_t( block.category )].live -= block.bytes;
+    _layers[block.layer][size_t( block.category )].live -= block.bytes;
+
+    _blocks.erase( it );
+}
+
+
+void MemoryTracker::allocated( const void* ptr, size_t bytes ) {
+    std::lock_guard< std::mutex > lock( _mutex );
+    add( ptr, { current_category, current_layer, bytes } );
+    _step_count++;
+    _step_bytes += bytes;
+}
+
+
+void MemoryTracker::freed( const void* ptr ) {
+    std::lock_guard< std::mutex > lock( _mutex );
+    remove( ptr );
+}
+
+
+void MemoryTracker::track( const void* key, size_t bytes ) {
+    std::lock_guard< std::mutex > lock( _mutex );
+    if ( _enabled ) {
+        add( key, { current_category, current_layer, bytes } );
+    }
+}
+
+
+void MemoryTracker::untrack( const void* key ) {
+    std::lock_guard< std::mutex > lock( _mutex );
+    remove( key );
+}
+
+
+void MemoryTracker::assign( const void* ptr, MemoryCategory category, int layer ) {
+
+    std::lock_guard< std::mutex > lock( _mutex );
+
+    auto it = _blocks.find( ptr );
+    if ( it == _blocks.end() ) {
+        return;
+    }
+
+    // Moved as if it was released and allocated again, the allocation
+    // counts stay
+    Block block = it->second;
+    remove( ptr );
+
+    block.category = category;
+    block.layer = layer;
+    add( ptr, block );
+
+    _total.allocations--;
+    _categories[size_t( block.category )].allocations--;
+    _layers[block.layer][size_t( block.category )].allocations--;
+}
+
+
+void MemoryTracker::end_step() {
+
+    std::lock_guard< std::mutex > lock( _mutex );
+    if ( !_enabled ) {
+        return;
+    }
+
+    _steps.min = _steps.steps == 0 ? _step_count : std::min( _steps.min, _step_count );
+    _steps.max = std::max( _steps.max, _step_count );
+    _steps.total += _step_count;
+    _steps.bytes += _step_bytes;
+    _steps.steps++;
+
+    _step_count = _step_bytes = 0;
+}
+
+
+MemoryUsage MemoryTracker::total() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _total;
+}
+
+
+MemoryUsage MemoryTracker::usage( MemoryCategory category ) const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _categories[size_t( category )];
+}
+
+
+MemoryUsage MemoryTracker::usage( MemoryCategory category, int layer ) const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    auto it = _layers.find( layer );
+    return it == _layers.end() ? MemoryUsage() : it->second[size_t( category )];
+}
+
+
+std::vector< int > MemoryTracker::layers() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+
+    std::vector< int > res;
+    for ( auto& entry : _layers ) {
+        res.push_back( entry.first );
+    }
+
+    return res;
+}
+
+
+StepAllocations MemoryTracker::step_allocations() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _steps;
+}
+
+
+static std::string kib( size_t bytes ) {
+    return std::to_string( ( bytes + 1023 ) / 1024 ) + " KiB";
+}
+
+
+void MemoryTracker::print() const {
+
+    MemoryUsage all = total();
+    std::cout << "Tracked memory: live " << kib( all.live ) << ", peak " << kib( all.peak )
+              << ", " << all.allocations << " allocations\n";
+
+    std::cout << std::left << std::setw( 16 ) << "   category" << std::setw( 14 ) << "live"
+              << std::setw( 14 ) << "peak" << "allocations\n";
+    for ( size_t c = 0; c < MEMORY_CATEGORIES; c++ ) {
+        MemoryUsage u = usage( MemoryCategory( c ) );
+        if ( u.peak == 0 ) {
+            continue;
+        }
+
+        std::cout << "   " << std::setw( 13 ) << category_name( MemoryCategory( c ) ) << std::setw( 14 )
+                  << kib( u.live ) << std::setw( 14 ) << kib( u.peak ) << u.allocations << "\n";
+    }
+
+    std::cout << "   by layer (live / peak):\n";
+    for ( int layer : layers() ) {
+        std::cout << "   " << std::setw( 13 ) << ( layer == NO_LAYER ? "none" : "#" + std::to_string( layer ) );
+        for ( size_t c = 0; c < MEMORY_CATEGORIES; c++ ) {
+            MemoryUsage u = usage( MemoryCategory( c ), layer );
+            if ( u.peak > 0 ) {
+                std::cout << " " << category_name( MemoryCategory( c ) ) << " "
+                          << kib( u.live ) << " / " << kib( u.peak ) << ";";
+            }
+        }
+        std::cout << "\n";
+    }
+
+    StepAllocations steps = step_allocations();
+    if ( steps.steps > 0 ) {
+        std::cout << "   per step: " << steps.total / steps.steps << " allocations (min " << steps.min
+                  << ", max " << steps.max << "), " << kib( steps.bytes / steps.steps ) << " allocated\n";
+    }
+
+    std::cout << std::right;
+}
+
+
+size_t MemoryEstimate::total() const {
+    size_t res = step_bytes;
+    for ( size_t b : bytes ) {
+        res += b;
+    }
+
+    return res;
+}
+
+
+void MemoryEstimate::print() const {
+
+    std::cout << "Estimated memory: " << kib( total() ) << "\n";
+    for ( size_t c = 0; c < MEMORY_CATEGORIES; c++ ) {
+        if ( bytes[c] > 0 ) {
+            std::cout << "   " << std::left << std::setw( 13 ) << category_name( MemoryCategory( c ) )
+                      << std::right << kib( bytes[c] ) << "\n";
+        }
+    }
+    std::cout << "   temporaries of a step " << kib( step_bytes ) << "\n";
+}
+
+
+MemoryEstimate estimate_training_memory( const std::vector< size_t >& widths, size_t batch,
+                                         size_t samples, bool bias ) {
+
+    MemoryEstimate res;
+    if ( widths.size() < 2 ) {
+        return res;
+    }
+
+    // Bytes of a rows x cols Matrix
+    auto matrix = []( size_t rows, size_t cols ){ return padded_rows( rows ) * cols * sizeof( float ); };
+    auto add = [&]( MemoryCategory category, size_t bytes ){ res.bytes[size_t( category )] += bytes; };
+
+    size_t step = 0;
+
+    for ( size_t l = 0; l + 1 < widths.size(); l++ ) {
+        size_t in = widths[l];
+        size_t out = widths[l + 1];
+
+        size_t params = matrix( out, in ) + ( bias ? matrix( out, 1 ) : 0 );
+        add( MemoryCategory::weights, params );
+        add( MemoryCategory::gradients, params );
+        add( MemoryCategory::optimizer, 2 * params );
+
+        // Kept from forward() to backward(): inputs, outputs and derivatives
+        // of the activation
+        add( MemoryCategory::activations, matrix( in, batch ) + 2 * matrix( out, batch ) );
+
+        // Derivatives w.r.t. the inputs, kept after backward()
+        if ( l > 0 ) {
+            add( MemoryCategory::gradients, matrix( in, batch ) );
+        }
+
+        // Temporaries of backward(): the transposed weights, the transposed
+        // inputs and the new weight gradients while the old are live
+        size_t temporaries = matrix( batch, in ) + matrix( out, in );
+        if ( l > 0 ) {
+            temporaries += matrix( in, out );
+        }
+        step = std::max( step, temporaries );
+    }
+
+    // Batch of samples being gathered, logits and their derivatives
+    size_t classes = widths.back();
+    step += matrix( widths[0], batch ) + 2 * matrix( classes, batch );
+
+    res.step_bytes = step;
+
+    // Samples with their labels
+    add( MemoryCategory::dataset, samples * ( widths[0] + 1 ) * sizeof( float ) );
+
+    return res;
+}
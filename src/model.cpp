@@ -1,4 +1,5 @@
 #include "model.hpp"
+#include "memory.hpp"
 
 /*
  *  Helper maps for easier initialization via strings.
@@ -45,12 +46,20 @@ LinearLayer::LinearLayer( size_t input_dim, size_t output_dim,
              std::string activation, 
              std::string init_mode,
              bool bias ) {
+    MemoryScope scope( MemoryCategory::weights );
     has_bias = bias;
     _act = activation_map[ activation ];
     initialize_weights( output_dim, input_dim, init_map[init_mode] );
 }
 
 
+LinearLayer::LinearLayer( Matrix&& weights, Matrix&& bias, ActivationFunction* act ) : _weights( std::move( weights ) ),
+                                                                                       _bias( std::move( bias ) ),
+                                                                                       _act( act ) {
+    has_bias = _bias.rows != 0;
+}
+
+
 /*
  * Initialize layer weights based on initialization mode.
  * Bias weights are initialized to constant 0.01
@@ -106,6 +115,16 @@ std::vector< Matrix* > LinearLayer::get_grads() {
 }
 
 
+std::vector< Matrix* > LinearLayer::get_masks() {
+    std::vector< Matrix* > masks = { &_weight_mask };
+    if ( has_bias ) {
+        masks.push_back( nullptr );
+    }
+
+    return masks;
+}
+
+
 /*
  * Allocate weight matrices
  */
@@ -127,20 +146,90 @@ void LinearLayer::set_evaluation( bool mode ) {
  * Forward pass of the layer
  */
 Matrix LinearLayer::forward( Matrix&& inputs ){
-    
-    auto forward_act = [&](float x){ return _act->forward(x); };
-    auto backward_act = [&](float x){ return _act->backward(x); };
 
+    if ( use_sparse( inputs ) ) {
+        return forward( SparseMatrix::from_dense( inputs ) );
+    }
 
     if ( debug_output ) {
         std::cout << "INPUT to forward call:\n";
         inputs.print();
     }
 
-    _outputs = _weights.mult( inputs ).cwise_add( _bias );
+    Matrix potentials = _weights.mult( inputs );
 
-    if ( !evaluation ){
+    // Keep inputs for the weight gradients, no copy needed
+    if ( !evaluation ) {
         _inputs = std::move(inputs);
+        _inputs_sparse = false;
+    }
+
+    return forward_outputs( std::move( potentials ) );
+}
+
+
+Matrix LinearLayer::forward( ConstMatrixView inputs ){
+
+    if ( use_sparse( inputs ) ) {
+        return forward( SparseMatrix::from_dense( inputs ) );
+    }
+
+    if ( debug_output ) {
+        std::cout << "INPUT to forward call:\n";
+        inputs.print();
+    }
+
+    Matrix potentials = _weights.mult( inputs );
+
+    if ( !evaluation ) {
+        _inputs = Matrix( inputs );
+        _inputs_sparse = false;
+    }
+
+    return forward_outputs( std::move( potentials ) );
+}
+
+
+Matrix LinearLayer::forward( SparseMatrix&& inputs ){
+
+    if ( debug_output ) {
+        std::cout << "INPUT to forward call:\n";
+        inputs.to_dense().print();
+    }
+
+    Matrix potentials( _weights.rows, inputs.cols );
+    sparse_gemm( _weights, inputs, potentials );
+
+    if ( !evaluation ) {
+        _sparse_inputs = std::move( inputs );
+        _inputs = Matrix();
+        _inputs_sparse = true;
+    }
+
+    return forward_outputs( std::move( potentials ) );
+}
+
+
+/*
+ * Decide whether a dense input is sparse enough to be worth converting.
+ */
+bool LinearLayer::use_sparse( ConstMatrixView inputs ) const {
+    return sparse_threshold > 0.f && density( inputs ) <= sparse_threshold;
+}
+
+
+Matrix LinearLayer::forward_outputs( Matrix&& potentials ){
+    
+    auto forward_act = [&](float x){ return _act->forward(x); };
+    auto backward_act = [&](float x){ return _act->backward(x); };
+
+    if ( has_bias ) {
+        potentials.cwise_add( _bias );
+    }
+
+    _outputs = std::move( potentials );
+
+    if ( !evaluation ){
         _potentials_derivatives = _outputs;
         _potentials_derivatives.apply( backward_act );
 
@@ -177,7 +266,12 @@ Matrix LinearLayer::backward( Matrix&& derivatives ){
     derivatives.cwise_product( _potentials_derivatives );
 
     // Derivatives w.r.t outputs for the previous layer
-    _prev_derivatives = _weights.transpose().mult( derivatives );
+    if ( propagate_derivatives ) {
+        _prev_derivatives = _weights.transpose().mult( derivatives );
+    }
+    else {
+        _prev_derivatives = Matrix();
+    }
 
     if ( debug_output ) {
         std::cout << "previous derivatives backward call:\n";
@@ -187,10 +281,34 @@ Matrix LinearLayer::backward( Matrix&& derivatives ){
     // Now calculate derivatives w.r.t weights & biases
     // The formula is prev = next derivatives * potentials of
     // outputs * tranposed input matrix
-    _weight_gradients = derivatives.mult( _inputs.transpose() );
+    bool accumulate = accumulate_gradients && _weight_gradients.rows == _weights.rows
+                                           && _weight_gradients.cols == _weights.cols;
+
+    if ( _inputs_sparse ) {
+        Matrix gradients( _weights.rows, _weights.cols );
+        sparse_gemm_transposed( derivatives, _sparse_inputs, gradients );
+
+        if ( accumulate ) {
+            _weight_gradients.cwise_add( gradients );
+        }
+        else {
+            _weight_gradients = std::move( gradients );
+        }
+    }
+    else if ( accumulate ) {
+        gemm( derivatives, _inputs.transpose(), _weight_gradients, true );
+    }
+    else {
+        _weight_gradients = derivatives.mult( _inputs.transpose() );
+    }
 
     // Biases are just sums of the losses, no multiplication by inputs required
-    _bias_gradients = std::move( derivatives.row_reduce() );
+    if ( accumulate && has_bias ) {
+        _bias_gradients.cwise_add( derivatives.row_reduce() );
+    }
+    else {
+        _bias_gradients = std::move( derivatives.row_reduce() );
+    }
 
     if ( debug_output ) {
         std::cout << "weight and bias gradients backward call:\n";
@@ -203,30 +321,259 @@ Matrix LinearLayer::backward( Matrix&& derivatives ){
 
 
 
+/*
+ * Activation recomputation.
+ *
+ * Everything backward() needs is _inputs (or _sparse_inputs) and
+ * _potentials_derivatives, _outputs is kept along as the result of forward().
+ */
+size_t LinearLayer::activation_bytes() const {
+
+    auto bytes = []( const Matrix& m ){ return m.ld * m.cols * sizeof( float ); };
+
+    size_t res = bytes( _inputs ) + bytes( _outputs ) + bytes( _potentials_derivatives );
+    if ( _inputs_sparse ) {
+        res += _sparse_inputs.offsets.size() * sizeof( size_t ) +
+               _sparse_inputs.indices.size() * sizeof( uint32_t ) +
+               _sparse_inputs.values.size() * sizeof( float );
+    }
+
+    return res;
+}
+
+
+bool LinearLayer::has_activations() const {
+    return _potentials_derivatives.rows != 0;
+}
+
+
+void LinearLayer::release_activations( bool keep_inputs ) {
+    _outputs = Matrix();
+    _potentials_derivatives = Matrix();
+
+    if ( !keep_inputs ) {
+        _inputs = Matrix();
+        _sparse_inputs = SparseMatrix();
+    }
+}
+
+
+Matrix LinearLayer::recompute_forward() {
+
+    if ( _inputs_sparse ) {
+        SparseMatrix inputs = std::move( _sparse_inputs );
+        return forward( std::move( inputs ) );
+    }
+
+    Matrix inputs = std::move( _inputs );
+    return forward( std::move( inputs ) );
+}
+
+
+void RecomputeStats::print() const {
+
+    auto kib = []( size_t bytes ){ return bytes / 1024; };
+    float saved = full_bytes == 0 ? 0.f : 100.f * ( full_bytes - peak_bytes ) / full_bytes;
+
+    // a training step is one forward and a backward of about twice the cost
+    float extra = forward_flops == 0 ? 0.f : 100.f * recompute_flops / ( 3.f * forward_flops );
+
+    std::cout << "Activation memory: peak " << kib( peak_bytes ) << " KiB, "
+              << kib( full_bytes ) << " KiB without recomputation (" << saved << "% saved)\n";
+    std::cout << "Recomputed forward flops: " << recompute_flops << " of " << forward_flops
+              << " (" << extra << "% extra compute per step)\n";
+}
+
+
+
 /*
  *  NEURAL NET
  */
 NeuralNet::NeuralNet() : _layers() { }
-NeuralNet::NeuralNet( std::vector< std::shared_ptr<LinearLayer > > &&layers) : _layers(std::move(layers)) {}
+NeuralNet::NeuralNet( std::vector< std::shared_ptr<LinearLayer > > &&layers) : _layers(std::move(layers)) {
+    // Nothing consumes derivatives w.r.t. the inputs of the network
+    if ( !_layers.empty() ) {
+        _layers[0]->propagate_derivatives = false;
+    }
+
+    // Layers learn their position only now
+    for ( size_t i = 0; i < _layers.size(); i++ ) {
+        for ( Matrix* p : _layers[i]->get_params() ) {
+            memory_tracker.assign( p->data().data(), MemoryCategory::weights, i );
+        }
+    }
+}
 
 
 // Forward pass for the whole network
 Matrix NeuralNet::forward( Matrix &&input ){
 
     for ( size_t i = 0; i < _layers.size(); i++ ) {
+       MemoryScope scope( MemoryCategory::activations, i );
        input = _layers[i]->forward( std::move(input) );
+       after_forward( i );
     }
 
     return input;
 }
 
+// Forward pass reading the input through a view, e.g. a slice of a dataset
+Matrix NeuralNet::forward( ConstMatrixView input ){
+
+    if ( _layers.empty() ) {
+        return Matrix( input );
+    }
+
+    Matrix result;
+    {
+        MemoryScope scope( MemoryCategory::activations, 0 );
+        result = _layers[0]->forward( input );
+        after_forward( 0 );
+    }
+
+    for ( size_t i = 1; i < _layers.size(); i++ ) {
+       MemoryScope scope( MemoryCategory::activations, i );
+       result = _layers[i]->forward( std::move(result) );
+       after_forward( i );
+    }
+
+    return result;
+}
+
+// Forward pass with a sparse input batch
+Matrix NeuralNet::forward( SparseMatrix&& input ){
+
+    if ( _layers.empty() ) {
+        return input.to_dense();
+    }
+
+    Matrix result;
+    {
+        MemoryScope scope( MemoryCategory::activations, 0 );
+        result = _layers[0]->forward( std::move( input ) );
+        after_forward( 0 );
+    }
+
+    for ( size_t i = 1; i < _layers.size(); i++ ) {
+       MemoryScope scope( MemoryCategory::activations, i );
+       result = _layers[i]->forward( std::move(result) );
+       after_forward( i );
+    }
+
+    return result;
+}
+
 // Run backpropagation on the network
 void NeuralNet::backward( Matrix&& derivatives ){
+    backward( std::move( derivatives ), nullptr );
+}
+
+
+void NeuralNet::backward( Matrix&& derivatives, const std::function< void( size_t ) >& layer_done ){
     for ( size_t i = _layers.size(); i > 0; --i ) {
-       derivatives = _layers[i-1]->backward( std::move(derivatives) );
+       auto& layer = _layers[i-1];
+       if ( layer->recompute && !layer->has_activations() ) {
+           recompute_segment( i-1 );
+       }
+
+       MemoryScope scope( MemoryCategory::gradients, i-1 );
+       derivatives = layer->backward( std::move(derivatives) );
+
+       if ( layer->recompute ) {
+           layer->release_activations( false );
+       }
+
+       if ( layer_done ) {
+           layer_done( i-1 );
+       }
     }
 }
 
+
+/*
+ * Activation recomputation. Layers with `recompute` set form segments of
+ * consecutive layers, the first layer of a segment keeps its inputs and the
+ * segment is run forward again when backward() reaches its last layer.
+ */
+void NeuralNet::after_forward( size_t i ) {
+
+    auto& layer = _layers[i];
+    if ( layer->evaluation ) {
+        return;
+    }
+
+    if ( i == 0 ) {
+        _kept_bytes = _full_bytes = 0;
+    }
+
+    _full_bytes += layer->activation_bytes();
+    _recompute_stats.forward_flops += 2 * layer->_weights.rows * layer->_weights.cols * layer->_outputs.cols;
+
+    if ( layer->recompute ) {
+        layer->release_activations( i == 0 || !_layers[i-1]->recompute );
+    }
+
+    _kept_bytes += layer->activation_bytes();
+
+    _recompute_stats.full_bytes = std::max( _recompute_stats.full_bytes, _full_bytes );
+    _recompute_stats.peak_bytes = std::max( _recompute_stats.peak_bytes, _kept_bytes );
+}
+
+
+void NeuralNet::recompute_segment( size_t end ) {
+
+    size_t start = end;
+    while ( start > 0 && _layers[start-1]->recompute ) {
+        start--;
+    }
+
+    Matrix result;
+    {
+        MemoryScope scope( MemoryCategory::activations, start );
+        result = _layers[start]->recompute_forward();
+    }
+
+    for ( size_t i = start + 1; i <= end; i++ ) {
+        MemoryScope scope( MemoryCategory::activations, i );
+        result = _layers[i]->forward( std::move(result) );
+    }
+
+    for ( size_t i = start; i <= end; i++ ) {
+        auto& w = _layers[i]->_weights;
+        _recompute_stats.recompute_flops += 2 * w.rows * w.cols * _layers[i]->_outputs.cols;
+    }
+
+    _recompute_stats.peak_bytes = std::max( _recompute_stats.peak_bytes, live_activation_bytes() );
+}
+
+
+size_t NeuralNet::live_activation_bytes() const {
+    size_t res = 0;
+    for ( auto& layer : _layers ) {
+        res += layer->activation_bytes();
+    }
+
+    return res;
+}
+
+
+void NeuralNet::set_recompute( size_t segment ) {
+    for ( size_t i = 0; i < _layers.size(); i++ ) {
+        _layers[i]->recompute = segment > 1 && i % segment != 0;
+    }
+}
+
+
+bool NeuralNet::recomputing() const {
+    return std::any_of( _layers.begin(), _layers.end(),
+                        []( auto& layer ){ return layer->recompute; } );
+}
+
+
+const RecomputeStats& NeuralNet::recompute_stats() const {
+    return _recompute_stats;
+}
+
 /*
  * Helper functions for optimizer - get weights and calculated gradients from
  * backward().
@@ -254,6 +601,23 @@ std::vector< Matrix* > NeuralNet::grads() {
 }
 
 
+std::vector< Matrix* > NeuralNet::masks() {
+    std::vector< Matrix* > res;
+    for ( size_t i = 0; i < _layers.size(); i++ ){
+        for ( auto ptr : _layers[i]->get_masks() ){
+            res.push_back(ptr);
+        }
+    }
+
+    return res;
+}
+
+
+const std::vector< std::shared_ptr< LinearLayer > >& NeuralNet::layers() const {
+    return _layers;
+}
+
+
 /* 
  * Switch between inference and training modes.
  */
@@ -268,6 +632,12 @@ void NeuralNet::training(){
     }
 }
 
+void NeuralNet::accumulate_gradients( bool accumulate ) {
+    for ( auto& layer : _layers ) {
+        layer->accumulate_gradients = accumulate;
+    }
+}
+
 /*
  * Predict labels for an input batch.
  */
@@ -276,3 +646,9 @@ std::vector< size_t > NeuralNet::predict( Matrix&& input ) {
     auto result = forward( std::move(input) );
     return predictions( result );
 }
+
+std::vector< size_t > NeuralNet::predict( ConstMatrixView input ) {
+    evaluation();
+    auto result = forward( input );
+    return predictions( result );
+}
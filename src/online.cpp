@@ -0,0 +1,315 @@
+#include "online.hpp"
+#include "inference.hpp"
+#include "loader.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+
+/*
+ * Line source
+ */
+bool LineSource::open( const std::string& path, const OnlineConfig& config ) {
+
+    _follow = config.follow;
+    _idle_ms = config.idle_ms;
+    _poll_ms = std::max< size_t >( 1, config.poll_ms );
+
+    if ( path == "-" ) {
+        _fd = 0;
+        return true;
+    }
+
+    _fd = ::open( path.c_str(), O_RDONLY );
+    _owned = _fd >= 0;
+    if ( _fd < 0 ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+LineSource::~LineSource() {
+    if ( _owned ) {
+        ::close( _fd );
+    }
+}
+
+
+bool LineSource::next( std::string& line, const std::atomic< bool >& stop ) {
+
+    size_t idle = 0;
+    char chunk[1 << 16];
+
+    while ( _fd >= 0 ) {
+
+        size_t newline = _buffer.find( '\n' );
+        if ( newline != std::string::npos ) {
+            line.assign( _buffer, 0, newline );
+            _buffer.erase( 0, newline + 1 );
+            if ( !line.empty() && line.back() == '\r' ) {
+                line.pop_back();
+            }
+            return true;
+        }
+
+        if ( stop || ( _idle_ms > 0 && idle >= _idle_ms ) ) {
+            return false;
+        }
+
+        // Nothing to read yet, e.g. a slow writer of a pipe
+        pollfd pfd{ _fd, POLLIN, 0 };
+        int ready = ::poll( &pfd, 1, _poll_ms );
+        if ( ready < 0 && errno != EINTR ) {
+            return false;
+        }
+
+        if ( ready <= 0 ) {
+            idle += _poll_ms;
+            continue;
+        }
+
+        ssize_t n = ::read( _fd, chunk, sizeof( chunk ) );
+        if ( n > 0 ) {
+            _buffer.append( chunk, n );
+            idle = 0;
+            continue;
+        }
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+
+        // End of the file, or the writer closed the pipe. A followed file
+        // may still grow, a partial last line waits for its end.
+        if ( _follow ) {
+            ::usleep( _poll_ms * 1000 );
+            idle += _poll_ms;
+            continue;
+        }
+
+        if ( _buffer.empty() ) {
+            return false;
+        }
+
+        line = std::move( _buffer );
+        _buffer.clear();
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Learner
+ */
+OnlineLearner::OnlineLearner( NeuralNet* net, AdamOptimizer* opt, const OnlineConfig& config )
+                            : _net( net ), _opt( opt ), _config( config ) {
+
+    _config.batch = std::max< size_t >( 1, _config.batch );
+    _config.publish_every = std::max< size_t >( 1, _config.publish_every );
+    _dim = _net->layers().empty() ? 0 : _net->layers()[0]->_weights.cols;
+}
+
+
+void OnlineLearner::set_normalization( const Normalization& norm ) {
+    _norm = norm;
+}
+
+
+const Normalization& OnlineLearner::normalization() const {
+    return _norm;
+}
+
+
+void OnlineLearner::set_publisher( std::function< void( std::vector< LayerParams >&& ) > publisher ) {
+    _publisher = std::move( publisher );
+}
+
+
+void OnlineLearner::add( std::vector< float >&& sample, int label ) {
+
+    _pending.push_back( std::move( sample ) );
+    _pending_labels.push_back( label );
+
+    // Steps wait until the normalization is known
+    if ( _norm.empty() ) {
+        if ( _pending.size() < std::max( _config.warmup, _config.batch ) ) {
+            return;
+        }
+        _norm = Normalization::global( compute_statistics( _pending ) );
+    }
+
+    while ( _pending.size() >= _config.batch ) {
+        step();
+    }
+}
+
+
+void OnlineLearner::run( LineSource& source, const std::atomic< bool >& stop ) {
+
+    size_t classes = _net->layers().empty() ? 0 : _net->layers().back()->_weights.rows;
+    std::string line;
+
+    while ( source.next( line, stop ) ) {
+        if ( line.empty() ) {
+            continue;
+        }
+
+        std::vector< float > values = Loader::parse_vector( line );
+        if ( values.size() != _dim + 1 || values[0] < 0 || values[0] >= float( classes ) ) {
+            _stats.rejected++;
+            continue;
+        }
+
+        int label = int( values[0] );
+        values.erase( values.begin() );
+        add( std::move( values ), label );
+    }
+
+    flush();
+}
+
+
+void OnlineLearner::flush() {
+
+    if ( _norm.empty() && !_pending.empty() ) {
+        _norm = Normalization::global( compute_statistics( _pending ) );
+    }
+
+    while ( !_pending.empty() ) {
+        step();
+    }
+
+    publish();
+}
+
+
+void OnlineLearner::step() {
+
+    auto start = std::chrono::steady_clock::now();
+
+    size_t count = std::min( _config.batch, _pending.size() );
+    size_t replayed = _replay.empty() ? 0 : _config.replay;
+
+    // New samples first, then the replayed ones
+    Matrix input( _dim, count + replayed );
+    std::vector< int > labels;
+
+    for ( size_t j = 0; j < count; j++ ) {
+        std::copy( _pending[j].begin(), _pending[j].end(), input.column( j ) );
+        labels.push_back( _pending_labels[j] );
+    }
+
+    std::uniform_int_distribution< size_t > pick( 0, _replay.size() - 1 );
+    for ( size_t j = 0; j < replayed; j++ ) {
+        size_t i = pick( _gen );
+        std::copy( _replay[i].begin(), _replay[i].end(), input.column( count + j ) );
+        labels.push_back( _replay_labels[i] );
+    }
+
+    _norm.apply( input );
+
+    Matrix logits = _net->forward( std::move( input ) );
+
+    auto preds = predictions( logits );
+    for ( size_t j = 0; j < count; j++ ) {
+        _stats.correct += preds[j] == size_t( labels[j] );
+    }
+
+    Matrix derivatives;
+    cross_entropy_loss( logits, labels, derivatives );
+    _net->backward( std::move( derivatives ) );
+    _opt->step();
+
+    for ( size_t j = 0; j < count; j++ ) {
+        remember( std::move( _pending[j] ), _pending_labels[j] );
+    }
+
+    _pending.erase( _pending.begin(), _pending.begin() + count );
+    _pending_labels.erase( _pending_labels.begin(), _pending_labels.begin() + count );
+
+    _stats.samples += count;
+    _stats.steps++;
+    _stats.seconds += std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    if ( _stats.steps % _config.publish_every == 0 ) {
+        publish();
+    }
+}
+
+
+// Reservoir sampling, every sample seen so far is in the buffer with the
+// same probability
+void OnlineLearner::remember( std::vector< float >&& sample, int label ) {
+
+    size_t seen = _seen++;
+
+    if ( _replay.size() < _config.buffer ) {
+        _replay.push_back( std::move( sample ) );
+        _replay_labels.push_back( label );
+        return;
+    }
+
+    size_t i = std::uniform_int_distribution< size_t >( 0, seen )( _gen );
+    if ( i < _replay.size() ) {
+        _replay[i] = std::move( sample );
+        _replay_labels[i] = label;
+    }
+}
+
+
+void OnlineLearner::publish() {
+
+    if ( !_publisher || _stats.steps == 0 ) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    _publisher( compile_layers( layer_params( *_net ), _norm ) );
+    _stats.seconds += std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    _stats.published++;
+
+    size_t samples = _stats.samples - _reported.samples;
+    if ( samples > 0 ) {
+        std::cout << "   Published after " << _stats.samples << " samples (" << _stats.steps << " steps), "
+                  << "accuracy on the last " << samples << " new samples "
+                  << float( _stats.correct - _reported.correct ) / samples << ", "
+                  << 1e6 * ( _stats.seconds - _reported.seconds ) / samples << " us per sample\n";
+    }
+
+    _reported = _stats;
+}
+
+
+const OnlineStats& OnlineLearner::stats() const {
+    return _stats;
+}
+
+
+bool publish_checkpoint( const std::string& path, const std::vector< LayerParams >& layers ) {
+
+    std::string tmp = path + ".tmp";
+    if ( !write_checkpoint( tmp, layers ) ) {
+        return false;
+    }
+
+    if ( std::rename( tmp.c_str(), path.c_str() ) != 0 ) {
+        std::cout << "Cannot replace " << path << "\n";
+        return false;
+    }
+
+    return true;
+}
@@ -1,4 +1,9 @@
 #include "optimizer.hpp" 
+#include "checkpoint.hpp"
+#include "memory.hpp"
+
+
+static const uint32_t ADAM_MAGIC = 0x4d414441; // "ADAM"
 
 
 /* Manually calculate softmax&CE loss given logits and correct labels.
@@ -38,7 +43,7 @@ float cross_entropy_loss( const Matrix &logits,
         // calculate softmax, derivatives and loss for each output in this
         // sample
         for ( size_t row = 0; row < logits.rows; row++ ) {
-            int match = ( labels[col] == row );
+            int match = ( size_t( labels[col] ) == row );
             float smax = std::exp( logits.at( row, col ) - max ) / denom;
             out_derivatives.at( row, col ) = smax - match;
             loss -= match * ( logits.at(row, col) - max  - std::log(denom));
@@ -52,10 +57,60 @@ float cross_entropy_loss( const Matrix &logits,
 }
 
 
+float distillation_loss( const Matrix &logits,
+                         const std::vector< int > &labels,
+                         const Matrix &soft_targets,
+                         float temperature, float alpha,
+                         Matrix &derivatives ){
+
+    float hard = cross_entropy_loss( logits, labels, derivatives );
+    derivatives.multiply_scalar( 1 - alpha );
+
+    float batch_size = logits.cols;
+    float soft = 0;
+
+    // Scale of the soft part of the derivatives, the mean over the batch
+    float scale = alpha * temperature / batch_size;
+
+    for ( size_t col = 0; col < logits.cols; col++ ) {
+
+        float max = logits.at( 0, col );
+        for ( size_t row = 0; row < logits.rows; row++ ) {
+            max = std::max( max, logits.at( row, col ) );
+        }
+
+        float denom = 0;
+        for ( size_t row = 0; row < logits.rows; row++ ) {
+            denom += std::exp( ( logits.at( row, col ) - max ) / temperature );
+        }
+
+        for ( size_t row = 0; row < logits.rows; row++ ) {
+            float shifted = ( logits.at( row, col ) - max ) / temperature;
+            float target = soft_targets.at( row, col );
+
+            derivatives.at( row, col ) += scale * ( std::exp( shifted ) / denom - target );
+            soft -= target * ( shifted - std::log( denom ) );
+        }
+    }
+
+    return ( 1 - alpha ) * hard + alpha * temperature * temperature * soft;
+}
+
+
 AdamOptimizer::AdamOptimizer( NeuralNet *m, float lr, 
-                              float beta1, float beta2 ) : _lr( lr ),
-                                                          _beta1( beta1 ), _beta2( beta2 ),
-                                                          _model_params( m->params() ), _model_gradients( m->grads() ) {
+                              float beta1, float beta2 ) : AdamOptimizer( m->params(), m->grads(), lr, beta1, beta2,
+                                                                          m->masks() ) {}
+
+
+AdamOptimizer::AdamOptimizer( std::vector< Matrix* > params, std::vector< Matrix* > grads,
+                              float lr, float beta1, float beta2,
+                              std::vector< Matrix* > masks ) : _lr( lr ),
+                                                               _beta1( beta1 ), _beta2( beta2 ),
+                                                               _model_params( std::move( params ) ),
+                                                               _model_gradients( std::move( grads ) ),
+                                                               _model_masks( std::move( masks ) ) {
+        MemoryScope scope( MemoryCategory::optimizer );
+
         // Initialize first and second moment matrices
         for ( size_t i = 0; i < _model_params.size(); i++ ) {
 
@@ -71,33 +126,180 @@ AdamOptimizer::AdamOptimizer( NeuralNet *m, float lr,
 
 void AdamOptimizer::step() {
 
-        _beta1t *= _beta1;
-        _beta2t *= _beta2;
+    begin_step();
+
+    // Loop over all parameters of the network
+    for ( size_t i = 0; i < _model_params.size(); i++ ){
+        update( i, 0, _model_params[i]->cols );
+    }
+}
+
+
+void AdamOptimizer::begin_step() {
+    timestep++;
+    _beta1t *= _beta1;
+    _beta2t *= _beta2;
+
+    _lr_t = _lr * std::sqrt( 1 - _beta2t ) / ( 1 - _beta1t );
+}
 
-        float lr_t = _lr * std::sqrt( 1 - _beta2t ) / ( 1 - _beta1t );
 
-        // Loop over all parameters of the network
-        for ( size_t i = 0; i < _model_params.size(); i++ ){
+/*
+ * Adam update of columns [ col_begin, col_end ) of a parameter, one pass
+ * over the parameter, its gradient, moments and mask
+ */
+void AdamOptimizer::update( size_t param, size_t col_begin, size_t col_end ) {
 
-            // Adjust first and second moment estimates
-            Matrix gradient = *_model_gradients[i];
-            Matrix gradient_square = *_model_gradients[i];
+    Matrix& params = *_model_params[param];
+    const Matrix& gradients = *_model_gradients[param];
+    Matrix& first = *_first_moments[param];
+    Matrix& second = *_second_moments[param];
 
-           gradient_square.cwise_product( gradient ).multiply_scalar( 1 - _beta2 );
-            gradient.multiply_scalar( 1 - _beta1 );
+    const Matrix* mask = param < _model_masks.size() ? _model_masks[param] : nullptr;
+    bool masked = mask && mask->rows != 0;
 
-            _first_moments[i]->multiply_scalar( _beta1 ).cwise_add( gradient );
-            _second_moments[i]->multiply_scalar( _beta2 ).cwise_add( gradient_square );
+    const float beta1 = _beta1, beta2 = _beta2, lr_t = _lr_t;
 
+    for ( size_t col = col_begin; col < col_end; col++ ) {
 
-            Matrix gradient_dir = *_second_moments[i];
+        float* p = params.column( col );
+        const float* g = gradients.column( col );
+        float* m = first.column( col );
+        float* v = second.column( col );
+        const float* keep = masked ? mask->column( col ) : nullptr;
 
+        for ( size_t row = 0; row < params.rows; row++ ) {
 
-            // calculate -alpha * m_t^ / ( sqrt(v_t^ + eps) )
-            gradient_dir.apply( [&]( float x ){ return ( -1 * lr_t ) / ( std::sqrt( x ) + 1e-6 ); } );
-            gradient_dir.cwise_product( *_first_moments[i] );
+            // Moments collected before a weight got pruned must not move it
+            float k = masked ? keep[row] : 1.f;
+            float gradient = g[row] * k;
 
-            _model_params[i]->cwise_add( gradient_dir );
+            m[row] = ( m[row] * beta1 + gradient * ( 1 - beta1 ) ) * k;
+            v[row] = ( v[row] * beta2 + gradient * gradient * ( 1 - beta2 ) ) * k;
 
+            // -alpha * m_t^ / ( sqrt(v_t^) + eps )
+            float dir = ( -1 * lr_t ) / ( std::sqrt( v[row] ) + 1e-6 );
+            p[row] += dir * m[row];
         }
+    }
+}
+
+
+size_t AdamOptimizer::size() const {
+    return _model_params.size();
+}
+
+
+const Matrix& AdamOptimizer::param( size_t i ) const {
+    return *_model_params[i];
+}
+
+
+// FNV-1a of the values of `params`, identifies the parameters the moments
+// were collected for
+static uint64_t params_hash( const std::vector< Matrix* >& params ) {
+
+    uint64_t hash = 0xcbf29ce484222325;
+    for ( const Matrix* m : params ) {
+        for ( size_t col = 0; col < m->cols; col++ ) {
+            auto bytes = reinterpret_cast< const unsigned char* >( m->column( col ) );
+            for ( size_t i = 0; i < m->rows * sizeof( float ); i++ ) {
+                hash = ( hash ^ bytes[i] ) * 0x100000001b3;
+            }
+        }
+    }
+
+    return hash;
+}
+
+
+/*
+ * Layout (little endian): magic, timestep, beta1^t, beta2^t, hash of the
+ * parameters, parameter count, rows and cols of every parameter, then the
+ * first and second moments of every parameter (column-major, packed)
+ */
+bool AdamOptimizer::save( const std::string& path ) const {
+    std::ofstream f( path, std::ios::out | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    write_value< uint32_t >( f, ADAM_MAGIC );
+    write_value< uint64_t >( f, timestep );
+    write_value< float >( f, _beta1t );
+    write_value< float >( f, _beta2t );
+    write_value< uint64_t >( f, params_hash( _model_params ) );
+    write_value< uint64_t >( f, _model_params.size() );
+
+    for ( const Matrix* p : _model_params ) {
+        write_value< uint64_t >( f, p->rows );
+        write_value< uint64_t >( f, p->cols );
+    }
+
+    for ( size_t i = 0; i < _model_params.size(); i++ ) {
+        write_matrix( f, *_first_moments[i] );
+        write_matrix( f, *_second_moments[i] );
+    }
+
+    return f.good();
+}
+
+
+bool AdamOptimizer::load( const std::string& path ) {
+    std::ifstream f( path, std::ios::in | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    if ( read_value< uint32_t >( f ) != ADAM_MAGIC ) {
+        std::cout << "File " << path << " is not an optimizer state\n";
+        return false;
+    }
+
+    size_t steps = read_value< uint64_t >( f );
+    float beta1t = read_value< float >( f );
+    float beta2t = read_value< float >( f );
+    uint64_t hash = read_value< uint64_t >( f );
+    size_t count = read_value< uint64_t >( f );
+
+    if ( !f.good() || count != _model_params.size() ) {
+        std::cout << "Optimizer state " << path << " does not match the model\n";
+        return false;
+    }
+
+    size_t floats = 0;
+    for ( const Matrix* p : _model_params ) {
+        size_t rows = read_value< uint64_t >( f );
+        size_t cols = read_value< uint64_t >( f );
+        if ( !f.good() || rows != p->rows || cols != p->cols ) {
+            std::cout << "Optimizer state " << path << " does not match the model\n";
+            return false;
+        }
+        floats += 2 * rows * cols;
+    }
+
+    if ( remaining_bytes( f ) != floats * sizeof( float ) ) {
+        std::cout << "Optimizer state " << path << " is truncated\n";
+        return false;
+    }
+
+    if ( hash != params_hash( _model_params ) ) {
+        std::cout << "Optimizer state " << path << " belongs to other parameters\n";
+        return false;
+    }
+
+    for ( size_t i = 0; i < _model_params.size(); i++ ) {
+        read_matrix( f, *_first_moments[i] );
+        read_matrix( f, *_second_moments[i] );
+    }
+
+    timestep = steps;
+    _beta1t = beta1t;
+    _beta2t = beta2t;
+
+    return true;
 }
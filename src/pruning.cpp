@@ -0,0 +1,349 @@
+#include "pruning.hpp"
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+
+
+static const uint32_t SPARSE_CHECKPOINT_MAGIC = 0x50534e4e; // "NNSP"
+
+
+float PruningSchedule::sparsity_at( size_t epoch ) const {
+
+    if ( epoch < start_epoch ) {
+        return 0.f;
+    }
+
+    if ( epoch >= end_epoch ) {
+        return target_sparsity;
+    }
+
+    float progress = float( epoch - start_epoch + 1 ) / ( end_epoch - start_epoch + 1 );
+    return target_sparsity * ( 1 - std::pow( 1 - progress, 3.f ) );
+}
+
+
+void prune_layer( LinearLayer& layer, float sparsity, size_t block_rows ) {
+
+    Matrix& w = layer._weights;
+    size_t blocks_per_col = ( w.rows + block_rows - 1 ) / block_rows;
+    size_t blocks = blocks_per_col * w.cols;
+
+    // L1 norm of every block, already pruned blocks score 0 and stay pruned
+    std::vector< float > scores( blocks, 0.f );
+    for ( size_t col = 0; col < w.cols; col++ ) {
+        for ( size_t row = 0; row < w.rows; row++ ) {
+            scores[col * blocks_per_col + row / block_rows] += std::abs( w.at( row, col ) );
+        }
+    }
+
+    size_t pruned = std::min( blocks, size_t( sparsity * blocks ) );
+
+    std::vector< size_t > order( blocks );
+    std::iota( order.begin(), order.end(), 0 );
+    std::nth_element( order.begin(), order.begin() + pruned, order.end(), [&]( size_t a, size_t b ){
+        return scores[a] < scores[b];
+    } );
+
+    layer._weight_mask = Matrix( w.rows, w.cols );
+    layer._weight_mask.add_scalar( 1.f );
+
+    for ( size_t i = 0; i < pruned; i++ ) {
+        size_t col = order[i] / blocks_per_col;
+        size_t first = ( order[i] % blocks_per_col ) * block_rows;
+
+        for ( size_t row = first; row < std::min( w.rows, first + block_rows ); row++ ) {
+            layer._weight_mask.at( row, col ) = 0.f;
+        }
+    }
+
+    w.cwise_product( layer._weight_mask );
+}
+
+
+float weight_sparsity( const LinearLayer& layer ) {
+
+    const Matrix& w = layer._weights;
+    size_t zeros = 0;
+
+    for ( size_t col = 0; col < w.cols; col++ ) {
+        for ( size_t row = 0; row < w.rows; row++ ) {
+            zeros += ( w.at( row, col ) == 0.f );
+        }
+    }
+
+    return float( zeros ) / ( w.rows * w.cols );
+}
+
+
+/*
+ *  SPARSE NET
+ */
+SparseNet::SparseNet( const NeuralNet& net ) {
+    for ( auto& layer : net.layers() ) {
+        _layers.push_back( { BlockSparseMatrix::from_dense( layer->_weights ),
+                             layer->has_bias ? layer->_bias : Matrix(),
+                             layer->_act->kind() } );
+    }
+}
+
+
+Matrix SparseNet::forward( ConstMatrixView input ) const {
+
+    Matrix result( input );
+
+    for ( const SparseLayer& layer : _layers ) {
+        Matrix outputs( layer.weights.rows, result.cols );
+        block_sparse_gemm( layer.weights, result, outputs );
+
+        if ( layer.bias.rows != 0 ) {
+            outputs.cwise_add( layer.bias );
+        }
+
+        if ( layer.act == ActivationKind::ReLU ) {
+            outputs.apply( []( float x ){ return std::max( 0.f, x ); } );
+        }
+
+        result = std::move( outputs );
+    }
+
+    return result;
+}
+
+
+std::vector< size_t > SparseNet::predict( ConstMatrixView input ) const {
+    return predictions( forward( input ) );
+}
+
+
+size_t SparseNet::bytes() const {
+    size_t res = 0;
+    for ( const SparseLayer& layer : _layers ) {
+        res += layer.weights.bytes() + layer.bias.rows * sizeof( float );
+    }
+
+    return res;
+}
+
+
+/*
+ * Layout: magic, layer count, then for every layer
+ *      activation kind, rows, cols, has_bias, block count,
+ *      column offsets (cols + 1 x uint32), block rows (uint32 each),
+ *      block values (SPARSE_BLOCK_ROWS floats each), bias
+ */
+bool SparseNet::save( const std::string& path ) const {
+    std::ofstream f( path, std::ios::out | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    write_value< uint32_t >( f, SPARSE_CHECKPOINT_MAGIC );
+    write_value< uint32_t >( f, _layers.size() );
+
+    for ( const SparseLayer& layer : _layers ) {
+        const BlockSparseMatrix& w = layer.weights;
+
+        write_value< uint32_t >( f, static_cast< uint32_t >( layer.act ) );
+        write_value< uint64_t >( f, w.rows );
+        write_value< uint64_t >( f, w.cols );
+        write_value< uint8_t >( f, layer.bias.rows != 0 );
+        write_value< uint64_t >( f, w.blocks() );
+
+        for ( size_t offset : w.offsets ) {
+            write_value< uint32_t >( f, offset );
+        }
+
+        f.write( reinterpret_cast< const char* >( w.block_rows.data() ), w.block_rows.size() * sizeof( uint32_t ) );
+        f.write( reinterpret_cast< const char* >( w.values.data() ), w.values.size() * sizeof( float ) );
+
+        if ( layer.bias.rows != 0 ) {
+            write_matrix( f, layer.bias );
+        }
+    }
+
+    return f.good();
+}
+
+
+bool SparseNet::load( const std::string& path ) {
+    std::ifstream f( path, std::ios::in | std::ios::binary );
+
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    if ( read_value< uint32_t >( f ) != SPARSE_CHECKPOINT_MAGIC ) {
+        std::cout << "File " << path << " is not a sparse checkpoint\n";
+        return false;
+    }
+
+    size_t count = read_value< uint32_t >( f );
+    _layers.clear();
+
+    // Activation kind, rows, cols, has_bias and block count of every layer
+    const size_t header = sizeof( uint32_t ) + 3 * sizeof( uint64_t ) + sizeof( uint8_t );
+    if ( count > remaining_bytes( f ) / header ) {
+        std::cout << "Sparse checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    for ( size_t i = 0; i < count && f.good(); i++ ) {
+        SparseLayer layer;
+        BlockSparseMatrix& w = layer.weights;
+
+        uint32_t kind = read_value< uint32_t >( f );
+        w.rows = read_value< uint64_t >( f );
+        w.cols = read_value< uint64_t >( f );
+        bool has_bias = read_value< uint8_t >( f );
+        size_t blocks = read_value< uint64_t >( f );
+
+        if ( !f.good() ) {
+            break;
+        }
+
+        if ( !valid_activation( kind ) ) {
+            std::cout << "Sparse checkpoint " << path << " has an unknown activation " << kind << " in layer " << i << "\n";
+            return false;
+        }
+        layer.act = static_cast< ActivationKind >( kind );
+
+        // Offsets, block rows, values and bias must be in the file before
+        // anything is allocated, checked without overflow
+        size_t words = remaining_bytes( f ) / sizeof( uint32_t );
+        size_t block_words = 1 + SPARSE_BLOCK_ROWS;
+        if ( w.rows == 0 || w.cols == 0 || w.cols >= words || blocks > ( words - w.cols - 1 ) / block_words ||
+             ( has_bias && w.rows > words - w.cols - 1 - blocks * block_words ) ) {
+            std::cout << "Sparse checkpoint " << path << " is truncated or has an invalid shape in layer " << i << "\n";
+            return false;
+        }
+
+        w.offsets.resize( w.cols + 1 );
+        for ( size_t& offset : w.offsets ) {
+            offset = read_value< uint32_t >( f );
+        }
+
+        if ( !f.good() ) {
+            break;
+        }
+
+        // Offsets and block rows index into the values in block_sparse_gemm
+        bool valid = w.offsets.front() == 0 && w.offsets.back() == blocks
+                  && std::is_sorted( w.offsets.begin(), w.offsets.end() );
+        if ( !valid ) {
+            std::cout << "Sparse checkpoint " << path << " has invalid column offsets in layer " << i << "\n";
+            return false;
+        }
+
+        if ( !_layers.empty() && _layers.back().weights.rows != w.cols ) {
+            std::cout << "Sparse checkpoint " << path << ": layer " << i << " has " << w.cols
+                      << " inputs, the previous one " << _layers.back().weights.rows << " outputs\n";
+            return false;
+        }
+
+        w.block_rows.resize( blocks );
+        w.values.resize( blocks * SPARSE_BLOCK_ROWS );
+        f.read( reinterpret_cast< char* >( w.block_rows.data() ), blocks * sizeof( uint32_t ) );
+        f.read( reinterpret_cast< char* >( w.values.data() ), w.values.size() * sizeof( float ) );
+
+        for ( uint32_t block : w.block_rows ) {
+            if ( size_t( block ) * SPARSE_BLOCK_ROWS >= w.rows ) {
+                std::cout << "Sparse checkpoint " << path << " has a block past row " << w.rows
+                          << " in layer " << i << "\n";
+                return false;
+            }
+        }
+
+        if ( has_bias ) {
+            layer.bias = Matrix( w.rows, 1 );
+            read_matrix( f, layer.bias );
+        }
+
+        _layers.push_back( std::move( layer ) );
+    }
+
+    if ( !f.good() ) {
+        std::cout << "Sparse checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+size_t SparseNet::checkpoint_bytes() const {
+
+    size_t res = 2 * sizeof( uint32_t );
+    for ( const SparseLayer& layer : _layers ) {
+        const BlockSparseMatrix& w = layer.weights;
+
+        res += sizeof( uint32_t ) + 3 * sizeof( uint64_t ) + sizeof( uint8_t );
+        res += w.offsets.size() * sizeof( uint32_t ) + w.block_rows.size() * sizeof( uint32_t );
+        res += w.values.size() * sizeof( float ) + layer.bias.rows * sizeof( float );
+    }
+
+    return res;
+}
+
+
+/*
+ * Built-in dense vs. sparse comparison.
+ */
+template < typename func >
+static double latency_us( func forward, const Matrix& data, size_t batch ) {
+
+    if ( batch == 0 || data.cols < batch ) {
+        return 0.0;
+    }
+
+    size_t batches = std::max< size_t >( 1, std::min< size_t >( 2000, data.cols ) / batch );
+
+    // warm up caches before timing
+    forward( data.col_range( 0, batch ) );
+
+    auto start = std::chrono::steady_clock::now();
+    for ( size_t i = 0; i < batches; i++ ) {
+        forward( data.col_range( ( i * batch ) % ( data.cols - batch + 1 ), batch ) );
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration< double, std::micro >( end - start ).count() / ( batches * batch );
+}
+
+
+void compare_sparse( NeuralNet& dense, const SparseNet& sparse,
+                     const Matrix& data, const std::vector< int >& labels ) {
+
+    if ( data.cols == 0 ) {
+        return;
+    }
+
+    auto dense_preds = dense.predict( data );
+    auto sparse_preds = sparse.predict( data );
+
+    float dense_acc = 0, sparse_acc = 0;
+    for ( size_t i = 0; i < data.cols; i++ ) {
+        dense_acc += ( dense_preds[i] == size_t( labels[i] ) );
+        sparse_acc += ( sparse_preds[i] == size_t( labels[i] ) );
+    }
+
+    std::cout << "                      dense       sparse\n";
+    std::cout << "Accuracy        " << std::setw( 11 ) << dense_acc / data.cols << "  "
+              << std::setw( 11 ) << sparse_acc / data.cols << "\n";
+    std::cout << "Checkpoint B    " << std::setw( 11 ) << checkpoint_bytes( dense ) << "  "
+              << std::setw( 11 ) << sparse.checkpoint_bytes() << "\n";
+
+    for ( size_t batch : { size_t( 1 ), size_t( 64 ) } ) {
+        batch = std::min( batch, data.cols );
+        double d = latency_us( [&]( ConstMatrixView x ){ dense.forward( x ); }, data, batch );
+        double s = latency_us( [&]( ConstMatrixView x ){ sparse.forward( x ); }, data, batch );
+
+        std::cout << "us/sample b=" << std::setw( 3 ) << batch << " " << std::setw( 11 ) << d << "  "
+                  << std::setw( 11 ) << s << "\n";
+    }
+}
@@ -1,3 +1,255 @@
 #include "random.hpp"
 
+#include <cstring>
+#include <thread>
+
 RNG rng;
+
+
+/*
+ * Philox4x32-10
+ */
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+static const size_t PHILOX_ROUNDS = 10;
+
+
+Philox::Block Philox::generate( uint64_t key, uint64_t stream, uint64_t counter ) {
+
+    uint32_t c0 = counter, c1 = counter >> 32, c2 = stream, c3 = stream >> 32;
+    uint32_t k0 = key, k1 = key >> 32;
+
+    for ( size_t round = 0; round < PHILOX_ROUNDS; round++ ) {
+        uint64_t p0 = uint64_t( PHILOX_M0 ) * c0;
+        uint64_t p1 = uint64_t( PHILOX_M1 ) * c2;
+
+        c0 = uint32_t( p1 >> 32 ) ^ c1 ^ k0;
+        c1 = uint32_t( p1 );
+        c2 = uint32_t( p0 >> 32 ) ^ c3 ^ k1;
+        c3 = uint32_t( p0 );
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    return { c0, c1, c2, c3 };
+}
+
+
+/*
+ * Batched generation. Blocks are produced GROUP at a time with every step
+ * written as a loop over the group, which the compiler turns into SIMD
+ * instructions. This includes the Box-Muller transform, hence polynomial
+ * log / sin / cos instead of calls to libm.
+ */
+static const size_t GROUP = 16;
+
+// Output blocks of a group, word w of block l in words[w][l]
+static void philox_group( uint64_t key, uint64_t stream, uint64_t first,
+                          uint32_t ( &words )[4][GROUP] ) {
+
+    uint32_t c0[GROUP], c1[GROUP], c2[GROUP], c3[GROUP];
+    for ( size_t l = 0; l < GROUP; l++ ) {
+        uint64_t counter = first + l;
+        c0[l] = counter;
+        c1[l] = counter >> 32;
+        c2[l] = stream;
+        c3[l] = stream >> 32;
+    }
+
+    uint32_t k0 = key, k1 = key >> 32;
+
+    for ( size_t round = 0; round < PHILOX_ROUNDS; round++ ) {
+        for ( size_t l = 0; l < GROUP; l++ ) {
+            uint32_t a0 = c0[l], a1 = c1[l], a2 = c2[l], a3 = c3[l];
+            uint64_t p0 = uint64_t( PHILOX_M0 ) * a0;
+            uint64_t p1 = uint64_t( PHILOX_M1 ) * a2;
+
+            c0[l] = uint32_t( p1 >> 32 ) ^ a1 ^ k0;
+            c1[l] = uint32_t( p1 );
+            c2[l] = uint32_t( p0 >> 32 ) ^ a3 ^ k1;
+            c3[l] = uint32_t( p0 );
+        }
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    std::copy( c0, c0 + GROUP, words[0] );
+    std::copy( c1, c1 + GROUP, words[1] );
+    std::copy( c2, c2 + GROUP, words[2] );
+    std::copy( c3, c3 + GROUP, words[3] );
+}
+
+
+// Uniform in [0, 1) and in (0, 1]
+static inline float to_uniform( uint32_t x ) {
+    return ( x >> 8 ) * ( 1.f / ( 1 << 24 ) );
+}
+
+static inline float to_uniform_open( uint32_t x ) {
+    return ( ( x >> 8 ) + 1 ) * ( 1.f / ( 1 << 24 ) );
+}
+
+
+// Natural log of x > 0, absolute error below 1e-7 for x in (0, 1]
+static inline float poly_log( float x ) {
+
+    uint32_t bits;
+    std::memcpy( &bits, &x, sizeof( bits ) );
+
+    float exponent = float( int( bits >> 23 ) - 127 );
+    bits = ( bits & 0x007fffff ) | 0x3f800000;
+
+    float m;
+    std::memcpy( &m, &bits, sizeof( m ) );
+
+    // log m = 2 atanh t for m in [1, 2), t in [0, 1/3)
+    float t = ( m - 1.f ) / ( m + 1.f );
+    float t2 = t * t;
+    float series = 1.f + t2 * ( 1.f / 3 + t2 * ( 1.f / 5 + t2 * ( 1.f / 7 + t2 * ( 1.f / 9 + t2 * ( 1.f / 11 ) ) ) ) );
+
+    return exponent * 0.69314718f + 2.f * t * series;
+}
+
+
+// sin and cos of x in [-pi / 2, pi / 2], Taylor series to x^11 / x^12
+static inline void poly_sincos( float x, float& s, float& c ) {
+    float x2 = x * x;
+    s = x * ( 1.f - x2 * ( 1.f / 6 ) * ( 1.f - x2 * ( 1.f / 20 ) * ( 1.f - x2 * ( 1.f / 42 ) *
+            ( 1.f - x2 * ( 1.f / 72 ) * ( 1.f - x2 * ( 1.f / 110 ) ) ) ) ) );
+    c = 1.f - x2 * 0.5f * ( 1.f - x2 * ( 1.f / 12 ) * ( 1.f - x2 * ( 1.f / 30 ) * ( 1.f - x2 * ( 1.f / 56 ) *
+            ( 1.f - x2 * ( 1.f / 90 ) * ( 1.f - x2 * ( 1.f / 132 ) ) ) ) ) );
+}
+
+
+/*
+ * Box-Muller: words 0, 1 and words 2, 3 of a block give two normals each,
+ *
+ *      r = sqrt( -2 log u1 ), z = r cos( 2 phi ), r sin( 2 phi )
+ *
+ * where phi = pi ( u2 - 1/2 ) is uniform in [-pi / 2, pi / 2), so that
+ * 2 phi covers a full turn and the double angle formulas give its sin / cos.
+ */
+static void normal_group( const uint32_t ( &words )[4][GROUP], float mu, float sd, float* out ) {
+
+    for ( size_t pair = 0; pair < 2; pair++ ) {
+        for ( size_t l = 0; l < GROUP; l++ ) {
+            float r = std::sqrt( -2.f * poly_log( to_uniform_open( words[2 * pair][l] ) ) ) * sd;
+            float phi = 3.14159265f * ( to_uniform( words[2 * pair + 1][l] ) - 0.5f );
+
+            float s, c;
+            poly_sincos( phi, s, c );
+
+            out[4 * l + 2 * pair] = mu + r * ( 1.f - 2.f * s * s );
+            out[4 * l + 2 * pair + 1] = mu + r * ( 2.f * s * c );
+        }
+    }
+}
+
+
+static void uniform_group( const uint32_t ( &words )[4][GROUP], float min, float max, float* out ) {
+    for ( size_t w = 0; w < 4; w++ ) {
+        for ( size_t l = 0; l < GROUP; l++ ) {
+            out[4 * l + w] = min + ( max - min ) * to_uniform( words[w][l] );
+        }
+    }
+}
+
+
+/*
+ * Fill `count` values from blocks first, first + 1, ... of a stream, every
+ * block gives 4 values. Large requests are split between threads at group
+ * boundaries, which does not change any value.
+ */
+template < typename transform >
+static void fill( uint64_t key, uint64_t stream, uint64_t first, float* out, size_t count, transform f ) {
+
+    const size_t values_per_group = 4 * GROUP;
+    size_t groups = ( count + values_per_group - 1 ) / values_per_group;
+
+    auto work = [&]( size_t begin, size_t end ){
+        uint32_t words[4][GROUP];
+        float values[values_per_group];
+
+        for ( size_t g = begin; g < end; g++ ) {
+            philox_group( key, stream, first + g * GROUP, words );
+            f( words, values );
+
+            size_t offset = g * values_per_group;
+            size_t n = std::min( values_per_group, count - offset );
+            std::copy( values, values + n, out + offset );
+        }
+    };
+
+    // Threads only pay off for large vectors
+    size_t threads = std::min< size_t >( std::max( 1u, std::thread::hardware_concurrency() ),
+                                         groups / 256 + 1 );
+
+    if ( threads == 1 ) {
+        work( 0, groups );
+        return;
+    }
+
+    std::vector< std::thread > workers;
+    size_t per_thread = ( groups + threads - 1 ) / threads;
+    for ( size_t t = 0; t < threads; t++ ) {
+        size_t begin = std::min( t * per_thread, groups );
+        size_t end = std::min( begin + per_thread, groups );
+        workers.emplace_back( work, begin, end );
+    }
+
+    for ( auto& worker : workers ) {
+        worker.join();
+    }
+}
+
+
+/*
+ * RNG
+ */
+void RNG::seed() {
+    std::random_device rd;
+    _seed = ( uint64_t( rd() ) << 32 ) | rd();
+    _offset = 0;
+}
+
+
+void RNG::seed( unsigned seed ) {
+    _seed = seed;
+    _offset = 0;
+}
+
+
+RandomStream RNG::stream( uint64_t id ) const {
+    return RandomStream( _seed, id + 1 );
+}
+
+
+std::vector< float > RNG::normal_vec( size_t count, float mu, float std ) {
+
+    std::vector< float > result( count );
+
+    uint64_t first = _offset.fetch_add( ( count + 4 * GROUP - 1 ) / ( 4 * GROUP ) * GROUP );
+    fill( _seed, 0, first, result.data(), count, [&]( auto& words, float* out ){
+        normal_group( words, mu, std, out );
+    } );
+
+    return result;
+}
+
+
+std::vector< float > RNG::uniform_vec( size_t count, float min, float max ) {
+
+    std::vector< float > result( count );
+
+    uint64_t first = _offset.fetch_add( ( count + 4 * GROUP - 1 ) / ( 4 * GROUP ) * GROUP );
+    fill( _seed, 0, first, result.data(), count, [&]( auto& words, float* out ){
+        uniform_group( words, min, max, out );
+    } );
+
+    return result;
+}
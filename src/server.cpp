@@ -0,0 +1,573 @@
+#include "server.hpp"
+#include "loader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/*
+ * Latency histogram, bucket b > 0 counts latencies in [ 2^(b-1), 2^b ) us
+ */
+void LatencyHistogram::record( double us ) {
+    size_t bucket = us < 1.0 ? 0 : std::min( BUCKETS - 1, size_t( std::log2( us ) ) + 1 );
+    _counts[bucket].fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+uint64_t LatencyHistogram::count() const {
+    uint64_t res = 0;
+    for ( auto& count : _counts ) {
+        res += count.load( std::memory_order_relaxed );
+    }
+
+    return res;
+}
+
+
+double LatencyHistogram::percentile( double p ) const {
+
+    uint64_t total = count();
+    uint64_t seen = 0;
+
+    if ( total == 0 ) {
+        return 0.0;
+    }
+
+    for ( size_t bucket = 0; bucket < BUCKETS; bucket++ ) {
+        seen += _counts[bucket].load( std::memory_order_relaxed );
+        if ( seen >= p / 100.0 * total ) {
+            return std::ldexp( 1.0, bucket );
+        }
+    }
+
+    return std::ldexp( 1.0, BUCKETS - 1 );
+}
+
+
+std::string LatencyHistogram::summary() const {
+    std::ostringstream res;
+    res << "p50 <= " << percentile( 50 ) << " us, p90 <= " << percentile( 90 )
+        << " us, p99 <= " << percentile( 99 ) << " us";
+
+    return res.str();
+}
+
+
+/*
+ * Batching server
+ */
+BatchingServer::BatchingServer( std::vector< LayerParams >&& layers, const ServerConfig& config )
+                              : _layers( std::make_shared< const std::vector< LayerParams > >( std::move( layers ) ) ),
+                                _config( config ), _start( clock::now() ) {
+
+    _input_dim = _layers->empty() ? 0 : ( *_layers )[0].weights.cols;
+
+    _config.max_batch = std::max< size_t >( 1, _config.max_batch );
+
+    size_t workers = _config.workers;
+    if ( workers == 0 ) {
+        workers = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
+    for ( size_t i = 0; i < workers; i++ ) {
+        _workers.emplace_back( &BatchingServer::work, this );
+    }
+}
+
+
+BatchingServer::~BatchingServer() {
+    stop();
+}
+
+
+size_t BatchingServer::input_dim() const {
+    return _input_dim;
+}
+
+
+std::future< int > BatchingServer::submit( std::vector< float >&& input ) {
+
+    Request request{ std::move( input ), std::promise< int >(), clock::now() };
+    std::future< int > res = request.result.get_future();
+
+    if ( request.input.size() != input_dim() ) {
+        request.result.set_value( -1 );
+        return res;
+    }
+
+    std::lock_guard< std::mutex > lock( _mutex );
+    _queue.push_back( std::move( request ) );
+
+    // A full batch has to wake the worker collecting it, not just any
+    if ( _queue.size() >= _config.max_batch ) {
+        _cv.notify_all();
+    }
+    else {
+        _cv.notify_one();
+    }
+
+    return res;
+}
+
+
+void BatchingServer::stop() {
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _stop = true;
+    }
+
+    _cv.notify_all();
+    for ( auto& worker : _workers ) {
+        worker.join();
+    }
+
+    _workers.clear();
+}
+
+
+void BatchingServer::work() {
+
+    for (;;) {
+
+        std::vector< Request > batch;
+        {
+            std::unique_lock< std::mutex > lock( _mutex );
+            _cv.wait( lock, [&](){ return _stop || !_queue.empty(); } );
+
+            if ( _queue.empty() ) {
+                return;
+            }
+
+            // Wait for a full batch, at most until the oldest request expires
+            auto deadline = _queue.front().arrival + std::chrono::microseconds( _config.max_wait_us );
+            _cv.wait_until( lock, deadline, [&](){ return _stop || _queue.size() >= _config.max_batch; } );
+
+            size_t size = std::min( _queue.size(), _config.max_batch );
+            for ( size_t i = 0; i < size; i++ ) {
+                batch.push_back( std::move( _queue.front() ) );
+                _queue.pop_front();
+            }
+
+            if ( !_queue.empty() ) {
+                _cv.notify_one();
+            }
+        }
+
+        if ( batch.empty() ) {
+            continue;
+        }
+
+        Matrix input( input_dim(), batch.size() );
+        for ( size_t j = 0; j < batch.size(); j++ ) {
+            std::copy( batch[j].input.begin(), batch[j].input.end(), input.column( j ) );
+        }
+
+        auto layers = std::atomic_load( &_layers );
+        std::vector< size_t > preds = predictions( forward( *layers, std::move( input ) ) );
+
+        auto now = clock::now();
+        for ( size_t j = 0; j < batch.size(); j++ ) {
+            batch[j].result.set_value( int( preds[j] ) );
+            _latency.record( std::chrono::duration< double, std::micro >( now - batch[j].arrival ).count() );
+        }
+
+        _requests += batch.size();
+        _batches += 1;
+    }
+}
+
+
+bool BatchingServer::update_model( std::vector< LayerParams >&& layers ) {
+
+    if ( layers.empty() || layers[0].weights.cols != _input_dim ) {
+        std::cout << "Model for inputs of another dimension, not updated\n";
+        return false;
+    }
+
+    std::atomic_store( &_layers, std::shared_ptr< const std::vector< LayerParams > >(
+                                     std::make_shared< const std::vector< LayerParams > >( std::move( layers ) ) ) );
+    _model_updates++;
+    return true;
+}
+
+
+Matrix BatchingServer::forward( const std::vector< LayerParams >& layers, Matrix&& input ) {
+
+    for ( auto& layer : layers ) {
+        Matrix output = layer.weights.mult( input );
+        if ( layer.bias.rows != 0 ) {
+            output.cwise_add( layer.bias );
+        }
+
+        ActivationFunction* act = get_activation( layer.act );
+        output.apply( [&]( float x ){ return act->forward( x ); } );
+
+        input = std::move( output );
+    }
+
+    return std::move( input );
+}
+
+
+std::string BatchingServer::statistics() const {
+
+    double seconds = std::chrono::duration< double >( clock::now() - _start ).count();
+    uint64_t requests = _requests;
+    uint64_t batches = _batches;
+
+    std::ostringstream res;
+    res << "requests " << requests << ", batches " << batches
+        << ", mean batch " << ( batches == 0 ? 0.0 : double( requests ) / batches )
+        << ", throughput " << requests / seconds << " req/s, model updates " << _model_updates << "\n"
+        << "server latency " << _latency.summary() << "\n";
+
+    return res.str();
+}
+
+
+/*
+ * Stdin protocol. Answers have to keep the order of requests, a separate
+ * thread writes them so that reading (and batching) never stalls on one.
+ */
+int serve_stdin( BatchingServer& server ) {
+
+    std::deque< std::future< int > > pending;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+
+    std::thread writer( [&](){
+        for (;;) {
+            std::future< int > result;
+            {
+                std::unique_lock< std::mutex > lock( mutex );
+                cv.wait( lock, [&](){ return done || !pending.empty(); } );
+                if ( pending.empty() ) {
+                    return;
+                }
+
+                result = std::move( pending.front() );
+                pending.pop_front();
+            }
+
+            int label = result.get();
+            if ( label < 0 ) {
+                std::cout << "error\n";
+            }
+            else {
+                std::cout << label << "\n";
+            }
+
+            std::cout.flush();
+        }
+    } );
+
+    std::string line;
+    while ( std::getline( std::cin, line ) ) {
+        std::future< int > result = server.submit( Loader::parse_vector( line ) );
+
+        std::lock_guard< std::mutex > lock( mutex );
+        pending.push_back( std::move( result ) );
+        cv.notify_one();
+    }
+
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        done = true;
+        cv.notify_one();
+    }
+
+    writer.join();
+    server.stop();
+
+    // stdout carries the answers
+    std::cerr << server.statistics();
+    return 0;
+}
+
+
+/*
+ * Unix domain socket protocol
+ */
+static std::atomic< bool > interrupted{ false };
+
+static void on_signal( int ) {
+    interrupted = true;
+}
+
+
+static bool read_exact( int fd, void* buffer, size_t bytes ) {
+    char* ptr = static_cast< char* >( buffer );
+    while ( bytes > 0 ) {
+        ssize_t n = ::read( fd, ptr, bytes );
+        if ( n <= 0 ) {
+            return false;
+        }
+
+        ptr += n;
+        bytes -= n;
+    }
+
+    return true;
+}
+
+
+static bool write_all( int fd, const void* buffer, size_t bytes ) {
+    const char* ptr = static_cast< const char* >( buffer );
+    while ( bytes > 0 ) {
+        ssize_t n = ::write( fd, ptr, bytes );
+        if ( n <= 0 ) {
+            return false;
+        }
+
+        ptr += n;
+        bytes -= n;
+    }
+
+    return true;
+}
+
+
+// Largest request accepted, protects against garbage on the socket
+static const uint32_t MAX_REQUEST_FLOATS = 1 << 24;
+
+
+static void handle_connection( BatchingServer& server, int fd ) {
+
+    uint32_t n;
+    while ( read_exact( fd, &n, sizeof( n ) ) ) {
+
+        if ( n == 0 ) {
+            std::string stats = server.statistics();
+            uint32_t length = stats.size();
+            if ( !write_all( fd, &length, sizeof( length ) ) || !write_all( fd, stats.data(), length ) ) {
+                break;
+            }
+
+            continue;
+        }
+
+        if ( n > MAX_REQUEST_FLOATS ) {
+            break;
+        }
+
+        std::vector< float > input( n );
+        if ( !read_exact( fd, input.data(), n * sizeof( float ) ) ) {
+            break;
+        }
+
+        int32_t label = server.submit( std::move( input ) ).get();
+        if ( !write_all( fd, &label, sizeof( label ) ) ) {
+            break;
+        }
+    }
+}
+
+
+// A client of serve_socket. Its thread closes the socket when the client
+// goes away, shutdown at exit only touches sockets that are still open.
+struct Connection {
+    std::thread thread;
+    std::mutex mutex;
+    int fd = -1;
+    bool open = true;
+};
+
+
+static void run_connection( BatchingServer& server, Connection& connection ) {
+
+    handle_connection( server, connection.fd );
+
+    std::lock_guard< std::mutex > lock( connection.mutex );
+    ::close( connection.fd );
+    connection.open = false;
+}
+
+
+static int connect_socket( const std::string& path ) {
+
+    int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy( addr.sun_path, sizeof( addr.sun_path ) - 1 );
+
+    if ( fd < 0 || ::connect( fd, reinterpret_cast< sockaddr* >( &addr ), sizeof( addr ) ) != 0 ) {
+        std::cout << "Cannot connect to " << path << "\n";
+        if ( fd >= 0 ) {
+            ::close( fd );
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int serve_socket( BatchingServer& server, const std::string& path ) {
+
+    sockaddr_un addr{};
+    if ( path.size() >= sizeof( addr.sun_path ) ) {
+        std::cout << "Socket path " << path << " is too long\n";
+        return 1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    path.copy( addr.sun_path, sizeof( addr.sun_path ) - 1 );
+
+    int listener = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+    ::unlink( path.c_str() );
+
+    if ( listener < 0 || ::bind( listener, reinterpret_cast< sockaddr* >( &addr ), sizeof( addr ) ) != 0 ||
+         ::listen( listener, 128 ) != 0 ) {
+        std::cout << "Cannot listen on " << path << "\n";
+        return 1;
+    }
+
+    std::signal( SIGINT, on_signal );
+    std::signal( SIGTERM, on_signal );
+    std::signal( SIGPIPE, SIG_IGN );
+
+    std::cout << "Serving on " << path << ", Ctrl-C to stop\n";
+
+    std::vector< std::unique_ptr< Connection > > connections;
+
+    // Join the threads of clients that are gone
+    auto reap = [&](){
+        auto finished = [&]( std::unique_ptr< Connection >& connection ){
+            {
+                std::lock_guard< std::mutex > lock( connection->mutex );
+                if ( connection->open ) {
+                    return false;
+                }
+            }
+
+            connection->thread.join();
+            return true;
+        };
+
+        connections.erase( std::remove_if( connections.begin(), connections.end(), finished ), connections.end() );
+    };
+
+    while ( !interrupted ) {
+        reap();
+
+        pollfd pfd{ listener, POLLIN, 0 };
+        if ( ::poll( &pfd, 1, 200 ) <= 0 ) {
+            continue;
+        }
+
+        int fd = ::accept( listener, nullptr, nullptr );
+        if ( fd >= 0 ) {
+            auto connection = std::make_unique< Connection >();
+            connection->fd = fd;
+            connection->thread = std::thread( run_connection, std::ref( server ), std::ref( *connection ) );
+            connections.push_back( std::move( connection ) );
+        }
+    }
+
+    // Unblock connections still waiting for requests
+    for ( auto& connection : connections ) {
+        {
+            std::lock_guard< std::mutex > lock( connection->mutex );
+            if ( connection->open ) {
+                ::shutdown( connection->fd, SHUT_RDWR );
+            }
+        }
+
+        connection->thread.join();
+    }
+
+    ::close( listener );
+    ::unlink( path.c_str() );
+
+    server.stop();
+    std::cout << server.statistics();
+    return 0;
+}
+
+
+/*
+ * Load generator
+ */
+int run_load_generator( const std::string& path, const std::vector< std::vector< float > >& samples,
+                        const std::vector< int >& labels, size_t clients, size_t requests ) {
+
+    if ( samples.empty() ) {
+        std::cout << "No samples to send\n";
+        return 1;
+    }
+
+    LatencyHistogram latency;
+    std::atomic< uint64_t > answered{ 0 }, correct{ 0 }, failed{ 0 };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector< std::thread > threads;
+    for ( size_t c = 0; c < clients; c++ ) {
+        threads.emplace_back( [&, c](){
+            int fd = connect_socket( path );
+            if ( fd < 0 ) {
+                failed += requests;
+                return;
+            }
+
+            for ( size_t r = 0; r < requests; r++ ) {
+                size_t i = ( c * requests + r ) % samples.size();
+                uint32_t n = samples[i].size();
+                int32_t label;
+
+                auto sent = std::chrono::steady_clock::now();
+                if ( !write_all( fd, &n, sizeof( n ) ) ||
+                     !write_all( fd, samples[i].data(), n * sizeof( float ) ) ||
+                     !read_exact( fd, &label, sizeof( label ) ) ) {
+                    failed += requests - r;
+                    break;
+                }
+
+                latency.record( std::chrono::duration< double, std::micro >( std::chrono::steady_clock::now() - sent ).count() );
+                answered++;
+                correct += ( i < labels.size() && label == labels[i] );
+            }
+
+            ::close( fd );
+        } );
+    }
+
+    for ( auto& thread : threads ) {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    std::cout << clients << " clients, " << answered << " answers, " << failed << " failed, "
+              << answered / seconds << " req/s\n";
+    std::cout << "client latency " << latency.summary() << "\n";
+    if ( !labels.empty() && answered > 0 ) {
+        std::cout << "accuracy " << double( correct ) / answered << "\n";
+    }
+
+    // Ask the server for its side of the story
+    int fd = connect_socket( path );
+    if ( fd < 0 ) {
+        return 1;
+    }
+
+    uint32_t zero = 0, length = 0;
+    if ( write_all( fd, &zero, sizeof( zero ) ) && read_exact( fd, &length, sizeof( length ) ) ) {
+        std::string stats( length, '\0' );
+        if ( read_exact( fd, stats.data(), length ) ) {
+            std::cout << stats;
+        }
+    }
+
+    ::close( fd );
+    return failed == 0 ? 0 : 1;
+}
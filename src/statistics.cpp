@@ -0,0 +1,180 @@
+#include "statistics.hpp"
+
+#include <cmath>
+#include <thread>
+
+
+void RunningStats::add( double x ) {
+    count++;
+    double delta = x - mean;
+    mean += delta / count;
+    m2 += delta * ( x - mean );
+}
+
+
+void RunningStats::merge( const RunningStats& rhs ) {
+
+    if ( rhs.count == 0 ) {
+        return;
+    }
+
+    size_t total = count + rhs.count;
+    double delta = rhs.mean - mean;
+
+    mean += delta * rhs.count / total;
+    m2 += rhs.m2 + delta * delta * ( double( count ) * rhs.count / total );
+    count = total;
+}
+
+
+double RunningStats::variance() const {
+    return count < 2 ? 0.0 : m2 / ( count - 1 );
+}
+
+
+double RunningStats::sd() const {
+    return std::sqrt( variance() );
+}
+
+
+void FeatureStats::merge( const FeatureStats& rhs ) {
+
+    if ( features.empty() ) {
+        features = rhs.features;
+        return;
+    }
+
+    for ( size_t i = 0; i < features.size() && i < rhs.features.size(); i++ ) {
+        features[i].merge( rhs.features[i] );
+    }
+}
+
+
+RunningStats FeatureStats::global() const {
+    RunningStats res;
+    for ( auto& feature : features ) {
+        res.merge( feature );
+    }
+
+    return res;
+}
+
+
+/*
+ * Every thread runs Welford over a contiguous range of samples for all
+ * features at once (all features share the count), partial results are
+ * merged at the end.
+ */
+static FeatureStats range_statistics( const std::vector< std::vector< float > >& vectors,
+                                      size_t begin, size_t end, size_t dim ) {
+
+    std::vector< double > mean( dim, 0.0 ), m2( dim, 0.0 );
+    size_t count = 0;
+
+    for ( size_t i = begin; i < end; i++ ) {
+        const float* sample = vectors[i].data();
+        count++;
+        double inv_count = 1.0 / count;
+
+        for ( size_t f = 0; f < dim; f++ ) {
+            double delta = sample[f] - mean[f];
+            mean[f] += delta * inv_count;
+            m2[f] += delta * ( sample[f] - mean[f] );
+        }
+    }
+
+    FeatureStats res;
+    res.features.resize( dim );
+    for ( size_t f = 0; f < dim; f++ ) {
+        res.features[f] = { count, mean[f], m2[f] };
+    }
+
+    return res;
+}
+
+
+FeatureStats compute_statistics( const std::vector< std::vector< float > >& vectors, size_t threads ) {
+
+    if ( vectors.empty() ) {
+        return FeatureStats();
+    }
+
+    size_t dim = vectors[0].size();
+
+    if ( threads == 0 ) {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+    threads = std::min( threads, vectors.size() );
+
+    std::vector< FeatureStats > partial( threads );
+    std::vector< std::thread > workers;
+
+    size_t per_thread = ( vectors.size() + threads - 1 ) / threads;
+    for ( size_t t = 0; t < threads; t++ ) {
+        size_t begin = std::min( t * per_thread, vectors.size() );
+        size_t end = std::min( begin + per_thread, vectors.size() );
+        workers.emplace_back( [&, t, begin, end](){
+            partial[t] = range_statistics( vectors, begin, end, dim );
+        } );
+    }
+
+    FeatureStats res;
+    for ( size_t t = 0; t < threads; t++ ) {
+        workers[t].join();
+        res.merge( partial[t] );
+    }
+
+    return res;
+}
+
+
+/*
+ * Normalization
+ */
+static float inverse_sd( double sd ) {
+    return sd > 0 ? float( 1.0 / sd ) : 1.f;
+}
+
+
+Normalization Normalization::global( const FeatureStats& stats ) {
+
+    RunningStats all = stats.global();
+    size_t dim = stats.features.size();
+
+    Normalization res;
+    res.mean.assign( dim, float( all.mean ) );
+    res.scale.assign( dim, inverse_sd( all.sd() ) );
+    return res;
+}
+
+
+Normalization Normalization::per_feature( const FeatureStats& stats ) {
+
+    Normalization res;
+    for ( auto& feature : stats.features ) {
+        res.mean.push_back( feature.mean );
+        res.scale.push_back( inverse_sd( feature.sd() ) );
+    }
+
+    return res;
+}
+
+
+bool Normalization::empty() const {
+    return mean.empty();
+}
+
+
+void Normalization::apply( const float* in, float* out ) const {
+    for ( size_t i = 0; i < mean.size(); i++ ) {
+        out[i] = ( in[i] - mean[i] ) * scale[i];
+    }
+}
+
+
+void Normalization::apply( MatrixView samples ) const {
+    assert( samples.rows == mean.size() );
+    for ( size_t col = 0; col < samples.cols; col++ ) {
+        apply( samples.col( col ), samples.col( col ) );
+    }
+}
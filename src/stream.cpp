@@ -0,0 +1,463 @@
+#include "stream.hpp"
+#include "checkpoint.hpp"
+#include "loader.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <numeric>
+
+
+static const uint32_t SHARD_MAGIC = 0x44534e4e; // "NNSD"
+
+
+/*
+ * Shard reader
+ */
+bool ShardReader::open( const Shard& shard ) {
+
+    _binary = shard.labels.empty();
+    _has_first = false;
+
+    if ( _binary ) {
+        _vectors = std::ifstream( shard.vectors, std::ios::in | std::ios::binary );
+    }
+    else {
+        _vectors = std::ifstream( shard.vectors, std::ios::in );
+        _labels = std::ifstream( shard.labels, std::ios::in );
+    }
+
+    if ( !_vectors.is_open() || ( !_binary && !_labels.is_open() ) ) {
+        std::cout << "Cannot open shard " << shard.vectors << "\n";
+        return false;
+    }
+
+    if ( _binary ) {
+        if ( read_value< uint32_t >( _vectors ) != SHARD_MAGIC ) {
+            std::cout << "File " << shard.vectors << " is not a shard\n";
+            return false;
+        }
+
+        _dim = read_value< uint32_t >( _vectors );
+        _remaining = read_value< uint64_t >( _vectors );
+        return _vectors.good();
+    }
+
+    // CSV does not store the dimension, take it from the first line
+    std::string line;
+    if ( std::getline( _vectors, line ) ) {
+        _first = Loader::parse_vector( line );
+        _has_first = true;
+    }
+
+    _dim = _first.size();
+    return true;
+}
+
+
+size_t ShardReader::dim() const {
+    return _dim;
+}
+
+
+bool ShardReader::next( float* out, int& label ) {
+
+    if ( _binary ) {
+        if ( _remaining == 0 ) {
+            return false;
+        }
+
+        _remaining--;
+        label = read_value< int32_t >( _vectors );
+        _vectors.read( reinterpret_cast< char* >( out ), _dim * sizeof( float ) );
+        return _vectors.good();
+    }
+
+    std::string line;
+    if ( !std::getline( _labels, line ) ) {
+        return false;
+    }
+
+    // Malformed labels end the shard, an exception here would be thrown on
+    // the reader thread
+    char* end = nullptr;
+    errno = 0;
+    long value = std::strtol( line.c_str(), &end, 10 );
+    while ( end != nullptr && std::isspace( static_cast< unsigned char >( *end ) ) ) {
+        end++;
+    }
+
+    if ( end == line.c_str() || *end != '\0' || errno == ERANGE || value < INT_MIN || value > INT_MAX ) {
+        std::cout << "Invalid label \"" << line << "\" in a shard\n";
+        return false;
+    }
+
+    label = int( value );
+
+    if ( _has_first ) {
+        _has_first = false;
+        std::copy( _first.begin(), _first.end(), out );
+        return true;
+    }
+
+    if ( !std::getline( _vectors, line ) ) {
+        return false;
+    }
+
+    std::vector< float > vector = Loader::parse_vector( line );
+    if ( vector.size() != _dim ) {
+        std::cout << "Sample of dimension " << vector.size() << " in a shard of dimension " << _dim << "\n";
+        return false;
+    }
+
+    std::copy( vector.begin(), vector.end(), out );
+    return true;
+}
+
+
+/*
+ * Writing shards
+ */
+static void write_shard_header( std::ofstream& f, size_t dim, size_t count ) {
+    write_value< uint32_t >( f, SHARD_MAGIC );
+    write_value< uint32_t >( f, dim );
+    write_value< uint64_t >( f, count );
+}
+
+
+bool write_shard( const std::string& path,
+                  const std::vector< std::vector< float > >& vectors,
+                  const std::vector< int >& labels ) {
+
+    std::ofstream f( path, std::ios::out | std::ios::binary );
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    size_t dim = vectors.empty() ? 0 : vectors[0].size();
+    write_shard_header( f, dim, vectors.size() );
+
+    for ( size_t i = 0; i < vectors.size(); i++ ) {
+        write_value< int32_t >( f, labels[i] );
+        f.write( reinterpret_cast< const char* >( vectors[i].data() ), dim * sizeof( float ) );
+    }
+
+    return f.good();
+}
+
+
+std::vector< Shard > shard_csv( const std::string& vectors_csv, const std::string& labels_csv,
+                                const std::string& prefix, size_t samples_per_shard ) {
+
+    ShardReader reader;
+    if ( !reader.open( { vectors_csv, labels_csv } ) ) {
+        return {};
+    }
+
+    std::vector< Shard > shards;
+    std::vector< float > sample( reader.dim() );
+    int label = 0;
+
+    bool more = reader.next( sample.data(), label );
+    while ( more ) {
+
+        std::string path = prefix + "_" + std::to_string( shards.size() ) + ".bin";
+        std::ofstream f( path, std::ios::out | std::ios::binary );
+        if ( !f.is_open() ) {
+            std::cout << "Cannot open file " << path << "\n";
+            return {};
+        }
+
+        // The count is not known until the shard is full, patched below
+        write_shard_header( f, reader.dim(), 0 );
+
+        size_t count = 0;
+        for ( ; more && count < samples_per_shard; count++ ) {
+            write_value< int32_t >( f, label );
+            f.write( reinterpret_cast< const char* >( sample.data() ), sample.size() * sizeof( float ) );
+            more = reader.next( sample.data(), label );
+        }
+
+        f.seekp( 2 * sizeof( uint32_t ) );
+        write_value< uint64_t >( f, count );
+
+        if ( !f.good() ) {
+            std::cout << "Cannot write shard " << path << "\n";
+            return {};
+        }
+
+        shards.push_back( { path, "" } );
+    }
+
+    return shards;
+}
+
+
+FeatureStats shard_statistics( const std::vector< Shard >& shards, size_t threads ) {
+
+    if ( threads == 0 ) {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+    threads = std::max< size_t >( 1, std::min( threads, shards.size() ) );
+
+    // Thread t reads shards t, t + threads, ...
+    std::vector< FeatureStats > partial( threads );
+    std::vector< std::thread > workers;
+
+    for ( size_t t = 0; t < threads; t++ ) {
+        workers.emplace_back( [&, t](){
+            for ( size_t i = t; i < shards.size(); i += threads ) {
+                ShardReader reader;
+                if ( !reader.open( shards[i] ) ) {
+                    continue;
+                }
+
+                FeatureStats stats;
+                stats.features.resize( reader.dim() );
+
+                std::vector< float > sample( reader.dim() );
+                int label;
+                while ( reader.next( sample.data(), label ) ) {
+                    for ( size_t f = 0; f < sample.size(); f++ ) {
+                        stats.features[f].add( sample[f] );
+                    }
+                }
+
+                partial[t].merge( stats );
+            }
+        } );
+    }
+
+    FeatureStats res;
+    for ( size_t t = 0; t < threads; t++ ) {
+        workers[t].join();
+        res.merge( partial[t] );
+    }
+
+    return res;
+}
+
+
+/*
+ * Streaming dataset
+ */
+StreamingDataset::StreamingDataset( std::vector< Shard > shards, size_t memory_budget, unsigned seed )
+                                  : _shards( std::move( shards ) ), _gen( seed, 0 ) {
+
+    ShardReader reader;
+    if ( _shards.empty() || !reader.open( _shards[0] ) ) {
+        std::cout << "No readable shards\n";
+        return;
+    }
+
+    _dim = reader.dim();
+
+    // Split the budget between prefetched chunks (a quarter) and the shuffle
+    // buffer. In flight are the queue, the chunk being read and the one
+    // being consumed.
+    size_t samples = memory_budget / ( ( _dim + 1 ) * sizeof( float ) );
+
+    _chunk_samples = std::clamp< size_t >( samples / 16, 1, 256 );
+    _queue_capacity = std::max< size_t >( 2, samples / ( 4 * _chunk_samples ) );
+
+    size_t in_flight = ( _queue_capacity + 2 ) * _chunk_samples;
+    _capacity = samples > in_flight ? samples - in_flight : 1;
+
+    if ( samples <= in_flight ) {
+        std::cout << "Memory budget of " << memory_budget << " B is too small, using "
+                  << memory_bytes() << " B\n";
+    }
+
+    _buffer.resize( _capacity * _dim );
+    _buffer_labels.resize( _capacity );
+}
+
+
+StreamingDataset::~StreamingDataset() {
+    stop_reader();
+}
+
+
+size_t StreamingDataset::dim() const {
+    return _dim;
+}
+
+
+void StreamingDataset::set_normalization( const Normalization& normalization ) {
+    _normalization = normalization;
+}
+
+
+bool StreamingDataset::normalized() const {
+    return !_normalization.empty();
+}
+
+
+size_t StreamingDataset::memory_bytes() const {
+    return ( _capacity + ( _queue_capacity + 2 ) * _chunk_samples ) * ( _dim + 1 ) * sizeof( float );
+}
+
+
+void StreamingDataset::start_epoch() {
+
+    stop_reader();
+
+    _buffered = 0;
+    _current = Chunk();
+    _cursor = 0;
+
+    if ( _dim == 0 ) {
+        return;
+    }
+
+    std::vector< size_t > order( _shards.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    std::shuffle( order.begin(), order.end(), _gen );
+
+    _stop = false;
+    _reader_done = false;
+    _reader = std::thread( &StreamingDataset::read_shards, this, std::move( order ) );
+}
+
+
+void StreamingDataset::stop_reader() {
+
+    if ( !_reader.joinable() ) {
+        return;
+    }
+
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _stop = true;
+    }
+
+    _cv.notify_all();
+    _reader.join();
+    _queue.clear();
+}
+
+
+/*
+ * Reader thread, pushes chunks of samples until the shards run out or the
+ * epoch is cancelled
+ */
+void StreamingDataset::read_shards( std::vector< size_t > order ) {
+
+    auto push = [&]( Chunk&& chunk ){
+        std::unique_lock< std::mutex > lock( _mutex );
+        _cv.wait( lock, [&](){ return _stop || _queue.size() < _queue_capacity; } );
+        if ( _stop ) {
+            return false;
+        }
+
+        _queue.push_back( std::move( chunk ) );
+        _cv.notify_all();
+        return true;
+    };
+
+    Chunk chunk;
+    for ( size_t shard : order ) {
+
+        ShardReader reader;
+        if ( !reader.open( _shards[shard] ) ) {
+            continue;
+        }
+
+        if ( reader.dim() != _dim ) {
+            std::cout << "Skipping shard " << _shards[shard].vectors << " of dimension " << reader.dim() << "\n";
+            continue;
+        }
+
+        int label;
+        chunk.values.resize( ( chunk.labels.size() + 1 ) * _dim );
+        while ( reader.next( chunk.values.data() + chunk.labels.size() * _dim, label ) ) {
+            chunk.labels.push_back( label );
+
+            if ( chunk.labels.size() == _chunk_samples ) {
+                if ( !push( std::move( chunk ) ) ) {
+                    return;
+                }
+                chunk = Chunk();
+            }
+
+            chunk.values.resize( ( chunk.labels.size() + 1 ) * _dim );
+        }
+
+        chunk.values.resize( chunk.labels.size() * _dim );
+    }
+
+    if ( !chunk.labels.empty() && !push( std::move( chunk ) ) ) {
+        return;
+    }
+
+    std::lock_guard< std::mutex > lock( _mutex );
+    _reader_done = true;
+    _cv.notify_all();
+}
+
+
+bool StreamingDataset::pull_sample( float* out, int& label ) {
+
+    if ( _cursor == _current.labels.size() ) {
+        std::unique_lock< std::mutex > lock( _mutex );
+        _cv.wait( lock, [&](){ return _reader_done || !_queue.empty(); } );
+        if ( _queue.empty() ) {
+            return false;
+        }
+
+        _current = std::move( _queue.front() );
+        _queue.pop_front();
+        _cursor = 0;
+        _cv.notify_all();
+    }
+
+    const float* sample = _current.values.data() + _cursor * _dim;
+    std::copy( sample, sample + _dim, out );
+    label = _current.labels[_cursor];
+    _cursor++;
+    return true;
+}
+
+
+bool StreamingDataset::next_batch( size_t size, Matrix& input, std::vector< int >& labels ) {
+
+    if ( input.rows != _dim || input.cols != size ) {
+        input = Matrix( _dim, size );
+    }
+
+    labels.resize( size );
+
+    for ( size_t j = 0; j < size; j++ ) {
+
+        // Keep the buffer full, then hand out a random sample from it
+        while ( _buffered < _capacity &&
+                pull_sample( _buffer.data() + _buffered * _dim, _buffer_labels[_buffered] ) ) {
+            _buffered++;
+        }
+
+        if ( _buffered == 0 ) {
+            return false;
+        }
+
+        size_t pick = std::uniform_int_distribution< size_t >( 0, _buffered - 1 )( _gen );
+        const float* sample = _buffer.data() + pick * _dim;
+
+        if ( _normalization.empty() ) {
+            std::copy( sample, sample + _dim, input.column( j ) );
+        }
+        else {
+            _normalization.apply( sample, input.column( j ) );
+        }
+        labels[j] = _buffer_labels[pick];
+
+        // Move the last buffered sample into the freed slot
+        _buffered--;
+        std::copy( _buffer.data() + _buffered * _dim, _buffer.data() + ( _buffered + 1 ) * _dim,
+                   _buffer.data() + pick * _dim );
+        _buffer_labels[pick] = _buffer_labels[_buffered];
+    }
+
+    return true;
+}
@@ -0,0 +1,211 @@
+#include "sweep.hpp"
+#include "optimizer.hpp"
+#include "tasks.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+
+
+std::vector< TrialConfig > sample_trials( size_t count, uint64_t seed ) {
+
+    RandomStream gen( seed, 0 );
+
+    const size_t batch_sizes[] = { 32, 64, 128 };
+    const size_t hidden_sizes[] = { 128, 256, 512 };
+    const float beta2s[] = { 0.99, 0.999 };
+
+    std::vector< TrialConfig > res( count );
+    for ( auto& trial : res ) {
+        trial.lr = std::pow( 10.f, -4.f + 2.f * gen.uniform() );
+        trial.beta1 = 0.8f + 0.15f * gen.uniform();
+        trial.beta2 = beta2s[gen() % 2];
+        trial.batch_size = batch_sizes[gen() % 3];
+        trial.hidden = hidden_sizes[gen() % 3];
+    }
+
+    return res;
+}
+
+
+// Accuracy and mean loss on the validation samples
+static void score( NeuralNet& net, const Matrix& data, const std::vector< int >& labels, TrialResult& result ) {
+
+    size_t hits = 0;
+    double loss = 0.0;
+    size_t batch = 1024;
+
+    net.evaluation();
+    for ( size_t col = 0; col < data.cols; col += batch ) {
+        size_t count = std::min( batch, data.cols - col );
+        Matrix logits = net.forward( data.col_range( col, count ) );
+        auto preds = predictions( logits );
+
+        std::vector< int > batch_labels( labels.begin() + col, labels.begin() + col + count );
+        Matrix derivatives;
+        loss += cross_entropy_loss( logits, batch_labels, derivatives );
+
+        for ( size_t i = 0; i < count; i++ ) {
+            hits += ( preds[i] == size_t( batch_labels[i] ) );
+        }
+    }
+
+    result.accuracy = data.cols == 0 ? 0.f : float( hits ) / data.cols;
+    result.loss = data.cols == 0 ? 0.f : loss / data.cols;
+}
+
+
+// Better validation accuracy, ties broken by the loss
+static bool better( const TrialResult& a, const TrialResult& b ) {
+    if ( a.accuracy != b.accuracy ) {
+        return a.accuracy > b.accuracy;
+    }
+    return a.loss < b.loss;
+}
+
+
+// A trial in progress, the net is released once the trial is stopped
+struct Trial {
+    std::unique_ptr< NeuralNet > net;
+    std::unique_ptr< AdamOptimizer > optimizer;
+    std::unique_ptr< Trainer > trainer;
+    TrialResult result;
+};
+
+
+std::vector< TrialResult > run_sweep( std::shared_ptr< const Dataset > train,
+                                      const Matrix& validation, const std::vector< int >& validation_labels,
+                                      const std::vector< TrialConfig >& trials, const SweepConfig& config ) {
+
+    if ( train->vectors.empty() || trials.empty() ) {
+        return {};
+    }
+
+    size_t input_dim = train->vectors[0].size();
+    size_t classes = *std::max_element( train->labels.begin(), train->labels.end() ) + 1;
+
+    // Built one after another, so the initial weights do not depend on
+    // the scheduling of the threads
+    std::vector< Trial > state( trials.size() );
+    for ( size_t i = 0; i < trials.size(); i++ ) {
+        const TrialConfig& c = trials[i];
+
+        auto layers = { std::make_shared< LinearLayer >( input_dim, c.hidden, "relu", "he" ),
+                        std::make_shared< LinearLayer >( c.hidden, classes, "id", "he" ) };
+
+        state[i].net = std::make_unique< NeuralNet >( std::move( layers ) );
+        state[i].optimizer = std::make_unique< AdamOptimizer >( state[i].net.get(), c.lr, c.beta1, c.beta2 );
+        state[i].trainer = std::make_unique< Trainer >( state[i].net.get(), state[i].optimizer.get(), train );
+        state[i].trainer->set_shuffle_stream( i );
+        state[i].trainer->set_verbose( false );
+        state[i].result.config = c;
+    }
+
+    std::vector< size_t > alive( trials.size() );
+    std::iota( alive.begin(), alive.end(), 0 );
+
+    TaskPool pool( config.threads );
+    size_t eta = std::max< size_t >( 2, config.eta );
+    size_t budget = std::min( std::max< size_t >( 1, config.min_epochs ), config.max_epochs );
+
+    while ( true ) {
+
+        for ( size_t i : alive ) {
+            pool.submit( [&, i](){
+                Trial& trial = state[i];
+                auto start = std::chrono::steady_clock::now();
+
+                trial.net->training();
+                trial.trainer->train( budget - trial.result.epochs, trial.result.config.batch_size );
+                trial.result.epochs = budget;
+                trial.result.train_loss = trial.trainer->epoch_loss();
+                score( *trial.net, validation, validation_labels, trial.result );
+
+                trial.result.seconds += std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+            } );
+        }
+
+        pool.wait();
+
+        std::stable_sort( alive.begin(), alive.end(), [&]( size_t a, size_t b ){
+            return better( state[a].result, state[b].result );
+        } );
+
+        std::cout << "Rung of " << budget << " epochs: " << alive.size() << " trials, best accuracy "
+                  << state[alive[0]].result.accuracy << "\n";
+
+        if ( budget >= config.max_epochs ) {
+            break;
+        }
+
+        size_t keep = std::max< size_t >( 1, alive.size() / eta );
+        for ( size_t j = keep; j < alive.size(); j++ ) {
+            Trial& trial = state[alive[j]];
+            trial.result.stopped = true;
+            trial.trainer.reset();
+            trial.optimizer.reset();
+            trial.net.reset();
+        }
+
+        alive.resize( keep );
+        budget = std::min( budget * eta, config.max_epochs );
+    }
+
+    std::vector< TrialResult > res;
+    for ( auto& trial : state ) {
+        res.push_back( trial.result );
+    }
+
+    return res;
+}
+
+
+void print_sweep( const std::vector< TrialResult >& results ) {
+
+    std::vector< size_t > order( results.size() );
+    std::iota( order.begin(), order.end(), 0 );
+
+    // Trials that got further first, then by score
+    std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        if ( results[a].epochs != results[b].epochs ) {
+            return results[a].epochs > results[b].epochs;
+        }
+        return better( results[a], results[b] );
+    } );
+
+    std::cout << "trial         lr   beta1   beta2  batch  hidden  epochs  train loss  val loss  accuracy    time  status\n";
+    for ( size_t i : order ) {
+        const TrialResult& r = results[i];
+        std::cout << std::setw( 5 ) << i << "  " << std::setw( 9 ) << std::setprecision( 3 ) << r.config.lr
+                  << "  " << std::setw( 6 ) << r.config.beta1 << "  " << std::setw( 6 ) << std::setprecision( 4 ) << r.config.beta2
+                  << "  " << std::setw( 5 ) << r.config.batch_size << "  " << std::setw( 6 ) << r.config.hidden
+                  << "  " << std::setw( 6 ) << r.epochs << "  " << std::setw( 10 ) << std::setprecision( 3 ) << r.train_loss
+                  << "  " << std::setw( 8 ) << r.loss
+                  << "  " << std::setw( 8 ) << std::setprecision( 4 ) << r.accuracy
+                  << "  " << std::setw( 5 ) << std::setprecision( 3 ) << r.seconds << "s"
+                  << "  " << ( r.stopped ? "stopped" : "finished" ) << "\n";
+    }
+
+    std::cout << std::setprecision( 6 );
+}
+
+
+bool write_sweep_csv( const std::vector< TrialResult >& results, const std::string& path ) {
+
+    std::ofstream f( path );
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    f << "trial,lr,beta1,beta2,batch_size,hidden,epochs,train_loss,loss,accuracy,seconds,stopped\n";
+    for ( size_t i = 0; i < results.size(); i++ ) {
+        const TrialResult& r = results[i];
+        f << i << "," << r.config.lr << "," << r.config.beta1 << "," << r.config.beta2 << ","
+          << r.config.batch_size << "," << r.config.hidden << "," << r.epochs << "," << r.train_loss << ","
+          << r.loss << "," << r.accuracy << "," << r.seconds << "," << r.stopped << "\n";
+    }
+
+    return f.good();
+}
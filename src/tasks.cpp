@@ -0,0 +1,153 @@
+#include "tasks.hpp"
+
+
+// Pool and index of the worker running on this thread (nullptr outside
+// of workers), a worker submitting to another pool is spread round robin
+static thread_local const TaskPool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+
+TaskPool::TaskPool( size_t threads ) {
+
+    if ( threads == 0 ) {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
+    for ( size_t i = 0; i < threads; i++ ) {
+        _queues.emplace_back( std::make_unique< Queue >() );
+    }
+
+    for ( size_t i = 0; i < threads; i++ ) {
+        _workers.emplace_back( &TaskPool::work, this, i );
+    }
+}
+
+
+TaskPool::~TaskPool() {
+
+    wait();
+
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _stop = true;
+    }
+
+    _cv.notify_all();
+    for ( auto& worker : _workers ) {
+        worker.join();
+    }
+}
+
+
+size_t TaskPool::threads() const {
+    return _workers.size();
+}
+
+
+void TaskPool::submit( Task&& task ) {
+
+    size_t id = current_pool == this ? current_worker
+                                     : _next_queue.fetch_add( 1, std::memory_order_relaxed ) % _queues.size();
+
+    _pending.fetch_add( 1 );
+    {
+        std::lock_guard< std::mutex > lock( _queues[id]->mutex );
+        _queues[id]->tasks.push_back( std::move( task ) );
+    }
+
+    // Taking the lock orders the push before a worker going to sleep
+    { std::lock_guard< std::mutex > lock( _mutex ); }
+    _cv.notify_one();
+}
+
+
+bool TaskPool::take( size_t id, Task& task ) {
+
+    {
+        Queue& own = *_queues[id];
+        std::lock_guard< std::mutex > lock( own.mutex );
+        if ( !own.tasks.empty() ) {
+            task = std::move( own.tasks.back() );
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for ( size_t i = 1; i < _queues.size(); i++ ) {
+        Queue& victim = *_queues[( id + i ) % _queues.size()];
+        std::lock_guard< std::mutex > lock( victim.mutex );
+        if ( !victim.tasks.empty() ) {
+            task = std::move( victim.tasks.front() );
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void TaskPool::finish() {
+    if ( _pending.fetch_sub( 1 ) == 1 ) {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _done_cv.notify_all();
+    }
+}
+
+
+void TaskPool::work( size_t id ) {
+
+    current_pool = this;
+    current_worker = id;
+
+    Task task;
+    while ( true ) {
+        if ( take( id, task ) ) {
+            task();
+            task = nullptr;
+            finish();
+            continue;
+        }
+
+        std::unique_lock< std::mutex > lock( _mutex );
+        _cv.wait( lock, [&](){
+            if ( _stop ) {
+                return true;
+            }
+
+            // Queued tasks, as opposed to running ones
+            for ( auto& queue : _queues ) {
+                std::lock_guard< std::mutex > queue_lock( queue->mutex );
+                if ( !queue->tasks.empty() ) {
+                    return true;
+                }
+            }
+
+            return false;
+        } );
+
+        if ( _stop ) {
+            return;
+        }
+    }
+}
+
+
+void TaskPool::wait() {
+
+    // Help with the queued tasks, then wait for the running ones
+    size_t id = current_pool == this ? current_worker : 0;
+
+    Task task;
+    while ( _pending.load() > 0 ) {
+        if ( take( id, task ) ) {
+            task();
+            task = nullptr;
+            finish();
+            continue;
+        }
+
+        std::unique_lock< std::mutex > lock( _mutex );
+        _done_cv.wait( lock, [&](){ return _pending.load() == 0; } );
+    }
+}
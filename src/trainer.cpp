@@ -1,25 +1,289 @@
 #include "trainer.hpp"
 #include "model.hpp"
+#include "checkpoint.hpp"
+#include "distill.hpp"
+#include "distributed.hpp"
+#include "memory.hpp"
+
+#include <numeric>
+
+
+// Dataset accounted by the memory tracker as one block while it lives
+static std::shared_ptr< const Dataset > tracked_dataset( Dataset&& data ) {
+
+    size_t bytes = data.labels.capacity() * sizeof( int );
+    for ( auto& vector : data.vectors ) {
+        bytes += vector.capacity() * sizeof( float );
+    }
+
+    const Dataset* res = new Dataset( std::move( data ) );
+
+    MemoryScope scope( MemoryCategory::dataset );
+    memory_tracker.track( res, bytes );
+
+    return std::shared_ptr< const Dataset >( res, []( const Dataset* d ){
+        memory_tracker.untrack( d );
+        delete d;
+    } );
+}
 
 
 Trainer::Trainer( NeuralNet *m, AdamOptimizer *opt, 
                   std::vector< std::vector< float > > d, 
-                  std::vector< int > l ) : model(m), optimizer(opt), data(d), labels(l) {
-    for ( size_t i = 0; i < data.size(); i++ ) {
-        dataset.emplace_back( std::make_pair( data[i], labels[i]) );
+                  std::vector< int > l ) : Trainer( m, opt, tracked_dataset(
+                                                                  Dataset{ std::move( d ), std::move( l ) } ) ) {}
+
+
+Trainer::Trainer( NeuralNet *m, AdamOptimizer *opt,
+                  std::shared_ptr< const Dataset > data ) : model(m), optimizer(opt), dataset( std::move( data ) ) {
+    order.resize( dataset->vectors.size() );
+    std::iota( order.begin(), order.end(), 0 );
+}
+
+
+Trainer::Trainer( NeuralNet *m, AdamOptimizer *opt, StreamingDataset *data ) : model(m), optimizer(opt), stream(data) {}
+
+
+void Trainer::set_shuffle_stream( uint64_t index ) {
+    gen = rng.stream( TRAINER_STREAM + index );
+}
+
+
+void Trainer::set_sparse_inputs( bool sparse ) {
+    sparse_inputs = sparse;
+}
+
+
+void Trainer::set_normalization( const Normalization& norm ) {
+    normalization = norm;
+    if ( stream ) {
+        stream->set_normalization( norm );
+    }
+}
+
+
+void Trainer::set_pruning( const PruningSchedule& schedule ) {
+    pruning = true;
+    pruning_schedule = schedule;
+}
+
+
+bool Trainer::set_overlapped_updates( bool overlap, size_t threads ) {
+
+    update_pool.reset();
+    layer_params.clear();
+
+    if ( !overlap ) {
+        return true;
+    }
+
+    // Parameters of the optimizer go layer by layer as in NeuralNet::params()
+    size_t param = 0;
+    for ( auto& layer : model->layers() ) {
+        layer_params.emplace_back();
+        for ( Matrix* p : layer->get_params() ) {
+            if ( param >= optimizer->size() || &optimizer->param( param ) != p ) {
+                std::cout << "Optimizer does not match the model, updates are not overlapped\n";
+                layer_params.clear();
+                return false;
+            }
+            layer_params.back().push_back( param++ );
+        }
+    }
+
+    if ( param != optimizer->size() ) {
+        std::cout << "Optimizer does not match the model, updates are not overlapped\n";
+        layer_params.clear();
+        return false;
+    }
+
+    update_pool = std::make_unique< TaskPool >( threads );
+    return true;
+}
+
+
+bool Trainer::backward_and_step( Matrix&& derivatives ) {
+
+    // Stepping on local gradients only would make the ranks diverge
+    if ( gradient_sync ) {
+        model->backward( std::move( derivatives ) );
+        if ( !gradient_sync->average( model->grads() ) ) {
+            return false;
+        }
+        optimizer->step();
+        return true;
+    }
+
+    if ( !update_pool ) {
+        model->backward( std::move( derivatives ) );
+        optimizer->step();
+        return true;
+    }
+
+    optimizer->begin_step();
+
+    // Large parameters are split by columns for more parallel slack
+    const size_t task_size = AdamOptimizer::task_size;
+
+    model->backward( std::move( derivatives ), [&]( size_t layer ){
+        for ( size_t param : layer_params[layer] ) {
+            const Matrix& p = optimizer->param( param );
+            size_t step = std::max< size_t >( 1, task_size / std::max< size_t >( 1, p.rows ) );
+
+            for ( size_t col = 0; col < p.cols; col += step ) {
+                size_t end = std::min( col + step, p.cols );
+                update_pool->submit( [this, param, col, end](){ optimizer->update( param, col, end ); } );
+            }
+        }
+    } );
+
+    update_pool->wait();
+    return true;
+}
+
+
+void Trainer::set_gradient_sync( RingAllReduce *sync ) {
+    gradient_sync = sync;
+}
+
+
+void Trainer::set_validation( BackgroundValidator *v, const EarlyStopping& stopping ) {
+    validator = v;
+    early_stopping = stopping;
+}
+
+
+bool Trainer::set_distillation( std::shared_ptr< const SoftTargets > targets, float alpha ) {
+
+    if ( targets && ( stream || !dataset || targets->samples() != dataset->vectors.size() ) ) {
+        std::cout << "Soft targets do not match the training data, not distilling\n";
+        return false;
+    }
+
+    soft_targets = std::move( targets );
+    distillation_alpha = alpha;
+    return true;
+}
+
+
+void Trainer::set_verbose( bool v ) {
+    verbose = v;
+}
+
+
+float Trainer::epoch_loss() const {
+    return last_loss;
+}
+
+
+void Trainer::finish_validation() {
+
+    validator->wait();
+
+    if ( early_stopping.patience == 0 || !early_stopping.restore_best ) {
+        return;
+    }
+
+    std::vector< LayerParams > best = validator->best();
+    if ( best.size() != model->layers().size() ) {
+        return;
+    }
+
+    for ( size_t i = 0; i < best.size(); i++ ) {
+        auto& layer = model->layers()[i];
+        layer->_weights = std::move( best[i].weights );
+        if ( layer->has_bias ) {
+            layer->_bias = std::move( best[i].bias );
+        }
+    }
+
+    if ( verbose ) {
+        std::cout << "Restored the weights of epoch #" << validator->best_epoch() << "\n";
+    }
+}
+
+
+void Trainer::start_epoch() {
+
+    if ( stream ) {
+        stream->start_epoch();
+        return;
+    }
+
+    std::shuffle( order.begin(), order.end(), gen );
+    position = 0;
+}
+
+
+bool Trainer::forward_batch( size_t size, Matrix& logits, std::vector< int >& label_batch ) {
+
+    // Make a batch of vectors, one sample per column, pass it into model and
+    // get its predictions
+    MemoryScope scope( MemoryCategory::activations );
+    Matrix input;
+
+    if ( stream ) {
+        if ( !stream->next_batch( size, input, label_batch ) ) {
+            return false;
+        }
+    }
+    else {
+        if ( position + size >= order.size() ) {
+            return false;
+        }
+
+        auto sample = [&]( size_t j ) -> const std::vector< float >& {
+            return dataset->vectors[order[position+j]];
+        };
+
+        label_batch.clear();
+        batch_indices.clear();
+        for ( size_t j = 0; j < size; j++ ){
+            label_batch.push_back( dataset->labels[order[position+j]] );
+            batch_indices.push_back( order[position+j] );
+        }
+
+        // Normalized inputs are rarely sparse, those take the dense path
+        if ( sparse_inputs && normalization.empty() ) {
+            SparseMatrix sparse( sample( 0 ).size() );
+            for ( size_t j = 0; j < size; j++ ){
+                sparse.append_sample( sample( j ).data(), sample( j ).size() );
+            }
+
+            position += size;
+            logits = model->forward( std::move(sparse) );
+            return true;
+        }
+
+        input = Matrix( sample( 0 ).size(), size );
+        for ( size_t j = 0; j < size; j++ ){
+            std::copy( sample( j ).begin(), sample( j ).end(), input.column( j ) );
+        }
+
+        if ( !normalization.empty() ) {
+            normalization.apply( input );
+        }
+
+        position += size;
     }
+
+    // Only raw streamed batches get here sparse, normalized ones stay dense
+    bool sparse = sparse_inputs && stream && !stream->normalized();
+    logits = sparse ? model->forward( SparseMatrix::from_dense( input ) )
+                    : model->forward( std::move(input) );
+    return true;
 }
 
 
-void Trainer::train( size_t epochs, size_t batch_size ) {
+bool Trainer::train( size_t epochs, size_t batch_size, size_t accumulation_steps ) {
 
-    // Reseed RNG to get deterministic shuffling during training
-    gen.seed( 42 );
+    accumulation_steps = std::max( accumulation_steps, size_t( 1 ) );
 
     auto train_start = std::chrono::high_resolution_clock::now();
     auto epoch_start = std::chrono::high_resolution_clock::now();
     auto epoch_end = std::chrono::high_resolution_clock::now();
 
+    bool synced = true;
     for ( size_t i = 0; i < epochs; i++ ) {
 
         epoch_start = std::chrono::high_resolution_clock::now();
@@ -27,51 +291,137 @@ void Trainer::train( size_t epochs, size_t batch_size ) {
         float total_l = 0;
         float total_samples = 0;
         float accuracy = 0;
+        size_t steps = 0;
+
+        start_epoch();
+
+        if ( pruning ) {
+            float sparsity = pruning_schedule.sparsity_at( i );
+            for ( auto& layer : model->layers() ) {
+                prune_layer( *layer, sparsity, pruning_schedule.block_rows );
+            }
 
-        std::shuffle( dataset.begin(), dataset.end(), gen );
+            if ( verbose ) {
+                std::cout << "   Pruned to sparsity " << sparsity << "\n";
+            }
+        }
 
-        for ( size_t sample = 0; sample < dataset.size() - batch_size; sample += batch_size ){
+        // A step whose micro-batches run out of data is dropped
+        bool more = true;
+        while ( more ) {
 
-            total_samples += batch_size;
+            for ( size_t micro = 0; micro < accumulation_steps; micro++ ){
 
-            std::vector< float > batch;
-            std::vector< int > label_batch;
+                Matrix logits;
+                std::vector< int > label_batch;
+                if ( !forward_batch( batch_size, logits, label_batch ) ) {
+                    more = false;
+                    break;
+                }
 
-            // Make a batch of vectors and labels
-            for ( size_t j = 0; j < batch_size; j++ ){
-                batch.insert( batch.end(), dataset[sample+j].first.begin(), dataset[sample+j].first.end() );
-                label_batch.push_back( dataset[sample+j].second );
+                total_samples += batch_size;
+                auto preds = predictions( logits );
 
-            }
+                // Calculate accuracy (on training set)
+                for ( size_t pred_i = 0; pred_i < preds.size(); pred_i++ ) {
+                    if ( preds[pred_i] == size_t( label_batch[pred_i] ) ){ accuracy += 1; }
+                }
 
-            // Pass matrix into model, get its predictions
-            Matrix input( batch, dataset[sample].first.size(), batch_size );
-            Matrix logits = model->forward( std::move(input) );
-            auto preds = predictions( logits );
 
-            // Calculate accuracy (on training set)
-            for ( size_t pred_i = 0; pred_i < preds.size(); pred_i++ ) {
-                if ( preds[pred_i] == label_batch[pred_i] ){ accuracy += 1; }
-            }
+                // Calculate loss_derivatives of softmax+CE, backprop. The
+                // derivatives are means over the micro-batch, scaling them
+                // makes the summed gradients a mean over the whole step.
+                Matrix loss_derivatives;
+                {
+                    MemoryScope scope( MemoryCategory::gradients );
 
+                    if ( soft_targets ) {
+                        Matrix soft( soft_targets->classes, label_batch.size() );
+                        soft_targets->gather( batch_indices, soft );
+                        total_l += distillation_loss( logits, label_batch, soft, soft_targets->temperature,
+                                                      distillation_alpha, loss_derivatives );
+                    }
+                    else {
+                        total_l += cross_entropy_loss( logits, label_batch, loss_derivatives );
+                    }
+                }
+                if ( accumulation_steps > 1 ) {
+                    loss_derivatives.multiply_scalar( 1.f / accumulation_steps );
+                }
+
+                model->accumulate_gradients( micro > 0 );
+
+                // Take one step of GD after the last micro-batch
+                if ( micro + 1 == accumulation_steps ) {
+                    if ( !backward_and_step( std::move(loss_derivatives) ) ) {
+                        std::cout << "Averaging gradients with the other ranks failed, training stopped\n";
+                        synced = false;
+                        more = false;
+                        break;
+                    }
+                    steps++;
+                    memory_tracker.end_step();
+                }
+                else {
+                    model->backward( std::move(loss_derivatives) );
+                }
+            }
+        }
 
-            // Calculate loss_derivatives of softmax+CE, backprop
-            Matrix loss_derivatives;
-            total_l += cross_entropy_loss( logits, label_batch, loss_derivatives );
-            model->backward( std::move(loss_derivatives) );
+        model->accumulate_gradients( false );
 
-            // Take one step of GD
-            optimizer->step();
+        if ( !synced ) {
+            break;
         }
 
         epoch_end = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::seconds>(epoch_end - epoch_start).count();
 
-        std::cout << "[Epoch: " << i + 1 << " / " << epochs << "; TIME: " << duration << " seconds.]\n";
-        std::cout << "   Loss in epoch #" << i << " : " << total_l << "\n";
-        std::cout << "   Accuracy in epoch #" << i << " : " << accuracy / (total_samples) << "\n";
+        last_loss = total_samples > 0 ? total_l / total_samples : 0.f;
+
+        // Evaluated in the background, results of earlier epochs decide
+        // about stopping
+        bool stop = false;
+        if ( validator ) {
+            validator->submit( i, ::layer_params( *model ) );
+            stop = validator->should_stop( early_stopping );
+        }
+
+        if ( verbose ) {
+            std::cout << "[Epoch: " << i + 1 << " / " << epochs << "; TIME: " << duration << " seconds.]\n";
+            std::cout << "   Loss in epoch #" << i << " : " << total_l << "\n";
+            std::cout << "   Accuracy in epoch #" << i << " : " << accuracy / (total_samples) << "\n";
+            if ( accumulation_steps > 1 ) {
+                std::cout << "   Optimizer steps in epoch #" << i << " : " << steps << "\n";
+            }
+        }
+
+        if ( stop ) {
+            if ( verbose ) {
+                std::cout << "Validation loss stopped improving, stopping early\n";
+            }
+            break;
+        }
+    }
+
+    if ( validator ) {
+        finish_validation();
+    }
+
+    if ( !synced ) {
+        return false;
+    }
+
+    if ( !verbose ) {
+        return true;
     }
 
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(epoch_end - train_start).count();
     std::cout << "Training finished, total time: " << duration << ".\n";
+
+    if ( model->recomputing() ) {
+        model->recompute_stats().print();
+    }
+
+    return true;
 }
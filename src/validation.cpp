@@ -0,0 +1,166 @@
+#include "validation.hpp"
+#include "optimizer.hpp"
+
+#include <chrono>
+#include <sstream>
+
+
+BackgroundValidator::BackgroundValidator( ConstMatrixView samples, std::vector< int > labels,
+                                          const Normalization& norm, size_t batch )
+                                        : _data( samples ), _labels( std::move( labels ) ),
+                                          _batch( std::max< size_t >( 1, batch ) ) {
+    if ( !norm.empty() ) {
+        norm.apply( _data );
+    }
+
+    _worker = std::thread( &BackgroundValidator::work, this );
+}
+
+
+BackgroundValidator::~BackgroundValidator() {
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _stop = true;
+    }
+
+    _cv.notify_all();
+    _worker.join();
+}
+
+
+void BackgroundValidator::submit( size_t epoch, std::vector< LayerParams >&& snapshot ) {
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        _queue.emplace_back( epoch, std::move( snapshot ) );
+    }
+
+    _cv.notify_all();
+}
+
+
+void BackgroundValidator::wait() {
+    std::unique_lock< std::mutex > lock( _mutex );
+    _cv.wait( lock, [&](){ return _queue.empty() && !_busy; } );
+}
+
+
+void BackgroundValidator::work() {
+
+    std::unique_lock< std::mutex > lock( _mutex );
+
+    while ( true ) {
+        _cv.wait( lock, [&](){ return _stop || !_queue.empty(); } );
+        if ( _queue.empty() ) {
+            return;
+        }
+
+        auto [epoch, snapshot] = std::move( _queue.front() );
+        _queue.pop_front();
+        _busy = true;
+
+        lock.unlock();
+        ValidationPoint point = evaluate( epoch, snapshot );
+
+        std::ostringstream line;
+        line << "   Validation after epoch #" << epoch << " : loss " << point.loss
+             << ", accuracy " << point.accuracy << "\n";
+        std::cout << line.str();
+
+        lock.lock();
+
+        if ( _curve.empty() || point.loss < _curve[_best_index].loss ) {
+            _best_index = _curve.size();
+            _best = std::move( snapshot );
+        }
+
+        _curve.push_back( point );
+        _busy = false;
+        _cv.notify_all();
+    }
+}
+
+
+ValidationPoint BackgroundValidator::evaluate( size_t epoch, std::vector< LayerParams > snapshot ) const {
+
+    auto start = std::chrono::steady_clock::now();
+
+    NeuralNet net = from_layer_params( std::move( snapshot ) );
+    net.evaluation();
+
+    size_t hits = 0;
+    double loss = 0.0;
+
+    for ( size_t col = 0; col < _data.cols; col += _batch ) {
+        size_t count = std::min( _batch, _data.cols - col );
+        Matrix logits = net.forward( _data.col_range( col, count ) );
+        auto preds = predictions( logits );
+
+        std::vector< int > labels( _labels.begin() + col, _labels.begin() + col + count );
+        Matrix derivatives;
+        loss += cross_entropy_loss( logits, labels, derivatives );
+
+        for ( size_t i = 0; i < count; i++ ) {
+            hits += ( preds[i] == size_t( labels[i] ) );
+        }
+    }
+
+    float samples = std::max< size_t >( 1, _data.cols );
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    return { epoch, float( loss / samples ), hits / samples, seconds };
+}
+
+
+std::vector< ValidationPoint > BackgroundValidator::curve() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _curve;
+}
+
+
+bool BackgroundValidator::should_stop( const EarlyStopping& early_stopping ) const {
+
+    if ( early_stopping.patience == 0 ) {
+        return false;
+    }
+
+    std::lock_guard< std::mutex > lock( _mutex );
+
+    // Epochs since the last improvement by more than `min_delta`
+    size_t best = 0;
+    for ( size_t i = 1; i < _curve.size(); i++ ) {
+        if ( _curve[i].loss < _curve[best].loss - early_stopping.min_delta ) {
+            best = i;
+        }
+    }
+
+    return _curve.size() > best + early_stopping.patience;
+}
+
+
+std::vector< LayerParams > BackgroundValidator::best() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _best;
+}
+
+
+size_t BackgroundValidator::best_epoch() const {
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _curve.empty() ? 0 : _curve[_best_index].epoch;
+}
+
+
+bool BackgroundValidator::write_csv( const std::string& path ) const {
+
+    std::ofstream f( path );
+    if ( !f.is_open() ) {
+        std::cout << "Cannot open file " << path << "\n";
+        return false;
+    }
+
+    f << "epoch,loss,accuracy,seconds\n";
+    for ( auto& point : curve() ) {
+        f << point.epoch << "," << point.loss << "," << point.accuracy << "," << point.seconds << "\n";
+    }
+
+    return f.good();
+}